@@ -54,6 +54,7 @@ build() {
         -Wall
         -Wextra
         -Wpedantic
+        -pthread
     )
 
     "$compiler" "${flags[@]}" ${CXXFLAGS:-} "$source_file" -o "$temp_output" ${LDFLAGS:-}
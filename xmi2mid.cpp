@@ -34,19 +34,59 @@
 
 #include "xmi2mid.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
 #include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <csignal>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/io_uring.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
 namespace
 {
 std::vector<std::uint8_t> read_file(const std::filesystem::path& path)
@@ -72,8 +112,97 @@ std::vector<std::uint8_t> read_file(const std::filesystem::path& path)
     return bytes;
 }
 
+// Reads at most `limit` bytes from the start of a file.
+std::vector<std::uint8_t> read_file_prefix(const std::filesystem::path& path, std::size_t limit)
+{
+    std::vector<std::uint8_t> bytes(limit);
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open input file " + path.string());
+    }
+
+    file.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    if (file.bad())
+    {
+        throw std::runtime_error("Cannot read input file " + path.string());
+    }
+    bytes.resize(static_cast<std::size_t>(file.gcount()));
+    return bytes;
+}
+
+// A whole input file, memory-mapped read-only where the platform allows and
+// read into memory elsewhere.
+class mapped_file
+{
+public:
+    explicit mapped_file(const std::filesystem::path& path)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        const int descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (descriptor < 0)
+        {
+            throw std::runtime_error("Cannot open input file " + path.string());
+        }
+
+        struct stat status{};
+        if (::fstat(descriptor, &status) != 0)
+        {
+            ::close(descriptor);
+            throw std::runtime_error("Cannot read input file " + path.string());
+        }
+
+        size_ = static_cast<std::size_t>(status.st_size);
+        void* const address = size_ == 0 ? nullptr : ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        ::close(descriptor);
+        if (address == MAP_FAILED)
+        {
+            throw std::runtime_error("Cannot map input file " + path.string());
+        }
+        data_ = static_cast<const std::uint8_t*>(address);
+#else
+        bytes_ = read_file(path);
+        data_ = bytes_.data();
+        size_ = bytes_.size();
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (data_ != nullptr)
+        {
+            ::munmap(const_cast<std::uint8_t*>(data_), size_);
+        }
+#endif
+    }
+
+    std::span<const std::uint8_t> bytes() const
+    {
+        return {data_, size_};
+    }
+
+private:
+    const std::uint8_t* data_ = nullptr;
+    std::size_t size_ = 0;
+#if !defined(__unix__) && !defined(__APPLE__)
+    std::vector<std::uint8_t> bytes_;
+#endif
+};
+
 void write_file(const std::filesystem::path& path, std::span<const std::uint8_t> bytes)
 {
+    // Outputs may be hard links into the conversion cache; replace the link
+    // instead of writing through it.
+    std::error_code error;
+    if (std::filesystem::hard_link_count(path, error) > 1)
+    {
+        std::filesystem::remove(path, error);
+    }
+
     std::ofstream file(path, std::ios::binary);
     if (!file)
     {
@@ -81,169 +210,4517 @@ void write_file(const std::filesystem::path& path, std::span<const std::uint8_t>
     }
 
     file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    file.close();
     if (!file)
     {
         throw std::runtime_error("Cannot write output file " + path.string());
     }
 }
 
-std::size_t parse_sequence_index(std::string_view text)
+std::uint64_t read_le64(const std::uint8_t* bytes)
 {
-    if (text.empty())
+    std::uint64_t value = 0;
+    for (int i = 7; i >= 0; --i)
     {
-        throw std::runtime_error("Missing sequence index");
+        value = (value << 8) | bytes[i];
     }
+    return value;
+}
 
-    std::size_t value = 0;
-    for (const char ch : text)
+std::uint32_t read_le32(const std::uint8_t* bytes)
+{
+    return static_cast<std::uint32_t>(bytes[0]) | (static_cast<std::uint32_t>(bytes[1]) << 8) |
+           (static_cast<std::uint32_t>(bytes[2]) << 16) | (static_cast<std::uint32_t>(bytes[3]) << 24);
+}
+
+std::uint64_t rotate_left(std::uint64_t value, int count)
+{
+    return (value << count) | (value >> (64 - count));
+}
+
+// XXH64: a fast non-cryptographic 64-bit hash used for cache keys.
+std::uint64_t hash_bytes(std::span<const std::uint8_t> bytes, std::uint64_t seed = 0)
+{
+    constexpr std::uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+    constexpr std::uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr std::uint64_t Prime3 = 0x165667B19E3779F9ULL;
+    constexpr std::uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr std::uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+    auto round = [](std::uint64_t accumulator, std::uint64_t lane)
     {
-        if (ch < '0' || ch > '9')
-        {
-            throw std::runtime_error("Invalid sequence index " + std::string(text));
-        }
+        accumulator += lane * Prime2;
+        accumulator = rotate_left(accumulator, 31);
+        return accumulator * Prime1;
+    };
 
-        const std::size_t digit = static_cast<std::size_t>(ch - '0');
-        if (value > (std::numeric_limits<std::size_t>::max() - digit) / 10)
+    auto merge_round = [&](std::uint64_t accumulator, std::uint64_t value)
+    {
+        accumulator ^= round(0, value);
+        return (accumulator * Prime1) + Prime4;
+    };
+
+    const std::uint8_t* cursor = bytes.data();
+    const std::uint8_t* const end = cursor + bytes.size();
+    std::uint64_t hash = 0;
+
+    if (bytes.size() >= 32)
+    {
+        std::uint64_t v1 = seed + Prime1 + Prime2;
+        std::uint64_t v2 = seed + Prime2;
+        std::uint64_t v3 = seed;
+        std::uint64_t v4 = seed - Prime1;
+        const std::uint8_t* const limit = end - 32;
+        do
         {
-            throw std::runtime_error("Sequence index is too large");
+            v1 = round(v1, read_le64(cursor));
+            v2 = round(v2, read_le64(cursor + 8));
+            v3 = round(v3, read_le64(cursor + 16));
+            v4 = round(v4, read_le64(cursor + 24));
+            cursor += 32;
         }
-        value = (value * 10) + digit;
+        while (cursor <= limit);
+
+        hash = rotate_left(v1, 1) + rotate_left(v2, 7) + rotate_left(v3, 12) + rotate_left(v4, 18);
+        hash = merge_round(hash, v1);
+        hash = merge_round(hash, v2);
+        hash = merge_round(hash, v3);
+        hash = merge_round(hash, v4);
     }
-    return value;
+    else
+    {
+        hash = seed + Prime5;
+    }
+
+    hash += static_cast<std::uint64_t>(bytes.size());
+
+    while (end - cursor >= 8)
+    {
+        hash ^= round(0, read_le64(cursor));
+        hash = (rotate_left(hash, 27) * Prime1) + Prime4;
+        cursor += 8;
+    }
+
+    if (end - cursor >= 4)
+    {
+        hash ^= static_cast<std::uint64_t>(read_le32(cursor)) * Prime1;
+        hash = (rotate_left(hash, 23) * Prime2) + Prime3;
+        cursor += 4;
+    }
+
+    while (cursor < end)
+    {
+        hash ^= static_cast<std::uint64_t>(*cursor++) * Prime5;
+        hash = rotate_left(hash, 11) * Prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+    return hash;
 }
 
-std::string sequence_suffix(std::size_t index, std::size_t count)
+std::string hex64(std::uint64_t value)
 {
-    const std::size_t width = std::max<std::size_t>(2, std::to_string(count == 0 ? 0 : count - 1).size());
-    std::ostringstream suffix;
-    suffix << std::setfill('0') << std::setw(static_cast<int>(width)) << index;
-    return suffix.str();
+    std::ostringstream text;
+    text << std::hex << std::setfill('0') << std::setw(16) << value;
+    return text.str();
 }
 
-std::filesystem::path sequence_output_path(const std::filesystem::path& inputPath,
-                                           const std::filesystem::path& outputTarget,
-                                           std::size_t index,
-                                           std::size_t count)
+// A fresh hidden name beside `target`, for writing a file that is then
+// renamed over it.
+std::filesystem::path temporary_sibling(const std::filesystem::path& target)
 {
-    const std::string suffix = sequence_suffix(index, count);
-    if (std::filesystem::exists(outputTarget) && std::filesystem::is_directory(outputTarget))
+    static const std::uint64_t process = std::random_device{}();
+    static std::atomic<std::uint32_t> nextTemporary = 0;
+    return target.parent_path() /
+           ("." + target.filename().string() + ".tmp-" + hex64((process << 32) | nextTemporary++));
+}
+
+std::uintmax_t parse_byte_size(std::string_view text)
+{
+    std::uintmax_t multiplier = 1;
+    if (!text.empty())
     {
-        return outputTarget / (inputPath.stem().string() + "_" + suffix + ".mid");
+        switch (text.back())
+        {
+        case 'K':
+        case 'k':
+            multiplier = std::uintmax_t{1} << 10;
+            break;
+        case 'M':
+        case 'm':
+            multiplier = std::uintmax_t{1} << 20;
+            break;
+        case 'G':
+        case 'g':
+            multiplier = std::uintmax_t{1} << 30;
+            break;
+        default:
+            break;
+        }
+        if (multiplier != 1)
+        {
+            text.remove_suffix(1);
+        }
     }
 
-    std::filesystem::path extension = outputTarget.extension();
-    if (extension.empty())
+    std::uintmax_t value = 0;
+    if (text.empty())
     {
-        extension = ".mid";
+        throw std::runtime_error("Missing byte size");
     }
-
-    std::string stem = outputTarget.stem().string();
-    if (stem.empty())
+    for (const char ch : text)
     {
-        stem = inputPath.stem().string();
+        if (ch < '0' || ch > '9')
+        {
+            throw std::runtime_error("Invalid byte size " + std::string(text));
+        }
+        const std::uintmax_t digit = static_cast<std::uintmax_t>(ch - '0');
+        if (value > (std::numeric_limits<std::uintmax_t>::max() - digit) / 10)
+        {
+            throw std::runtime_error("Byte size is too large");
+        }
+        value = (value * 10) + digit;
     }
-
-    return outputTarget.parent_path() / (stem + "_" + suffix + extension.string());
+    if (value > std::numeric_limits<std::uintmax_t>::max() / multiplier)
+    {
+        throw std::runtime_error("Byte size is too large");
+    }
+    return value * multiplier;
 }
 
-void print_sequence_list(const std::filesystem::path& inputPath, const std::vector<xmi2mid::sequence_info>& sequences)
+// Places a copy of source at target, sharing storage when the filesystem
+// allows it: a reflink first, then a hard link, then a plain copy.
+void place_file(const std::filesystem::path& source, const std::filesystem::path& target)
 {
-    std::cout << inputPath.string() << ": " << sequences.size() << " sequence(s)\n";
-    for (const xmi2mid::sequence_info& sequence : sequences)
+    std::error_code error;
+    std::filesystem::remove(target, error);
+
+#if defined(FICLONE)
+    const int sourceFd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sourceFd >= 0)
     {
-        std::cout << "  [" << sequence.index << "] "
-                  << "FORM offset " << sequence.form_offset
-                  << ", FORM bytes " << sequence.form_size
-                  << ", EVNT offset " << sequence.event_offset
-                  << ", EVNT bytes " << sequence.event_size
-                  << ", TIMB " << (sequence.has_timb ? "yes" : "no")
-                  << ", RBRN " << (sequence.has_rbrn ? "yes" : "no") << '\n';
+        const int targetFd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (targetFd >= 0)
+        {
+            const bool cloned = ::ioctl(targetFd, FICLONE, sourceFd) == 0;
+            ::close(targetFd);
+            ::close(sourceFd);
+            if (cloned)
+            {
+                return;
+            }
+            std::filesystem::remove(target, error);
+        }
+        else
+        {
+            ::close(sourceFd);
+        }
     }
+#endif
+
+    std::filesystem::create_hard_link(source, target, error);
+    if (!error)
+    {
+        return;
+    }
+
+    std::filesystem::copy_file(source, target, std::filesystem::copy_options::overwrite_existing);
 }
 
-void print_usage(const char* program)
+#if defined(__unix__) || defined(__APPLE__)
+void write_descriptor(int descriptor, std::span<const std::uint8_t> bytes)
 {
-    std::cerr << "Usage:\n"
-              << "  " << program << " Reference/AIL2/DEMO.XMI demo.mid\n"
-              << "  " << program << " --sequence 0 Reference/AIL2/DEMO.XMI demo.mid\n"
-              << "  " << program << " --all Reference/AIL2/DEMO.XMI demo\n"
-              << "  " << program << " --list Reference/AIL2/DEMO.XMI\n";
-}
+    while (!bytes.empty())
+    {
+        const ssize_t count = ::write(descriptor, bytes.data(), bytes.size());
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "write");
+        }
+        bytes = bytes.subspan(static_cast<std::size_t>(count));
+    }
 }
 
-int main(int argc, char* argv[])
+// Output file that convert_into() writes straight into through a shared
+// mapping. The bytes go to a temporary file beside the target, grown as the
+// render needs room; commit() trims it to the exact size and renames it over
+// the target, so readers never see a partial file, and syncs it first so a
+// crash leaves the old output or the new one. Each growth allocates real
+// blocks first, as a store into a sparse page on a full disk raises SIGBUS;
+// when that fails, no_space is thrown and the temporary file removed.
+class mapped_output
 {
-    if (argc < 2)
+public:
+    struct no_space : std::runtime_error
     {
-        print_usage(argv[0]);
-        return 1;
+        using std::runtime_error::runtime_error;
+    };
+
+    explicit mapped_output(std::filesystem::path target)
+        : target_(std::move(target)), temporary_(temporary_sibling(target_))
+    {
+        descriptor_ = ::open(temporary_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (descriptor_ < 0)
+        {
+            throw std::runtime_error("Cannot open output file " + target_.string());
+        }
     }
 
-    try
+    mapped_output(mapped_output&& other) noexcept
+        : target_(std::move(other.target_)), temporary_(std::move(other.temporary_)),
+          descriptor_(std::exchange(other.descriptor_, -1)), data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0)), capacity_(std::exchange(other.capacity_, 0))
     {
-        const std::string_view command = argv[1];
+    }
 
-        if (command == "--help" || command == "-h")
+    mapped_output(const mapped_output&) = delete;
+    mapped_output& operator=(const mapped_output&) = delete;
+    mapped_output& operator=(mapped_output&&) = delete;
+
+    ~mapped_output()
+    {
+        unmap();
+        if (descriptor_ >= 0)
         {
-            print_usage(argv[0]);
-            return 0;
+            ::close(descriptor_);
+            ::unlink(temporary_.c_str());
         }
+    }
 
-        if (command == "--list")
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    std::uint8_t* data()
+    {
+        return data_;
+    }
+
+    std::uint8_t* end()
+    {
+        return data_ + size_;
+    }
+
+    std::uint8_t& operator[](std::size_t index)
+    {
+        return data_[index];
+    }
+
+    void reserve(std::size_t capacity)
+    {
+        if (capacity > capacity_)
         {
-            if (argc != 3)
-            {
-                print_usage(argv[0]);
-                return 1;
-            }
+            remap(capacity);
+        }
+    }
 
-            const std::filesystem::path inputPath = argv[2];
-            const auto xmiData = read_file(inputPath);
-            print_sequence_list(inputPath, xmi2mid::sequence_infos(xmiData));
-            return 0;
+    // Bytes past the old size keep whatever the file held; the renderer
+    // overwrites them.
+    void resize(std::size_t size)
+    {
+        if (size > capacity_)
+        {
+            remap(std::max(size, capacity_ * 2));
+        }
+        size_ = size;
+    }
+
+    void push_back(std::uint8_t byte)
+    {
+        if (size_ == capacity_)
+        {
+            remap(std::max<std::size_t>(capacity_ * 2, 4096));
         }
+        data_[size_++] = byte;
+    }
 
-        if (command == "--sequence")
+    void insert(std::uint8_t*, const std::uint8_t* first, const std::uint8_t* last)
+    {
+        const std::size_t count = static_cast<std::size_t>(last - first);
+        if (count > capacity_ - size_)
         {
-            if (argc != 5)
-            {
-                print_usage(argv[0]);
-                return 1;
-            }
+            remap(std::max(size_ + count, capacity_ * 2));
+        }
+        std::copy(first, last, data_ + size_);
+        size_ += count;
+    }
 
-            const std::size_t sequenceIndex = parse_sequence_index(argv[2]);
-            const std::filesystem::path inputPath = argv[3];
-            const std::filesystem::path outputPath = argv[4];
-            const auto xmiData = read_file(inputPath);
-            const auto midiData = xmi2mid::convert(xmiData, sequenceIndex);
-            write_file(outputPath, midiData);
-            std::cout << "Converted sequence " << sequenceIndex << " from "
-                      << inputPath.string() << " to " << outputPath.string() << '\n';
-            return 0;
+    void commit()
+    {
+        unmap();
+        if (::ftruncate(descriptor_, static_cast<off_t>(size_)) != 0 || ::fsync(descriptor_) != 0 ||
+            ::close(std::exchange(descriptor_, -1)) != 0)
+        {
+            ::unlink(temporary_.c_str());
+            throw std::runtime_error("Cannot write output file " + target_.string());
         }
 
-        if (command == "--all")
+        std::error_code error;
+        std::filesystem::rename(temporary_, target_, error);
+        if (error)
         {
-            if (argc != 4)
-            {
-                print_usage(argv[0]);
-                return 1;
-            }
+            ::unlink(temporary_.c_str());
+            throw std::runtime_error("Cannot write output file " + target_.string());
+        }
+    }
 
-            const std::filesystem::path inputPath = argv[2];
-            const std::filesystem::path outputTarget = argv[3];
-            const auto xmiData = read_file(inputPath);
-            const auto midiFiles = xmi2mid::convert_all(xmiData);
+private:
+    void remap(std::size_t capacity)
+    {
+        const auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        capacity = (capacity + page - 1) / page * page;
+        if (!allocate(capacity))
+        {
+            throw no_space("Cannot allocate output file " + target_.string());
+        }
+
+        void* address = MAP_FAILED;
+#if defined(__linux__)
+        if (data_ != nullptr)
+        {
+            address = ::mremap(data_, capacity_, capacity, MREMAP_MAYMOVE);
+        }
+        else
+#endif
+        {
+            unmap();
+            address = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor_, 0);
+        }
+        if (address == MAP_FAILED)
+        {
+            throw std::runtime_error("Cannot map output file " + target_.string());
+        }
+        data_ = static_cast<std::uint8_t*>(address);
+        capacity_ = capacity;
+    }
 
-            for (std::size_t index = 0; index < midiFiles.size(); ++index)
+    // Extends the file to `capacity` bytes backed by disk blocks.
+    bool allocate(std::size_t capacity)
+    {
+#if defined(__APPLE__)
+        // No posix_fallocate; writing the zeros allocates the blocks.
+        static constexpr std::uint8_t zeros[4096] = {};
+        for (std::size_t offset = capacity_; offset < capacity;)
+        {
+            const ssize_t count = ::pwrite(descriptor_, zeros, std::min(sizeof(zeros), capacity - offset),
+                                           static_cast<off_t>(offset));
+            if (count < 0 && errno != EINTR)
             {
-                const std::filesystem::path outputPath =
-                    sequence_output_path(inputPath, outputTarget, index, midiFiles.size());
-                write_file(outputPath, midiFiles[index]);
-                std::cout << "Converted sequence " << index << " from "
-                          << inputPath.string() << " to " << outputPath.string() << '\n';
+                return false;
             }
+            offset += static_cast<std::size_t>(std::max<ssize_t>(count, 0));
+        }
+        return true;
+#else
+        return ::posix_fallocate(descriptor_, static_cast<off_t>(capacity_),
+                                 static_cast<off_t>(capacity - capacity_)) == 0;
+#endif
+    }
+
+    void unmap()
+    {
+        if (data_ != nullptr)
+        {
+            ::munmap(data_, capacity_);
+            data_ = nullptr;
+            capacity_ = 0;
+        }
+    }
+
+    std::filesystem::path target_;
+    std::filesystem::path temporary_;
+    int descriptor_ = -1;
+    std::uint8_t* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t capacity_ = 0;
+};
+#endif
+
+// On-disk MIDI cache keyed by a hash of the FORM XMID bytes and the
+// conversion settings. Entries are written to a temporary name and renamed
+// into place, and the oldest entries are evicted once the directory grows
+// past its size limit. Lookups and stores may run on several threads; evict()
+// must not run alongside them.
+class conversion_cache
+{
+public:
+    conversion_cache(std::filesystem::path directory, std::uintmax_t limit)
+        : directory_(std::move(directory)), limit_(limit)
+    {
+        std::filesystem::create_directories(directory_);
+    }
+
+    conversion_cache(const conversion_cache&) = delete;
+    conversion_cache& operator=(const conversion_cache&) = delete;
+
+    ~conversion_cache()
+    {
+        try
+        {
+            evict();
+        }
+        catch (const std::exception&)
+        {
+        }
+    }
+
+    std::filesystem::path entry_path(std::string_view key) const
+    {
+        return directory_ / std::string(key.substr(0, 2)) / (std::string(key) + ".mid");
+    }
+
+    std::optional<std::filesystem::path> find(std::string_view key) const
+    {
+        std::filesystem::path entry = entry_path(key);
+        std::error_code error;
+        if (!std::filesystem::is_regular_file(entry, error))
+        {
+            return std::nullopt;
+        }
+
+        std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), error);
+        return entry;
+    }
+
+    std::filesystem::path store(std::string_view key, std::span<const std::uint8_t> midi)
+    {
+        return publish(key, midi.size(), [midi](const std::filesystem::path& temporary)
+        {
+            write_file(temporary, midi);
+        });
+    }
+
+    // Stores a finished output file, sharing its storage where possible.
+    std::filesystem::path store_file(std::string_view key, const std::filesystem::path& source, std::uintmax_t size)
+    {
+        return publish(key, size, [&source](const std::filesystem::path& temporary)
+        {
+            place_file(source, temporary);
+        });
+    }
+
+    // Whether anything was stored since the last evict().
+    bool grown() const
+    {
+        return storedBytes_ != 0;
+    }
+
+    // Removes the oldest entries past the size limit, and temporary files
+    // that a crashed run left behind.
+    void evict()
+    {
+        constexpr auto StaleTemporaryAge = std::chrono::hours(1);
+        if (storedBytes_.exchange(0) == 0)
+        {
+            return;
+        }
+        const auto staleBefore = std::filesystem::file_time_type::clock::now() - StaleTemporaryAge;
+
+        struct entry_state
+        {
+            std::filesystem::path path;
+            std::filesystem::file_time_type time;
+            std::uintmax_t size = 0;
+        };
+
+        std::vector<entry_state> entries;
+        std::uintmax_t total = 0;
+        std::error_code error;
+        for (std::filesystem::recursive_directory_iterator item(directory_, error), end; !error && item != end;
+             item.increment(error))
+        {
+            std::error_code entryError;
+            if (!item->is_regular_file(entryError))
+            {
+                continue;
+            }
+            const std::string name = item->path().filename().string();
+            if (name.starts_with('.') && name.find(".tmp-") != std::string::npos)
+            {
+                if (item->last_write_time(entryError) < staleBefore && !entryError)
+                {
+                    std::filesystem::remove(item->path(), entryError);
+                }
+                continue;
+            }
+            if (item->path().extension() != ".mid")
+            {
+                continue;
+            }
+
+            entry_state state{item->path(), item->last_write_time(entryError), item->file_size(entryError)};
+            total += state.size;
+            entries.push_back(std::move(state));
+        }
+
+        if (total <= limit_)
+        {
+            return;
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const entry_state& left, const entry_state& right)
+        {
+            return left.time < right.time;
+        });
+
+        for (const entry_state& entry : entries)
+        {
+            if (total <= limit_)
+            {
+                break;
+            }
+            if (std::filesystem::remove(entry.path, error))
+            {
+                total -= entry.size;
+            }
+        }
+    }
+
+private:
+    template <typename Write>
+    std::filesystem::path publish(std::string_view key, std::uintmax_t size, Write write)
+    {
+        const std::filesystem::path entry = entry_path(key);
+        std::filesystem::create_directories(entry.parent_path());
+
+        const std::filesystem::path temporary = temporary_sibling(entry);
+        try
+        {
+            write(temporary);
+            std::filesystem::rename(temporary, entry);
+        }
+        catch (const std::exception&)
+        {
+            std::error_code error;
+            std::filesystem::remove(temporary, error);
+            throw;
+        }
+
+        storedBytes_ += size;
+        return entry;
+    }
+
+    std::filesystem::path directory_;
+    std::uintmax_t limit_ = 0;
+    std::atomic<std::uintmax_t> storedBytes_ = 0;
+};
+
+struct cli_options
+{
+    std::optional<std::filesystem::path> cache_directory;
+    std::uintmax_t cache_limit = std::uintmax_t{1} << 30;
+    std::optional<std::filesystem::path> manifest_path;
+    std::optional<xmi2mid::loop_options> unroll_loops;
+    bool break_ends_loop = xmi2mid::BreakEndsLoopByDefault;
+    xmi2mid::convert_options conversion;
+};
+
+// Bumped whenever xmi2mid::convert output changes so stale cache entries are
+// never reused.
+constexpr std::string_view ConversionFingerprint = "xmi2mid-smf0-960ppqn-v1";
+
+// Identifies how outputs were produced, for cache keys and manifests.
+std::string conversion_fingerprint(const cli_options& options)
+{
+    std::string fingerprint(ConversionFingerprint);
+    if (options.unroll_loops)
+    {
+        // Both Break modes are named, so entries from before Break became
+        // optional are never reused.
+        fingerprint += "-unrolled" + std::to_string(options.unroll_loops->infinite_loop_plays) +
+                       (options.unroll_loops->break_ends_loop ? "-break" : "-nobreak");
+    }
+    if (options.conversion.patches == xmi2mid::patch_map::mt32_to_gm)
+    {
+        fingerprint += "-gm";
+    }
+    return fingerprint;
+}
+
+// Converts one sequence the way the global options ask for.
+std::vector<std::uint8_t> convert_sequence(const std::optional<xmi2mid::loop_options>& unrollLoops,
+                                           const xmi2mid::convert_options& conversion,
+                                           std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    return unrollLoops ? xmi2mid::convert_unrolled(xmi, sequenceIndex, *unrollLoops, conversion)
+                       : xmi2mid::convert(xmi, sequenceIndex, conversion);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// Writes `bytes` to a synced temporary file beside `path` and renames it over
+// `path`. On failure the temporary file is removed and `path` is untouched.
+void replace_file(const std::filesystem::path& path, std::span<const std::uint8_t> bytes)
+{
+    const std::filesystem::path temporary = temporary_sibling(path);
+    const int descriptor = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (descriptor < 0)
+    {
+        throw std::runtime_error("Cannot open output file " + path.string());
+    }
+
+    bool written = false;
+    try
+    {
+        write_descriptor(descriptor, bytes);
+        written = ::fsync(descriptor) == 0;
+    }
+    catch (const std::system_error&)
+    {
+    }
+    written = ::close(descriptor) == 0 && written;
+
+    std::error_code error;
+    if (written)
+    {
+        std::filesystem::rename(temporary, path, error);
+    }
+    if (!written || error)
+    {
+        ::unlink(temporary.c_str());
+        throw std::runtime_error("Cannot write output file " + path.string());
+    }
+}
+
+// Converts straight into a mapping of the output file, then renames it into
+// place. Falls back to converting in memory and replace_file() when the
+// mapping cannot get disk blocks. Returns the MIDI size.
+std::size_t convert_sequence_to_file(const std::optional<xmi2mid::loop_options>& unrollLoops,
+                                     const xmi2mid::convert_options& conversion, std::span<const std::uint8_t> xmi,
+                                     std::size_t sequenceIndex, const std::filesystem::path& outputPath)
+{
+    try
+    {
+        mapped_output midi =
+            unrollLoops
+                ? xmi2mid::convert_unrolled_into(xmi, sequenceIndex, mapped_output(outputPath), *unrollLoops,
+                                                 conversion)
+                : xmi2mid::convert_into(xmi, sequenceIndex, mapped_output(outputPath), conversion);
+        midi.commit();
+        return midi.size();
+    }
+    catch (const mapped_output::no_space&)
+    {
+    }
+
+    const std::vector<std::uint8_t> midi = convert_sequence(unrollLoops, conversion, xmi, sequenceIndex);
+    replace_file(outputPath, midi);
+    return midi.size();
+}
+#endif
+
+// Fixed-size worker pool. Jobs must not throw; callers report their own
+// errors.
+class thread_pool
+{
+public:
+    explicit thread_pool(std::size_t threadCount = std::max(1U, std::thread::hardware_concurrency()))
+    {
+        workers_.reserve(threadCount);
+        for (std::size_t i = 0; i < threadCount; ++i)
+        {
+            workers_.emplace_back([this] { run(); });
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread& worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    std::size_t size() const
+    {
+        return workers_.size();
+    }
+
+    void submit(std::function<void()> job)
+    {
+        {
+            std::lock_guard lock(mutex_);
+            jobs_.push_back(std::move(job));
+            ++pending_;
+        }
+        wake_.notify_one();
+    }
+
+    void wait()
+    {
+        std::unique_lock lock(mutex_);
+        idle_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+private:
+    void run()
+    {
+        for (;;)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock lock(mutex_);
+                wake_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty())
+                {
+                    return;
+                }
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+
+            job();
+
+            std::lock_guard lock(mutex_);
+            if (--pending_ == 0)
+            {
+                idle_.notify_all();
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::deque<std::function<void()>> jobs_;
+    std::vector<std::thread> workers_;
+    std::size_t pending_ = 0;
+    bool stopping_ = false;
+};
+
+// Contents of one input file read by batch_io, or why it could not be read.
+struct file_read
+{
+    std::vector<std::uint8_t> bytes;
+    std::string error;
+};
+
+#if defined(__linux__)
+// Minimal io_uring over raw syscalls for whole-file reads and writes. Each
+// file is one linked chain on a registered descriptor slot, open then read or
+// write then close, so no descriptor ever reaches this process and a group of
+// files costs one io_uring_enter instead of several syscalls per file.
+class io_ring
+{
+public:
+    // Null when io_uring is missing, disabled, or too old for direct
+    // descriptors.
+    static std::unique_ptr<io_ring> open()
+    {
+        io_uring_params params{};
+        const int descriptor = static_cast<int>(::syscall(__NR_io_uring_setup, Entries, &params));
+        if (descriptor < 0)
+        {
+            return nullptr;
+        }
+
+        std::unique_ptr<io_ring> ring(new io_ring(descriptor));
+        // IORING_FEAT_CQE_SKIP arrived in 5.17, after direct descriptors for
+        // open and close (5.15).
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 || (params.features & IORING_FEAT_CQE_SKIP) == 0 ||
+            !ring->map(params))
+        {
+            return nullptr;
+        }
+
+        std::vector<int> slots(Slots, -1);
+        if (::syscall(__NR_io_uring_register, descriptor, IORING_REGISTER_FILES, slots.data(), Slots) != 0)
+        {
+            return nullptr;
+        }
+        return ring;
+    }
+
+    io_ring(const io_ring&) = delete;
+    io_ring& operator=(const io_ring&) = delete;
+
+    ~io_ring()
+    {
+        // The kernel may still write into request buffers.
+        try
+        {
+            wait_until([this] { return inFlight_ == 0; });
+        }
+        catch (const std::exception&)
+        {
+        }
+
+        if (sqes_ != nullptr)
+        {
+            ::munmap(sqes_, sqesSize_);
+        }
+        if (ringMemory_ != nullptr)
+        {
+            ::munmap(ringMemory_, ringSize_);
+        }
+        ::close(descriptor_);
+    }
+
+    // Starts reading the whole file into `target`, which must stay in place
+    // until wait_reads() returns.
+    void read(std::string path, file_read& target)
+    {
+        request& chain = start(std::move(path), false);
+        chain.target = &target;
+        if (!chain.buffer)
+        {
+            chain.buffer = std::make_unique_for_overwrite<std::uint8_t[]>(ReadBytes);
+        }
+        chain.pending = 3;
+
+        const unsigned slot = slot_of(chain);
+        prepare_open(slot, O_RDONLY, 0);
+        prepare_transfer(slot, IORING_OP_READ, chain.buffer.get(), ReadBytes);
+        prepare_close(slot);
+        ++readsInFlight_;
+    }
+
+    // Starts replacing the file with `bytes`.
+    void write(std::string path, std::vector<std::uint8_t> bytes)
+    {
+        request& chain = start(std::move(path), true);
+        chain.bytes = std::move(bytes);
+        chain.pending = 3;
+
+        const unsigned slot = slot_of(chain);
+        prepare_open(slot, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        prepare_transfer(slot, IORING_OP_WRITE, chain.bytes.data(), chain.bytes.size());
+        prepare_close(slot);
+    }
+
+    // Hands queued chains to the kernel without waiting for them.
+    void submit()
+    {
+        enter(0);
+    }
+
+    void wait_reads()
+    {
+        wait_until([this] { return readsInFlight_ == 0; });
+    }
+
+    void wait_all()
+    {
+        wait_until([this] { return inFlight_ == 0; });
+    }
+
+    std::string take_write_error()
+    {
+        return std::exchange(writeError_, {});
+    }
+
+private:
+    // Each slot reads into a buffer this large; larger files are read again
+    // with read_file.
+    static constexpr std::size_t ReadBytes = std::size_t{32} << 10;
+    static constexpr unsigned Entries = 1024;
+    static constexpr unsigned Slots = 256;
+    static constexpr unsigned ChainLength = 3;
+
+    enum stage : std::uint64_t
+    {
+        Open,
+        Transfer,
+        Close
+    };
+
+    struct request
+    {
+        std::string path;
+        std::vector<std::uint8_t> bytes;
+        std::unique_ptr<std::uint8_t[]> buffer;
+        file_read* target = nullptr;
+        bool write = false;
+        unsigned pending = 0;
+        int opened = 0;
+        int transferred = 0;
+    };
+
+    explicit io_ring(int descriptor) : descriptor_(descriptor), requests_(Slots)
+    {
+        for (unsigned slot = Slots; slot-- > 0;)
+        {
+            freeSlots_.push_back(slot);
+        }
+    }
+
+    bool map(const io_uring_params& params)
+    {
+        ringSize_ = std::max<std::size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                          params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        void* const ringMemory = ::mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        descriptor_, IORING_OFF_SQ_RING);
+        if (ringMemory == MAP_FAILED)
+        {
+            return false;
+        }
+        ringMemory_ = ringMemory;
+
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* const sqes = ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  descriptor_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+        {
+            return false;
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        auto* const base = static_cast<std::uint8_t*>(ringMemory_);
+        sqHead_ = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sqTail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        sqEntries_ = params.sq_entries;
+        cqHead_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+        tail_ = *sqTail_;
+        return true;
+    }
+
+    unsigned slot_of(const request& chain) const
+    {
+        return static_cast<unsigned>(&chain - requests_.data());
+    }
+
+    request& start(std::string path, bool write)
+    {
+        wait_until([this] { return !freeSlots_.empty(); });
+        if (sqEntries_ - (tail_ - std::atomic_ref(*sqHead_).load(std::memory_order_acquire)) < ChainLength)
+        {
+            enter(0);
+        }
+
+        request& chain = requests_[freeSlots_.back()];
+        freeSlots_.pop_back();
+        chain.path = std::move(path);
+        chain.write = write;
+        ++inFlight_;
+        return chain;
+    }
+
+    io_uring_sqe& next_sqe(unsigned slot, stage step)
+    {
+        const unsigned index = tail_ & sqMask_;
+        io_uring_sqe& sqe = sqes_[index];
+        sqe = io_uring_sqe{};
+        sqe.user_data = (std::uint64_t{slot} << 2) | step;
+        sqArray_[index] = index;
+        ++tail_;
+        ++unsubmitted_;
+        return sqe;
+    }
+
+    void prepare_open(unsigned slot, int flags, unsigned mode)
+    {
+        io_uring_sqe& open = next_sqe(slot, Open);
+        open.opcode = IORING_OP_OPENAT;
+        open.fd = AT_FDCWD;
+        open.addr = reinterpret_cast<std::uintptr_t>(requests_[slot].path.c_str());
+        open.len = mode;
+        open.open_flags = static_cast<std::uint32_t>(flags);
+        open.file_index = slot + 1;
+        open.flags = IOSQE_IO_LINK;
+    }
+
+    // A short transfer fails the link, so the close is hard-linked to run
+    // regardless.
+    void prepare_transfer(unsigned slot, std::uint8_t opcode, std::uint8_t* bytes, std::size_t size)
+    {
+        io_uring_sqe& transfer = next_sqe(slot, Transfer);
+        transfer.opcode = opcode;
+        transfer.fd = static_cast<std::int32_t>(slot);
+        transfer.addr = reinterpret_cast<std::uintptr_t>(bytes);
+        transfer.len = static_cast<std::uint32_t>(size);
+        transfer.flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    }
+
+    void prepare_close(unsigned slot)
+    {
+        io_uring_sqe& close = next_sqe(slot, Close);
+        close.opcode = IORING_OP_CLOSE;
+        close.file_index = slot + 1;
+    }
+
+    void enter(unsigned minComplete)
+    {
+        std::atomic_ref(*sqTail_).store(tail_, std::memory_order_release);
+        for (;;)
+        {
+            const unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+            const long submitted = ::syscall(__NR_io_uring_enter, descriptor_, unsubmitted_, minComplete, flags,
+                                             nullptr, 0);
+            if (submitted >= 0)
+            {
+                unsubmitted_ -= static_cast<unsigned>(submitted);
+                if (unsubmitted_ == 0)
+                {
+                    return;
+                }
+                minComplete = 0;
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EBUSY || errno == EAGAIN)
+            {
+                // The completion queue is full; drain it and try again.
+                reap();
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+        }
+    }
+
+    template <typename Done>
+    void wait_until(Done done)
+    {
+        reap();
+        while (!done())
+        {
+            enter(1);
+            reap();
+        }
+    }
+
+    void reap()
+    {
+        unsigned head = *cqHead_;
+        const unsigned tail = std::atomic_ref(*cqTail_).load(std::memory_order_acquire);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe& cqe = cqes_[head & cqMask_];
+            complete(static_cast<unsigned>(cqe.user_data >> 2), static_cast<stage>(cqe.user_data & 3), cqe.res);
+        }
+        std::atomic_ref(*cqHead_).store(head, std::memory_order_release);
+    }
+
+    void complete(unsigned slot, stage step, int result)
+    {
+        request& chain = requests_[slot];
+        if (step == Open)
+        {
+            chain.opened = result;
+        }
+        else if (step == Transfer)
+        {
+            chain.transferred = result;
+        }
+        if (--chain.pending > 0)
+        {
+            return;
+        }
+
+        if (chain.write)
+        {
+            finish_write(chain);
+        }
+        else
+        {
+            finish_read(chain);
+        }
+        chain.path.clear();
+        chain.bytes = {};
+        chain.target = nullptr;
+        freeSlots_.push_back(slot);
+        --inFlight_;
+    }
+
+    void finish_read(request& chain)
+    {
+        file_read& target = *chain.target;
+        --readsInFlight_;
+        if (chain.opened < 0)
+        {
+            target.error = "Cannot open input file " + chain.path;
+            return;
+        }
+        if (chain.transferred < 0)
+        {
+            target.error = "Cannot read input file " + chain.path;
+            return;
+        }
+
+        if (static_cast<std::size_t>(chain.transferred) < ReadBytes)
+        {
+            target.bytes.assign(chain.buffer.get(), chain.buffer.get() + chain.transferred);
+            return;
+        }
+        try
+        {
+            target.bytes = read_file(chain.path);
+        }
+        catch (const std::exception& failure)
+        {
+            target.error = failure.what();
+        }
+    }
+
+    void finish_write(request& chain)
+    {
+        if (chain.opened >= 0 && chain.transferred >= 0 &&
+            static_cast<std::size_t>(chain.transferred) == chain.bytes.size())
+        {
+            return;
+        }
+
+        try
+        {
+            write_file(chain.path, chain.bytes);
+        }
+        catch (const std::exception& failure)
+        {
+            if (writeError_.empty())
+            {
+                writeError_ = failure.what();
+            }
+        }
+    }
+
+    int descriptor_;
+    void* ringMemory_ = nullptr;
+    std::size_t ringSize_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    std::size_t sqesSize_ = 0;
+    unsigned* sqHead_ = nullptr;
+    unsigned* sqTail_ = nullptr;
+    unsigned* sqArray_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned sqEntries_ = 0;
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned cqMask_ = 0;
+    unsigned tail_ = 0;
+    unsigned unsubmitted_ = 0;
+    std::vector<request> requests_;
+    std::vector<unsigned> freeSlots_;
+    std::size_t inFlight_ = 0;
+    std::size_t readsInFlight_ = 0;
+    std::string writeError_;
+};
+#endif
+
+// Whole-file reads and writes for --batch, started in groups so conversion
+// runs while they are outstanding. Uses io_ring where the kernel allows and
+// the thread pool otherwise.
+class batch_io
+{
+public:
+    batch_io()
+    {
+#if defined(__linux__)
+        ring_ = io_ring::open();
+        if (ring_)
+        {
+            return;
+        }
+#endif
+        pool_ = std::make_unique<thread_pool>();
+    }
+
+    // Starts reading the files; finish_reads() returns them in the same order.
+    void start_reads(std::span<const std::filesystem::path> paths)
+    {
+        reads_.assign(paths.size(), {});
+#if defined(__linux__)
+        if (ring_)
+        {
+            for (std::size_t index = 0; index < paths.size(); ++index)
+            {
+                ring_->read(paths[index].string(), reads_[index]);
+            }
+            ring_->submit();
+            return;
+        }
+#endif
+        for (std::size_t index = 0; index < paths.size(); ++index)
+        {
+            pool_->submit([this, path = paths[index], index]
+            {
+                try
+                {
+                    reads_[index].bytes = read_file(path);
+                }
+                catch (const std::exception& failure)
+                {
+                    reads_[index].error = failure.what();
+                }
+            });
+        }
+    }
+
+    std::vector<file_read> finish_reads()
+    {
+#if defined(__linux__)
+        if (ring_)
+        {
+            ring_->wait_reads();
+        }
+#endif
+        if (pool_)
+        {
+            pool_->wait();
+        }
+        return std::move(reads_);
+    }
+
+    // Queues a write; failures are reported by flush().
+    void write(const std::filesystem::path& path, std::vector<std::uint8_t> bytes)
+    {
+#if defined(__linux__)
+        if (ring_)
+        {
+            // As in write_file, replace hard links into the conversion cache
+            // instead of writing through them.
+            std::error_code error;
+            if (std::filesystem::hard_link_count(path, error) > 1)
+            {
+                std::filesystem::remove(path, error);
+            }
+
+            ring_->write(path.string(), std::move(bytes));
+            return;
+        }
+#endif
+        pool_->submit([this, path, bytes = std::move(bytes)]
+        {
+            try
+            {
+                write_file(path, bytes);
+            }
+            catch (const std::exception& failure)
+            {
+                std::lock_guard lock(errorMutex_);
+                if (writeError_.empty())
+                {
+                    writeError_ = failure.what();
+                }
+            }
+        });
+    }
+
+    void submit()
+    {
+#if defined(__linux__)
+        if (ring_)
+        {
+            ring_->submit();
+        }
+#endif
+    }
+
+    // Waits for every queued write.
+    void flush()
+    {
+#if defined(__linux__)
+        if (ring_)
+        {
+            ring_->wait_all();
+            writeError_ = ring_->take_write_error();
+        }
+#endif
+        if (pool_)
+        {
+            pool_->wait();
+        }
+        if (!writeError_.empty())
+        {
+            throw std::runtime_error(std::exchange(writeError_, {}));
+        }
+    }
+
+private:
+    std::vector<file_read> reads_;
+    std::mutex errorMutex_;
+    std::string writeError_;
+#if defined(__linux__)
+    std::unique_ptr<io_ring> ring_;
+#endif
+    // Last, so queued jobs finish before the members they use are destroyed.
+    std::unique_ptr<thread_pool> pool_;
+};
+
+// Writes converted sequences, reusing identical FORM XMID conversions from
+// earlier in the run or from the on-disk cache without decoding them again.
+class sequence_writer
+{
+public:
+    // Batch outputs of sequences at least this large skip batch_io and are
+    // converted straight into a file mapping.
+    static constexpr std::size_t MappedOutputEventBytes = std::size_t{64} << 10;
+
+    // Uses `cache` when given, otherwise its own cache if options ask for one.
+    explicit sequence_writer(const cli_options& options, conversion_cache* cache = nullptr)
+        : unrollLoops_(options.unroll_loops), conversion_(options.conversion), cache_(cache)
+    {
+        const std::string fingerprint = conversion_fingerprint(options);
+        fingerprint_ = hash_bytes({reinterpret_cast<const std::uint8_t*>(fingerprint.data()), fingerprint.size()});
+        if (cache_ == nullptr && options.cache_directory)
+        {
+            cache_ = &ownedCache_.emplace(*options.cache_directory, options.cache_limit);
+        }
+    }
+
+    std::string key(std::span<const std::uint8_t> xmi, const xmi2mid::sequence_info& sequence) const
+    {
+        const auto form = xmi.subspan(sequence.form_offset, sequence.form_size);
+        return hex64(hash_bytes(form, fingerprint_)) + "-" + hex64(form.size()).substr(8);
+    }
+
+    // Returns true when the output came from an earlier conversion. New
+    // outputs are rendered into a file mapping, except that with `io` small
+    // ones are queued there.
+    bool write(std::span<const std::uint8_t> xmi, const xmi2mid::sequence_info& sequence,
+               const std::filesystem::path& outputPath, batch_io* io = nullptr)
+    {
+        const std::string sequenceKey = key(xmi, sequence);
+
+        if (const auto known = converted_.find(sequenceKey); known != converted_.end())
+        {
+            if (known->second != outputPath)
+            {
+                if (io != nullptr && !cache_)
+                {
+                    // The earlier output may still be queued.
+                    io->flush();
+                }
+                place_file(known->second, outputPath);
+            }
+            return true;
+        }
+
+        if (cache_)
+        {
+            if (auto entry = cache_->find(sequenceKey))
+            {
+                place_file(*entry, outputPath);
+                converted_.emplace(sequenceKey, std::move(*entry));
+                return true;
+            }
+        }
+
+#if defined(__unix__) || defined(__APPLE__)
+        if (io == nullptr || sequence.event_size >= MappedOutputEventBytes)
+        {
+            const std::size_t size =
+                convert_sequence_to_file(unrollLoops_, conversion_, xmi, sequence.index, outputPath);
+            converted_.emplace(sequenceKey, cache_ ? cache_->store_file(sequenceKey, outputPath, size) : outputPath);
+            return false;
+        }
+#endif
+
+        auto midiData = convert_sequence(unrollLoops_, conversion_, xmi, sequence.index);
+        if (io != nullptr)
+        {
+            converted_.emplace(sequenceKey, cache_ ? cache_->store(sequenceKey, midiData) : outputPath);
+            io->write(outputPath, std::move(midiData));
+            return false;
+        }
+
+        write_file(outputPath, midiData);
+        converted_.emplace(sequenceKey, cache_ ? cache_->store(sequenceKey, midiData) : outputPath);
+        return false;
+    }
+
+private:
+    std::uint64_t fingerprint_ = 0;
+    std::optional<xmi2mid::loop_options> unrollLoops_;
+    xmi2mid::convert_options conversion_;
+    std::optional<conversion_cache> ownedCache_;
+    conversion_cache* cache_ = nullptr;
+    std::unordered_map<std::string, std::filesystem::path> converted_;
+};
+
+std::size_t parse_sequence_index(std::string_view text)
+{
+    if (text.empty())
+    {
+        throw std::runtime_error("Missing sequence index");
+    }
+
+    std::size_t value = 0;
+    for (const char ch : text)
+    {
+        if (ch < '0' || ch > '9')
+        {
+            throw std::runtime_error("Invalid sequence index " + std::string(text));
+        }
+
+        const std::size_t digit = static_cast<std::size_t>(ch - '0');
+        if (value > (std::numeric_limits<std::size_t>::max() - digit) / 10)
+        {
+            throw std::runtime_error("Sequence index is too large");
+        }
+        value = (value * 10) + digit;
+    }
+    return value;
+}
+
+std::string sequence_suffix(std::size_t index, std::size_t count)
+{
+    const std::size_t width = std::max<std::size_t>(2, std::to_string(count == 0 ? 0 : count - 1).size());
+    std::ostringstream suffix;
+    suffix << std::setfill('0') << std::setw(static_cast<int>(width)) << index;
+    return suffix.str();
+}
+
+std::filesystem::path suffixed_output_path(const std::filesystem::path& inputPath,
+                                           const std::filesystem::path& outputTarget,
+                                           const std::string& suffix,
+                                           const std::string& defaultExtension = ".mid")
+{
+    if (std::filesystem::exists(outputTarget) && std::filesystem::is_directory(outputTarget))
+    {
+        return outputTarget / (inputPath.stem().string() + "_" + suffix + defaultExtension);
+    }
+
+    std::filesystem::path extension = outputTarget.extension();
+    if (extension.empty())
+    {
+        extension = defaultExtension;
+    }
+
+    std::string stem = outputTarget.stem().string();
+    if (stem.empty())
+    {
+        stem = inputPath.stem().string();
+    }
+
+    return outputTarget.parent_path() / (stem + "_" + suffix + extension.string());
+}
+
+std::filesystem::path sequence_output_path(const std::filesystem::path& inputPath,
+                                           const std::filesystem::path& outputTarget,
+                                           std::size_t index,
+                                           std::size_t count)
+{
+    return suffixed_output_path(inputPath, outputTarget, sequence_suffix(index, count));
+}
+
+std::filesystem::path branch_output_path(const std::filesystem::path& inputPath,
+                                         const std::filesystem::path& outputTarget,
+                                         std::size_t sequenceIndex,
+                                         std::size_t sequenceCount,
+                                         std::uint16_t marker)
+{
+    std::string suffix = "b" + std::to_string(marker);
+    if (sequenceCount > 1)
+    {
+        suffix = sequence_suffix(sequenceIndex, sequenceCount) + "_" + suffix;
+    }
+    return suffixed_output_path(inputPath, outputTarget, suffix);
+}
+
+void print_sequence_list(const std::filesystem::path& inputPath, std::span<const std::uint8_t> xmi,
+                         const std::vector<xmi2mid::sequence_info>& sequences, bool durations)
+{
+    std::cout << inputPath.string() << ": " << sequences.size() << " sequence(s)\n";
+    for (const xmi2mid::sequence_info& sequence : sequences)
+    {
+        std::cout << "  [" << sequence.index << "] "
+                  << "FORM offset " << sequence.form_offset
+                  << ", FORM bytes " << sequence.form_size
+                  << ", EVNT offset " << sequence.event_offset
+                  << ", EVNT bytes " << sequence.event_size
+                  << ", TIMB " << (sequence.has_timb ? "yes" : "no")
+                  << ", RBRN " << (sequence.has_rbrn ? "yes" : "no");
+        if (durations)
+        {
+            std::cout << std::fixed << std::setprecision(2) << ", duration "
+                      << xmi2mid::sequence_duration(xmi, sequence.index) << " s";
+        }
+        std::cout << '\n';
+        // A damaged TIMB or RBRN does not stop conversion, so it is reported
+        // here instead of ending the listing.
+        const auto timbres = xmi2mid::try_timbres(xmi, sequence);
+        if (!timbres)
+        {
+            std::cout << "      timbres: " << xmi2mid::to_string(timbres.error()) << '\n';
+        }
+        else if (!timbres->empty())
+        {
+            std::cout << "      timbres (bank:patch)";
+            for (const xmi2mid::timbre_request timbre : *timbres)
+            {
+                std::cout << ' ' << static_cast<int>(timbre.bank) << ':' << static_cast<int>(timbre.patch);
+            }
+            std::cout << '\n';
+        }
+
+        const auto branches = xmi2mid::try_branch_points(xmi, sequence);
+        if (!branches)
+        {
+            std::cout << "      branches: " << xmi2mid::to_string(branches.error()) << '\n';
+        }
+        else
+        {
+            for (const xmi2mid::branch_point& branch : *branches)
+            {
+                std::cout << "      branch " << branch.marker << " at EVNT offset " << branch.offset << '\n';
+            }
+        }
+    }
+}
+
+void append_number(std::string& text, std::uint32_t value, int base = 10)
+{
+    char digits[16];
+    const auto result = std::to_chars(digits, digits + sizeof(digits), value, base);
+    if (base == 16 && result.ptr - digits == 1)
+    {
+        text += '0';
+    }
+    text.append(digits, result.ptr);
+}
+
+// One line per trace event: tick, kind, then the kind's fields. MIDI status
+// bytes are hex, everything else decimal.
+void append_trace_line(std::string& text, const xmi2mid::trace_event& event)
+{
+    append_number(text, event.tick);
+    switch (event.kind)
+    {
+    case xmi2mid::trace_kind::midi:
+        text += "\tmidi\t";
+        append_number(text, event.status, 16);
+        text += '\t';
+        append_number(text, event.data1);
+        text += '\t';
+        append_number(text, event.data2);
+        break;
+    case xmi2mid::trace_kind::sysex:
+        text += "\tsysex\t";
+        append_number(text, event.status, 16);
+        text += "\tEVNT offset ";
+        append_number(text, event.value);
+        break;
+    case xmi2mid::trace_kind::callback:
+        text += "\tcallback\t";
+        append_number(text, event.status & 0x0Fu);
+        text += '\t';
+        append_number(text, event.data1);
+        break;
+    case xmi2mid::trace_kind::beat:
+        text += "\tbeat\t";
+        append_number(text, event.value);
+        text += ':';
+        append_number(text, event.data1);
+        break;
+    case xmi2mid::trace_kind::branch:
+        text += "\tbranch\t";
+        append_number(text, event.data1);
+        text += "\tEVNT offset ";
+        append_number(text, event.value);
+        break;
+    case xmi2mid::trace_kind::done:
+        text += "\tdone";
+        break;
+    }
+    text += '\n';
+}
+
+// Ten minutes of 120 Hz intervals, so looping sequences still end.
+constexpr std::uint32_t DefaultTraceTicks = 120 * 60 * 10;
+
+struct branch_request
+{
+    std::uint32_t tick = 0;
+    std::uint8_t marker = 0;
+};
+
+// Parses tick:marker for --branch-at.
+branch_request parse_branch_request(std::string_view text)
+{
+    const std::size_t colon = text.find(':');
+    if (colon == std::string_view::npos)
+    {
+        throw std::runtime_error("Invalid branch request " + std::string(text) + ", expected tick:marker");
+    }
+    const std::size_t tick = parse_sequence_index(text.substr(0, colon));
+    const std::size_t marker = parse_sequence_index(text.substr(colon + 1));
+    if (tick > std::numeric_limits<std::uint32_t>::max() || marker > std::numeric_limits<std::uint8_t>::max())
+    {
+        throw std::runtime_error("Invalid branch request " + std::string(text));
+    }
+    return {static_cast<std::uint32_t>(tick), static_cast<std::uint8_t>(marker)};
+}
+
+// Plays one sequence through the AIL sequencer emulation and prints its trace
+// to stdout. Branch requests run in tick order, before the interval at their
+// tick, as if AIL_branch_index() were called from the application.
+void print_trace(const std::filesystem::path& inputPath, std::span<const std::uint8_t> xmi,
+                 std::size_t sequenceIndex, std::uint32_t maxTicks, std::vector<branch_request> branches,
+                 const xmi2mid::sequencer_options& sequencerOptions)
+{
+    std::stable_sort(branches.begin(), branches.end(), [](const branch_request& left, const branch_request& right)
+    {
+        return left.tick < right.tick;
+    });
+
+    const auto start = std::chrono::steady_clock::now();
+    xmi2mid::sequencer engine(xmi, sequenceIndex, sequencerOptions);
+    for (const branch_request& branch : branches)
+    {
+        engine.run_until(std::min(branch.tick, maxTicks));
+        if (engine.done() || engine.tick() >= maxTicks)
+        {
+            break;
+        }
+        if (!engine.branch_index(branch.marker))
+        {
+            throw std::runtime_error("Sequence " + std::to_string(sequenceIndex) + " has no branch marker " +
+                                     std::to_string(branch.marker));
+        }
+    }
+    engine.run_until(maxTicks);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::string text = "# xmi2mid trace v1: sequence " + std::to_string(sequenceIndex) + " of " +
+                       inputPath.string() + " at 120 Hz\n";
+    for (const xmi2mid::trace_event& event : engine.trace())
+    {
+        append_trace_line(text, event);
+    }
+    std::cout << text;
+    std::cerr << std::fixed << std::setprecision(2) << "Traced " << engine.tick() << " tick(s), "
+              << engine.trace().size() << " event(s)" << (engine.done() ? "" : ", stopped before End of Track")
+              << " in " << seconds * 1000.0 << " ms (" << engine.tick() / seconds / 1e6 << " M ticks/s)\n";
+}
+
+// Renders one sequence, or every sequence in parallel on a thread pool, to
+// WAV through the OPL emulation.
+void render_wav_files(const std::filesystem::path& inputPath, const std::filesystem::path& timbrePath,
+                      const std::filesystem::path& outputTarget, std::size_t sequenceIndex, bool allSequences,
+                      const xmi2mid::opl_render_options& renderOptions)
+{
+    const auto xmiData = read_file(inputPath);
+    const auto gtlData = read_file(timbrePath);
+    std::mutex outputMutex;
+
+    const auto render_one = [&](std::size_t index, const std::filesystem::path& outputPath)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const auto wav = xmi2mid::render_wav(xmiData, index, gtlData, renderOptions);
+        write_file(outputPath, wav);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const std::size_t frameBytes = renderOptions.chip == xmi2mid::opl_chip_type::opl3 ? 4 : 2;
+        const double audioSeconds = static_cast<double>(wav.size() - 44) / frameBytes / renderOptions.sample_rate;
+        std::lock_guard lock(outputMutex);
+        std::cout << std::fixed << std::setprecision(2) << "Rendered sequence " << index << " from "
+                  << inputPath.string() << " to " << outputPath.string() << " (" << audioSeconds << " s of audio, "
+                  << audioSeconds / seconds << "x real time)\n";
+    };
+
+    if (!allSequences)
+    {
+        render_one(sequenceIndex, outputTarget);
+        return;
+    }
+
+    xmi2mid::global_timbres(gtlData);
+    const std::size_t sequenceCount = xmi2mid::sequence_infos(xmiData).size();
+    std::atomic<bool> failed = false;
+    thread_pool pool(std::min<std::size_t>(sequenceCount, std::max(1U, std::thread::hardware_concurrency())));
+    for (std::size_t index = 0; index < sequenceCount; ++index)
+    {
+        pool.submit([&, index]
+        {
+            try
+            {
+                render_one(index, suffixed_output_path(inputPath, outputTarget, sequence_suffix(index, sequenceCount),
+                                                       ".wav"));
+            }
+            catch (const std::exception& failure)
+            {
+                failed = true;
+                std::lock_guard lock(outputMutex);
+                std::cerr << "Error: sequence " << index << ": " << failure.what() << '\n';
+            }
+        });
+    }
+    pool.wait();
+
+    if (failed)
+    {
+        throw std::runtime_error("Some sequences could not be rendered");
+    }
+}
+
+void write_playback_files(const std::filesystem::path& inputPath, const std::filesystem::path& outputTarget,
+                          std::size_t sequenceIndex, bool allSequences, const xmi2mid::playback_options& options)
+{
+    const auto xmiData = read_file(inputPath);
+    const auto compile_one = [&](std::size_t index, const std::filesystem::path& outputPath)
+    {
+        write_file(outputPath, xmi2mid::compile_playback(xmiData, index, options));
+        std::cout << "Compiled sequence " << index << " from " << inputPath.string() << " to "
+                  << outputPath.string() << '\n';
+    };
+
+    if (!allSequences)
+    {
+        compile_one(sequenceIndex, outputTarget);
+        return;
+    }
+
+    const std::size_t sequenceCount = xmi2mid::sequence_infos(xmiData).size();
+    for (std::size_t index = 0; index < sequenceCount; ++index)
+    {
+        compile_one(index, suffixed_output_path(inputPath, outputTarget, sequence_suffix(index, sequenceCount), ".xpb"));
+    }
+}
+
+// Walks the track convert() writes the way an SMF player does: varlen deltas,
+// running status and length-prefixed SysEx and meta events.
+template <typename Handler>
+void dispatch_smf(std::span<const std::uint8_t> midi, Handler&& handler)
+{
+    const std::uint8_t* cursor = midi.data() + xmi2mid::detail::smf_render::TrackDataOffset;
+    const std::uint8_t* const end = midi.data() + midi.size();
+    std::uint32_t time = 0;
+    std::uint8_t status = 0;
+    while (cursor < end)
+    {
+        time += xmi2mid::detail::read_midi_varlen(cursor, end);
+        if (cursor < end && (*cursor & 0x80) != 0)
+        {
+            status = *cursor++;
+        }
+
+        std::uint32_t message = status;
+        if (status == 0xFF || status == 0xF0 || status == 0xF7)
+        {
+            if (status == 0xFF && cursor < end)
+            {
+                message |= std::uint32_t{*cursor++} << 8;
+            }
+            const std::uint32_t length = xmi2mid::detail::read_midi_varlen(cursor, end);
+            xmi2mid::detail::need_midi_bytes(cursor, end, length, "event");
+            cursor += length;
+        }
+        else
+        {
+            const std::size_t dataBytes = xmi2mid::detail::channel_event_size(status) - 1;
+            xmi2mid::detail::need_midi_bytes(cursor, end, dataBytes, "channel event");
+            message |= std::uint32_t{cursor[0]} << 8;
+            if (dataBytes == 2)
+            {
+                message |= std::uint32_t{cursor[1]} << 16;
+            }
+            cursor += dataBytes;
+        }
+        handler(time, message);
+    }
+}
+
+// Times handing every event of every sequence to a trivial handler, once by
+// parsing the MIDI from convert() and once from playback blobs.
+void bench_playback(const std::filesystem::path& inputPath, std::size_t repeat)
+{
+    const auto xmiData = read_file(inputPath);
+    const std::size_t sequenceCount = xmi2mid::sequence_infos(xmiData).size();
+    std::vector<std::vector<std::uint8_t>> midis;
+    std::vector<std::vector<std::uint8_t>> blobs;
+    midis.reserve(sequenceCount);
+    blobs.reserve(sequenceCount);
+    for (std::size_t index = 0; index < sequenceCount; ++index)
+    {
+        midis.push_back(xmi2mid::convert(xmiData, index));
+        blobs.push_back(xmi2mid::compile_playback(xmiData, index));
+    }
+
+    std::uint64_t checksum = 0;
+    std::size_t smfEvents = 0;
+    std::size_t blobEvents = 0;
+    const auto smfStart = std::chrono::steady_clock::now();
+    for (std::size_t iteration = 0; iteration < repeat; ++iteration)
+    {
+        for (const auto& midi : midis)
+        {
+            dispatch_smf(midi, [&](std::uint32_t time, std::uint32_t message)
+            {
+                checksum += time ^ message;
+                ++smfEvents;
+            });
+        }
+    }
+    const auto blobStart = std::chrono::steady_clock::now();
+    for (std::size_t iteration = 0; iteration < repeat; ++iteration)
+    {
+        for (const auto& blob : blobs)
+        {
+            const xmi2mid::playback_view view(blob);
+            view.play(0, view.length_ticks(), [&](const xmi2mid::playback_event& event)
+            {
+                checksum += event.time ^ event.message;
+                ++blobEvents;
+            });
+        }
+    }
+    const auto blobEnd = std::chrono::steady_clock::now();
+
+    if (smfEvents != blobEvents)
+    {
+        throw std::runtime_error("Playback blobs and MIDI hold different event counts");
+    }
+    const double events = static_cast<double>(std::max<std::size_t>(smfEvents, 1));
+    const double smfNanos = std::chrono::duration<double, std::nano>(blobStart - smfStart).count() / events;
+    const double blobNanos = std::chrono::duration<double, std::nano>(blobEnd - blobStart).count() / events;
+    std::cout << std::fixed << std::setprecision(2) << "Dispatched " << smfEvents / repeat << " events from "
+              << sequenceCount << " sequence(s) of " << inputPath.string() << ' ' << repeat << " times: SMF "
+              << smfNanos << " ns/event, playback blob " << blobNanos << " ns/event (" << smfNanos / blobNanos
+              << "x, checksum " << std::hex << checksum << std::dec << ")\n";
+}
+
+bool is_xmi_path(const std::filesystem::path& path)
+{
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char ch)
+    {
+        return static_cast<char>(std::tolower(ch));
+    });
+    return extension == ".xmi";
+}
+
+struct batch_input
+{
+    std::filesystem::path path;
+    std::filesystem::path relative_parent;
+};
+
+// Expands batch arguments: files are taken as given, directories are searched
+// recursively for .xmi files and keep their relative layout in the output.
+std::vector<batch_input> collect_batch_inputs(std::span<char* const> arguments)
+{
+    std::vector<batch_input> inputs;
+    for (const char* argument : arguments)
+    {
+        const std::filesystem::path path = argument;
+        if (!std::filesystem::is_directory(path))
+        {
+            inputs.push_back({path, {}});
+            continue;
+        }
+
+        std::vector<batch_input> found;
+        std::filesystem::path parent;
+        std::filesystem::path relativeParent;
+        for (const auto& item : std::filesystem::recursive_directory_iterator(path))
+        {
+            if (!item.is_regular_file() || !is_xmi_path(item.path()))
+            {
+                continue;
+            }
+
+            if (item.path().parent_path() != parent)
+            {
+                parent = item.path().parent_path();
+                relativeParent = parent.lexically_relative(path);
+            }
+            found.push_back({item.path(), relativeParent});
+        }
+
+        std::sort(found.begin(), found.end(), [](const batch_input& left, const batch_input& right)
+        {
+            return left.path.native() < right.path.native();
+        });
+        inputs.insert(inputs.end(), found.begin(), found.end());
+    }
+    return inputs;
+}
+
+// MIDIFORM's directory chunk is 22 bytes; leave room for other INFO layouts.
+constexpr std::size_t DirectoryPrefixBytes = 256;
+
+// Prints each input's sequence count. Files with an XDIR INFO count are only
+// read as far as the directory unless `verify` asks for a catalog cross-check.
+void print_sequence_counts(const std::vector<batch_input>& inputs, bool verify)
+{
+    const xmi2mid::directory_check check = verify ? xmi2mid::directory_check::verify : xmi2mid::directory_check::trust;
+    std::string text;
+    bool failed = false;
+    for (const batch_input& input : inputs)
+    {
+        try
+        {
+            std::optional<std::size_t> count;
+            if (!verify)
+            {
+                count = xmi2mid::directory_sequence_count(read_file_prefix(input.path, DirectoryPrefixBytes));
+            }
+            if (!count)
+            {
+                count = xmi2mid::sequence_count(read_file(input.path), check);
+            }
+            text += input.path.string() + ": " + std::to_string(*count) + " sequence(s)\n";
+        }
+        catch (const std::exception& failure)
+        {
+            failed = true;
+            std::cout << text << std::flush;
+            text.clear();
+            std::cerr << "Error: " << input.path.string() << ": " << failure.what() << '\n';
+        }
+    }
+    std::cout << text;
+
+    if (failed)
+    {
+        throw std::runtime_error("Some files could not be counted");
+    }
+}
+
+std::filesystem::path batch_output_path(const batch_input& input, const std::filesystem::path& outputDirectory,
+                                        std::size_t index, std::size_t count)
+{
+    return outputDirectory / input.relative_parent /
+           (input.path.stem().string() + "_" + sequence_suffix(index, count) + ".mid");
+}
+
+void append_json_string(std::string& text, std::string_view value)
+{
+    text += '"';
+    for (const char ch : value)
+    {
+        if (ch == '"' || ch == '\\')
+        {
+            text += '\\';
+            text += ch;
+        }
+        else if (static_cast<unsigned char>(ch) < 0x20)
+        {
+            text += "\\u00";
+            append_number(text, static_cast<unsigned char>(ch), 16);
+        }
+        else
+        {
+            text += ch;
+        }
+    }
+    text += '"';
+}
+
+template <typename Values>
+void append_json_array(std::string& text, const Values& values)
+{
+    text += '[';
+    bool first = true;
+    for (const auto value : values)
+    {
+        if (!first)
+        {
+            text += ',';
+        }
+        first = false;
+        text += std::to_string(value);
+    }
+    text += ']';
+}
+
+std::string analysis_json(const std::filesystem::path& inputPath, std::size_t sequenceIndex,
+                          const xmi2mid::sequence_analysis& analysis)
+{
+    std::string line = "{\"file\":";
+    append_json_string(line, inputPath.string());
+    line += ",\"sequence\":" + std::to_string(sequenceIndex);
+
+    char seconds[32];
+    const auto written = std::to_chars(seconds, seconds + sizeof(seconds), analysis.seconds,
+                                       std::chars_format::fixed, 3);
+    line += ",\"seconds\":";
+    line.append(seconds, written.ptr);
+    line += ",\"ticks\":" + std::to_string(analysis.ticks);
+
+    line += ",\"notes\":";
+    append_json_array(line, analysis.notes);
+    if (analysis.lowest_note <= analysis.highest_note)
+    {
+        line += ",\"lowest_note\":" + std::to_string(analysis.lowest_note);
+        line += ",\"highest_note\":" + std::to_string(analysis.highest_note);
+    }
+    else
+    {
+        line += ",\"lowest_note\":null,\"highest_note\":null";
+    }
+    line += ",\"peak_polyphony\":" + std::to_string(analysis.peak_polyphony);
+
+    std::vector<int> programs;
+    for (std::size_t program = 0; program < analysis.programs.size(); ++program)
+    {
+        if (analysis.programs[program])
+        {
+            programs.push_back(static_cast<int>(program));
+        }
+    }
+    line += ",\"programs\":";
+    append_json_array(line, programs);
+
+    line += ",\"tempo_changes\":[";
+    for (std::size_t i = 0; i < analysis.tempo_changes.size(); ++i)
+    {
+        line += i == 0 ? "{\"tick\":" : ",{\"tick\":";
+        line += std::to_string(analysis.tempo_changes[i].tick);
+        line += ",\"quarter_note_micros\":" + std::to_string(analysis.tempo_changes[i].quarter_note_micros) + "}";
+    }
+    line += "],\"sysex_bytes\":" + std::to_string(analysis.sysex_bytes);
+    line += ",\"ail_controllers\":";
+    append_json_array(line, analysis.ail_controllers);
+    line += "}\n";
+    return line;
+}
+
+// Analyzes every sequence of every input on a thread pool: one job per file
+// reads it, then one job per sequence decodes it. Lines are printed in input
+// and sequence order once all jobs finish.
+void run_analyze(const std::vector<batch_input>& inputs)
+{
+    std::vector<std::vector<std::string>> lines(inputs.size());
+    std::atomic<bool> failed = false;
+    std::mutex errorMutex;
+    const auto report = [&](const std::filesystem::path& path, const std::string& what)
+    {
+        failed = true;
+        std::lock_guard lock(errorMutex);
+        std::cerr << "Error: " << path.string() << ": " << what << '\n';
+    };
+
+    thread_pool pool;
+    for (std::size_t file = 0; file < inputs.size(); ++file)
+    {
+        pool.submit([&, file]
+        {
+            const std::filesystem::path& path = inputs[file].path;
+            try
+            {
+                auto xmiData = std::make_shared<const std::vector<std::uint8_t>>(read_file(path));
+                const std::size_t sequenceCount = xmi2mid::sequence_infos(*xmiData).size();
+                lines[file].resize(sequenceCount);
+                for (std::size_t index = 0; index < sequenceCount; ++index)
+                {
+                    pool.submit([&, file, index, xmiData]
+                    {
+                        try
+                        {
+                            lines[file][index] = analysis_json(path, index, xmi2mid::analyze(*xmiData, index));
+                        }
+                        catch (const std::exception& failure)
+                        {
+                            report(path, "sequence " + std::to_string(index) + ": " + failure.what());
+                        }
+                    });
+                }
+            }
+            catch (const std::exception& failure)
+            {
+                report(path, failure.what());
+            }
+        });
+    }
+    pool.wait();
+
+    std::string text;
+    for (const auto& fileLines : lines)
+    {
+        for (const std::string& line : fileLines)
+        {
+            text += line;
+        }
+    }
+    std::cout << text;
+
+    if (failed)
+    {
+        throw std::runtime_error("Some sequences could not be analyzed");
+    }
+}
+
+// Shards are this large so each scan job stays busy well past its setup cost.
+constexpr std::size_t ScanShardBytes = std::size_t{32} << 20;
+
+// Scans a file for embedded XMI images in parallel shards, then converts every
+// sequence of every image straight from the mapped file.
+void run_scan(const cli_options& options, const std::filesystem::path& inputPath,
+              const std::filesystem::path& outputDirectory)
+{
+    const mapped_file input(inputPath);
+    const std::span<const std::uint8_t> data = input.bytes();
+    const auto start = std::chrono::steady_clock::now();
+
+    const std::size_t shardCount = std::max<std::size_t>(1, (data.size() + ScanShardBytes - 1) / ScanShardBytes);
+    std::vector<std::vector<xmi2mid::embedded_xmi>> shards(shardCount);
+    thread_pool pool(std::min<std::size_t>(shardCount, std::max(1U, std::thread::hardware_concurrency())));
+    for (std::size_t shard = 0; shard < shardCount; ++shard)
+    {
+        pool.submit([&, shard]
+        {
+            shards[shard] = xmi2mid::find_embedded(data, shard * ScanShardBytes, (shard + 1) * ScanShardBytes);
+        });
+    }
+    pool.wait();
+
+    // A shard that starts inside an image finds the sequences nested in it;
+    // the image found by the earlier shard already covers them.
+    std::vector<xmi2mid::embedded_xmi> images;
+    std::size_t coveredEnd = 0;
+    for (const auto& found : shards)
+    {
+        for (const xmi2mid::embedded_xmi& image : found)
+        {
+            if (image.offset >= coveredEnd)
+            {
+                images.push_back(image);
+                coveredEnd = image.offset + image.size;
+            }
+        }
+    }
+    const double scanSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::filesystem::create_directories(outputDirectory);
+    std::vector<std::string> lines(images.size());
+    std::atomic<bool> failed = false;
+    for (std::size_t index = 0; index < images.size(); ++index)
+    {
+        pool.submit([&, index]
+        {
+            const xmi2mid::embedded_xmi& image = images[index];
+            const auto xmi = data.subspan(image.offset, image.size);
+            const std::string stem = inputPath.stem().string() + "_" + hex64(image.offset).substr(4);
+            std::string line = "Found XMI at offset " + std::to_string(image.offset) + " (" +
+                               std::to_string(image.size) + " bytes, " + std::to_string(image.sequence_count) +
+                               " sequence(s))\n";
+            for (std::size_t sequence = 0; sequence < image.sequence_count; ++sequence)
+            {
+                const std::filesystem::path outputPath =
+                    outputDirectory / (stem + "_" + sequence_suffix(sequence, image.sequence_count) + ".mid");
+                try
+                {
+                    write_file(outputPath, convert_sequence(options.unroll_loops, options.conversion, xmi, sequence));
+                    line += "  converted sequence " + std::to_string(sequence) + " to " + outputPath.string() + "\n";
+                }
+                catch (const std::exception& failure)
+                {
+                    failed = true;
+                    line += "  Error: sequence " + std::to_string(sequence) + ": " + failure.what() + "\n";
+                }
+            }
+            lines[index] = std::move(line);
+        });
+    }
+    pool.wait();
+
+    for (const std::string& line : lines)
+    {
+        std::cout << line;
+    }
+    std::cout << std::fixed << std::setprecision(1) << "Scanned " << data.size() << " bytes of "
+              << inputPath.string() << " in " << shardCount << " shard(s) at "
+              << static_cast<double>(data.size()) / (1 << 20) / std::max(scanSeconds, 1e-9) << " MiB/s, found "
+              << images.size() << " XMI image(s)\n";
+
+    if (failed)
+    {
+        throw std::runtime_error("Some sequences could not be converted");
+    }
+}
+
+// Sequences of one input file to copy, unchanged, into a catalog.
+struct catalog_source
+{
+    std::filesystem::path path;
+    std::vector<xmi2mid::sequence_info> sequences;
+};
+
+catalog_source read_catalog_source(const std::filesystem::path& path)
+{
+    // Only the pages holding chunk headers are touched while parsing.
+    const mapped_file input(path);
+    return {path, xmi2mid::sequence_infos(input.bytes())};
+}
+
+#if defined(__linux__)
+class unique_descriptor
+{
+public:
+    explicit unique_descriptor(int descriptor) : descriptor_(descriptor) {}
+    unique_descriptor(const unique_descriptor&) = delete;
+    unique_descriptor& operator=(const unique_descriptor&) = delete;
+
+    ~unique_descriptor()
+    {
+        if (descriptor_ >= 0)
+        {
+            ::close(descriptor_);
+        }
+    }
+
+    int get() const
+    {
+        return descriptor_;
+    }
+
+private:
+    int descriptor_;
+};
+
+// Appends part of the input to the output without the bytes passing through
+// this process: copy_file_range, or sendfile where the file systems cannot
+// share one copy (EXDEV on older kernels, or no support at all).
+void copy_descriptor_range(int input, int output, std::size_t offset, std::size_t size, bool& copyRange)
+{
+    while (size > 0)
+    {
+        ssize_t count = 0;
+        if (copyRange)
+        {
+            loff_t position = static_cast<loff_t>(offset);
+            count = ::copy_file_range(input, &position, output, nullptr, size, 0);
+            if (count < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                copyRange = false;
+                continue;
+            }
+        }
+        else
+        {
+            off_t position = static_cast<off_t>(offset);
+            count = ::sendfile(output, input, &position, size);
+        }
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), copyRange ? "copy_file_range" : "sendfile");
+        }
+        if (count == 0)
+        {
+            throw std::runtime_error("Input file ended inside a sequence");
+        }
+        offset += static_cast<std::size_t>(count);
+        size -= static_cast<std::size_t>(count);
+    }
+}
+#endif
+
+// Writes the selected FORM XMID chunks as one catalog behind a fresh XDIR
+// directory. Events are never decoded, and on Linux the chunk bytes are copied
+// inside the kernel. The catalog is written beside the output and renamed over
+// it, so an output that is also a source is read intact and an error leaves no
+// partial file.
+void write_catalog(const std::filesystem::path& outputPath, std::span<const catalog_source> sources)
+{
+    std::vector<std::size_t> formSizes;
+    for (const catalog_source& source : sources)
+    {
+        for (const xmi2mid::sequence_info& sequence : source.sequences)
+        {
+            formSizes.push_back(sequence.form_size);
+        }
+    }
+    const std::vector<std::uint8_t> header = xmi2mid::catalog_header(formSizes);
+
+    const std::filesystem::path temporary = temporary_sibling(outputPath);
+    try
+    {
+#if defined(__linux__)
+        const unique_descriptor output(::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+        if (output.get() < 0)
+        {
+            throw std::runtime_error("Cannot open output file " + outputPath.string());
+        }
+        write_descriptor(output.get(), header);
+
+        bool copyRange = true;
+        const std::uint8_t pad[1] = {0};
+        for (const catalog_source& source : sources)
+        {
+            const unique_descriptor input(::open(source.path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (input.get() < 0)
+            {
+                throw std::runtime_error("Cannot open input file " + source.path.string());
+            }
+            for (const xmi2mid::sequence_info& sequence : source.sequences)
+            {
+                copy_descriptor_range(input.get(), output.get(), sequence.form_offset, sequence.form_size, copyRange);
+                if ((sequence.form_size & 1) != 0)
+                {
+                    write_descriptor(output.get(), pad);
+                }
+            }
+        }
+#else
+        std::vector<std::uint8_t> xmi = header;
+        for (const catalog_source& source : sources)
+        {
+            const mapped_file input(source.path);
+            for (const xmi2mid::sequence_info& sequence : source.sequences)
+            {
+                const auto form = input.bytes().subspan(sequence.form_offset, sequence.form_size);
+                xmi.insert(xmi.end(), form.begin(), form.end());
+                if ((form.size() & 1) != 0)
+                {
+                    xmi.push_back(0);
+                }
+            }
+        }
+        write_file(temporary, xmi);
+#endif
+        std::error_code error;
+        std::filesystem::rename(temporary, outputPath, error);
+        if (error)
+        {
+            throw std::runtime_error("Cannot write output file " + outputPath.string());
+        }
+    }
+    catch (const std::exception&)
+    {
+        std::error_code error;
+        std::filesystem::remove(temporary, error);
+        throw;
+    }
+}
+
+// Whether `path` is `root` or inside it, comparing the paths as written, as
+// collect_batch_inputs() builds input paths from its arguments.
+bool is_within(const std::filesystem::path& path, const std::filesystem::path& root)
+{
+    const auto [rootPart, pathPart] = std::mismatch(root.begin(), root.end(), path.begin(), path.end());
+    return rootPart == root.end() || (rootPart->empty() && std::next(rootPart) == root.end());
+}
+
+// Incremental build state for --batch: the size, modification time, and
+// content hash of every input, plus the outputs each one produced. Inputs
+// whose size and time still match are skipped without being opened.
+class build_manifest
+{
+public:
+    struct input_state
+    {
+        std::uintmax_t size = 0;
+        std::int64_t time = 0;
+        std::uint64_t hash = 0;
+        std::vector<std::string> outputs;
+        bool seen = false;
+    };
+
+    build_manifest(std::filesystem::path path, std::string header)
+        : path_(std::move(path)), header_(std::move(header))
+    {
+        std::ifstream file(path_, std::ios::binary);
+        if (!file)
+        {
+            return;
+        }
+
+        std::string line;
+        if (!std::getline(file, line) || line != header_)
+        {
+            return;
+        }
+
+        input_state* current = nullptr;
+        while (std::getline(file, line))
+        {
+            if (line.size() > 2 && line[0] == 'O' && line[1] == '\t' && current != nullptr)
+            {
+                current->outputs.push_back(line.substr(2));
+                continue;
+            }
+
+            // I <size> <time> <hash>\t<path>
+            const std::size_t tab = line.find('\t');
+            if (line.size() < 2 || line[0] != 'I' || line[1] != ' ' || tab == std::string::npos)
+            {
+                throw std::runtime_error("Invalid manifest " + path_.string());
+            }
+
+            input_state state{};
+            const char* field = line.data() + 2;
+            const char* const fieldsEnd = line.data() + tab;
+            auto parse_field = [&](auto& value, int base)
+            {
+                const auto [next, error] = std::from_chars(field, fieldsEnd, value, base);
+                if (error != std::errc{})
+                {
+                    throw std::runtime_error("Invalid manifest " + path_.string());
+                }
+                field = next < fieldsEnd ? next + 1 : next;
+            };
+            parse_field(state.size, 10);
+            parse_field(state.time, 10);
+            parse_field(state.hash, 16);
+
+            std::string inputPath = line.substr(tab + 1);
+            current = &inputs_.insert_or_assign(std::move(inputPath), std::move(state)).first->second;
+        }
+    }
+
+    input_state* find(const std::string& inputPath)
+    {
+        const auto found = inputs_.find(inputPath);
+        return found == inputs_.end() ? nullptr : &found->second;
+    }
+
+    input_state& update(const std::string& inputPath, input_state state)
+    {
+        changed_ = true;
+        state.seen = true;
+        return inputs_.insert_or_assign(inputPath, std::move(state)).first->second;
+    }
+
+    void mark_changed()
+    {
+        changed_ = true;
+    }
+
+    void erase(const std::string& inputPath)
+    {
+        if (inputs_.erase(inputPath) != 0)
+        {
+            changed_ = true;
+        }
+    }
+
+    // Drops inputs under `roots` that were not seen in this run and returns
+    // their outputs. Inputs elsewhere were not searched, so they are kept.
+    std::vector<std::string> take_unseen_outputs(std::span<const std::filesystem::path> roots)
+    {
+        std::vector<std::string> outputs;
+        for (auto input = inputs_.begin(); input != inputs_.end();)
+        {
+            const std::filesystem::path inputPath = input->first;
+            const bool searched = std::any_of(roots.begin(), roots.end(), [&](const std::filesystem::path& root)
+            {
+                return is_within(inputPath, root);
+            });
+            if (input->second.seen || !searched)
+            {
+                ++input;
+                continue;
+            }
+
+            outputs.insert(outputs.end(), input->second.outputs.begin(), input->second.outputs.end());
+            input = inputs_.erase(input);
+            changed_ = true;
+        }
+        return outputs;
+    }
+
+    void save()
+    {
+        if (!changed_)
+        {
+            return;
+        }
+
+        std::vector<const decltype(inputs_)::value_type*> sorted;
+        sorted.reserve(inputs_.size());
+        for (const auto& input : inputs_)
+        {
+            sorted.push_back(&input);
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const auto* left, const auto* right)
+        {
+            return left->first < right->first;
+        });
+
+        std::string text = header_ + "\n";
+        for (const auto* input : sorted)
+        {
+            text += "I " + std::to_string(input->second.size) + " " + std::to_string(input->second.time) + " " +
+                    hex64(input->second.hash) + "\t" + input->first + "\n";
+            for (const std::string& output : input->second.outputs)
+            {
+                text += "O\t" + output + "\n";
+            }
+        }
+
+        const std::filesystem::path temporary = path_.string() + ".tmp";
+        write_file(temporary, {reinterpret_cast<const std::uint8_t*>(text.data()), text.size()});
+        std::filesystem::rename(temporary, path_);
+        changed_ = false;
+    }
+
+private:
+    std::filesystem::path path_;
+    std::string header_;
+    std::unordered_map<std::string, input_state> inputs_;
+    bool changed_ = false;
+};
+
+// Opens the manifest the options name, if any, for outputs in
+// `outputDirectory`.
+std::optional<build_manifest> open_manifest(const cli_options& options, const std::filesystem::path& outputDirectory)
+{
+    std::optional<build_manifest> manifest;
+    if (options.manifest_path)
+    {
+        manifest.emplace(*options.manifest_path, "xmi2mid-manifest v1 " + conversion_fingerprint(options) + " " +
+                                                     outputDirectory.string());
+    }
+    return manifest;
+}
+
+struct batch_summary
+{
+    std::size_t files = 0;
+    std::size_t changed_files = 0;
+    std::size_t sequences = 0;
+    std::size_t reused = 0;
+    std::size_t removed = 0;
+    std::size_t failed = 0;
+};
+
+// Inputs read by one batch_io group. The next group is read while this one
+// converts.
+constexpr std::size_t BatchReadGroup = 64;
+
+// An output file and the sequence_writer::key() of the sequence it holds.
+struct sequence_output
+{
+    std::string key;
+    std::string path;
+};
+
+// `roots` are the batch arguments. With a manifest, outputs of recorded
+// inputs under them that no longer exist are removed. `produced`, when given,
+// receives every input's outputs by input path; inputs the manifest skipped
+// were not read, so their keys are empty. An input that cannot be read or
+// converted is reported and counted in `failed`; the batch goes on, and the
+// manifest keeps that input's previous entry so the next run tries it again.
+batch_summary run_batch(const cli_options& options, const std::filesystem::path& outputDirectory,
+                        const std::vector<batch_input>& inputs, std::span<const std::filesystem::path> roots,
+                        std::unordered_map<std::string, std::vector<sequence_output>>* produced = nullptr)
+{
+    batch_summary summary{};
+    summary.files = inputs.size();
+    sequence_writer writer(options);
+    batch_io io;
+
+    std::optional<build_manifest> manifest = open_manifest(options, outputDirectory);
+
+    // A skipped input must still have every output it produced.
+    auto outputs_exist = [](const build_manifest::input_state& state)
+    {
+        return std::all_of(state.outputs.begin(), state.outputs.end(), [](const std::string& output)
+        {
+            std::error_code error;
+            return std::filesystem::exists(output, error);
+        });
+    };
+
+    auto record_skipped = [&](const std::string& inputKey, const build_manifest::input_state& state)
+    {
+        if (produced != nullptr)
+        {
+            std::vector<sequence_output>& outputs = (*produced)[inputKey];
+            for (const std::string& output : state.outputs)
+            {
+                outputs.push_back({{}, output});
+            }
+        }
+    };
+
+    auto remove_output = [&](const std::string& output)
+    {
+        std::error_code error;
+        if (std::filesystem::remove(output, error))
+        {
+            ++summary.removed;
+        }
+    };
+
+    auto record_failure = [&](const batch_input& input, build_manifest::input_state* previous,
+                              std::string_view message)
+    {
+        std::cerr << "Error: " << input.path.string() << ": " << message << '\n';
+        ++summary.failed;
+        if (previous != nullptr)
+        {
+            previous->seen = true;
+        }
+    };
+
+    struct pending_input
+    {
+        const batch_input* input = nullptr;
+        build_manifest::input_state* previous = nullptr;
+        build_manifest::input_state current{};
+    };
+
+    // Skips inputs the manifest shows unchanged and starts reading up to
+    // BatchReadGroup of the rest.
+    std::size_t nextInput = 0;
+    auto start_group = [&]
+    {
+        std::vector<pending_input> group;
+        std::vector<std::filesystem::path> paths;
+        for (; nextInput < inputs.size() && group.size() < BatchReadGroup; ++nextInput)
+        {
+            const batch_input& input = inputs[nextInput];
+            const std::string inputKey = input.path.string();
+            pending_input pending{&input, manifest ? manifest->find(inputKey) : nullptr, {}};
+
+            if (manifest)
+            {
+                if (inputKey.find('\n') != std::string::npos)
+                {
+                    throw std::runtime_error("Cannot record input path with a newline in the manifest");
+                }
+
+                // A stat failure leaves zeros, so the read reports it.
+                std::error_code error;
+                const std::filesystem::directory_entry entry(input.path, error);
+                pending.current.size = entry.file_size(error);
+                pending.current.time =
+                    static_cast<std::int64_t>(entry.last_write_time(error).time_since_epoch().count());
+                if (!error && pending.previous != nullptr && pending.previous->size == pending.current.size &&
+                    pending.previous->time == pending.current.time && outputs_exist(*pending.previous))
+                {
+                    pending.previous->seen = true;
+                    record_skipped(inputKey, *pending.previous);
+                    continue;
+                }
+            }
+
+            paths.push_back(input.path);
+            group.push_back(std::move(pending));
+        }
+        io.start_reads(paths);
+        return group;
+    };
+
+    for (std::vector<pending_input> group = start_group(); !group.empty();)
+    {
+        std::vector<file_read> contents = io.finish_reads();
+        std::vector<pending_input> following = start_group();
+
+        for (std::size_t index = 0; index < group.size(); ++index)
+        {
+            const batch_input& input = *group[index].input;
+            build_manifest::input_state* const previous = group[index].previous;
+            build_manifest::input_state& current = group[index].current;
+            if (!contents[index].error.empty())
+            {
+                record_failure(input, previous, contents[index].error);
+                continue;
+            }
+
+            const std::vector<std::uint8_t>& xmiData = contents[index].bytes;
+            if (manifest)
+            {
+                current.hash = hash_bytes(xmiData);
+                if (previous != nullptr && previous->hash == current.hash && outputs_exist(*previous))
+                {
+                    previous->size = current.size;
+                    previous->time = current.time;
+                    previous->seen = true;
+                    manifest->mark_changed();
+                    record_skipped(input.path.string(), *previous);
+                    continue;
+                }
+            }
+
+            const xmi2mid::result<std::vector<xmi2mid::sequence_info>> sequences =
+                xmi2mid::try_sequence_infos(xmiData);
+            if (!sequences)
+            {
+                record_failure(input, previous, xmi2mid::to_string(sequences.error()));
+                continue;
+            }
+
+            ++summary.changed_files;
+            std::vector<sequence_output> outputs;
+            try
+            {
+                std::filesystem::create_directories(outputDirectory / input.relative_parent);
+                for (const xmi2mid::sequence_info& sequence : *sequences)
+                {
+                    const std::filesystem::path outputPath =
+                        batch_output_path(input, outputDirectory, sequence.index, sequences->size());
+                    if (writer.write(xmiData, sequence, outputPath, &io))
+                    {
+                        ++summary.reused;
+                    }
+                    current.outputs.push_back(outputPath.string());
+                    if (produced != nullptr)
+                    {
+                        outputs.push_back({writer.key(xmiData, sequence), outputPath.string()});
+                    }
+                    ++summary.sequences;
+                }
+            }
+            catch (const std::exception& failure)
+            {
+                record_failure(input, previous, failure.what());
+                continue;
+            }
+            if (produced != nullptr)
+            {
+                (*produced)[input.path.string()] = std::move(outputs);
+            }
+
+            if (manifest)
+            {
+                if (previous != nullptr)
+                {
+                    for (const std::string& output : previous->outputs)
+                    {
+                        if (std::find(current.outputs.begin(), current.outputs.end(), output) ==
+                            current.outputs.end())
+                        {
+                            remove_output(output);
+                        }
+                    }
+                }
+                manifest->update(input.path.string(), std::move(current));
+            }
+        }
+
+        io.submit();
+        group = std::move(following);
+    }
+    io.flush();
+
+    if (manifest)
+    {
+        for (const std::string& output : manifest->take_unseen_outputs(roots))
+        {
+            remove_output(output);
+        }
+        manifest->save();
+    }
+
+    return summary;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+volatile std::sig_atomic_t stopRequested = 0;
+
+extern "C" void request_stop(int)
+{
+    stopRequested = 1;
+}
+
+// Installs SIGINT and SIGTERM handlers without SA_RESTART, so blocking
+// poll(), accept(), and read() calls return EINTR once a stop is requested.
+void install_stop_handlers()
+{
+    struct sigaction stopAction{};
+    stopAction.sa_handler = request_stop;
+    sigemptyset(&stopAction.sa_mask);
+    ::sigaction(SIGINT, &stopAction, nullptr);
+    ::sigaction(SIGTERM, &stopAction, nullptr);
+}
+
+// Blocks SIGINT and SIGTERM in the calling thread while alive. Threads started
+// in that scope inherit the mask, so stop signals reach the thread that waits
+// in poll() or accept() instead of a worker.
+class stop_signals_blocked
+{
+public:
+    stop_signals_blocked()
+    {
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        ::pthread_sigmask(SIG_BLOCK, &stopSignals, &previous_);
+    }
+
+    stop_signals_blocked(const stop_signals_blocked&) = delete;
+    stop_signals_blocked& operator=(const stop_signals_blocked&) = delete;
+
+    ~stop_signals_blocked()
+    {
+        ::pthread_sigmask(SIG_SETMASK, &previous_, nullptr);
+    }
+
+private:
+    sigset_t previous_;
+};
+#endif
+
+#if defined(__linux__)
+// Keeps outputDirectory in sync with the .xmi files under inputDirectory.
+// inotify reports closed writes and renames; events are coalesced for a short
+// quiet period, then each changed file is converted on the worker pool. Only
+// sequences whose FORM XMID bytes or output name changed are written again.
+// A finished job wakes the loop through an eventfd, so a file changed while
+// it was converting is picked up without polling. With a manifest, every job
+// updates it and it is saved whenever no job runs, so a later --batch run
+// starts from what the watch left.
+void run_watch(const cli_options& options, const std::filesystem::path& inputDirectory,
+               const std::filesystem::path& outputDirectory)
+{
+    constexpr auto QuietPeriod = std::chrono::milliseconds(5);
+    constexpr auto MaxCoalesce = std::chrono::milliseconds(50);
+    constexpr auto EvictInterval = std::chrono::seconds(10);
+    constexpr std::uint32_t WatchMask =
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR;
+
+    if (!std::filesystem::is_directory(inputDirectory))
+    {
+        throw std::runtime_error("Cannot watch " + inputDirectory.string() + ": not a directory");
+    }
+
+    // Outputs of every input, indexed by sequence, as last written.
+    std::unordered_map<std::string, std::vector<sequence_output>> state;
+    {
+        char* inputArgument = const_cast<char*>(inputDirectory.c_str());
+        const batch_summary summary =
+            run_batch(options, outputDirectory, collect_batch_inputs(std::span<char* const>(&inputArgument, 1)),
+                      std::span<const std::filesystem::path>(&inputDirectory, 1), &state);
+        std::cout << "Converted " << summary.sequences << " sequence(s) from " << summary.changed_files << " of "
+                  << summary.files << " file(s) to " << outputDirectory.string() << '\n';
+    }
+    std::optional<build_manifest> manifest = open_manifest(options, outputDirectory);
+    std::mutex manifestMutex;
+
+    const int notify = ::inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (notify < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "inotify_init1");
+    }
+    const int jobDone = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (jobDone < 0)
+    {
+        ::close(notify);
+        throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+
+    std::unordered_map<int, std::filesystem::path> watches;
+    std::unordered_set<std::string> inFlight;
+    std::unordered_set<std::string> pending;
+    std::mutex stateMutex;
+    std::mutex outputMutex;
+
+    auto add_watch = [&](const std::filesystem::path& directory)
+    {
+        const int descriptor = ::inotify_add_watch(notify, directory.c_str(), WatchMask);
+        if (descriptor >= 0)
+        {
+            watches[descriptor] = directory;
+        }
+    };
+
+    // Visits everything under `root`. Directories can vanish while they are
+    // walked, so one that cannot be read is skipped instead of ending the
+    // watch.
+    auto for_each_entry = [](const std::filesystem::path& root, auto visit)
+    {
+        std::vector<std::filesystem::path> directories{root};
+        while (!directories.empty())
+        {
+            const std::filesystem::path directory = std::move(directories.back());
+            directories.pop_back();
+
+            std::error_code error;
+            for (std::filesystem::directory_iterator item(directory, error), end; !error && item != end;
+                 item.increment(error))
+            {
+                std::error_code typeError;
+                const bool isDirectory = item->is_directory(typeError) && !item->is_symlink(typeError);
+                if (isDirectory)
+                {
+                    directories.push_back(item->path());
+                }
+                visit(item->path(), isDirectory);
+            }
+        }
+    };
+
+    add_watch(inputDirectory);
+    for_each_entry(inputDirectory, [&](const std::filesystem::path& path, bool isDirectory)
+    {
+        if (isDirectory)
+        {
+            add_watch(path);
+        }
+    });
+
+    auto relative_parent = [&](const std::filesystem::path& path)
+    {
+        return path.parent_path().lexically_relative(inputDirectory);
+    };
+
+    // One cache serves the whole session; evicting walks all of it, so that
+    // waits until no job runs, at most once per EvictInterval.
+    std::optional<conversion_cache> cache;
+    if (options.cache_directory)
+    {
+        cache.emplace(*options.cache_directory, options.cache_limit);
+    }
+    auto lastEvict = std::chrono::steady_clock::now();
+
+    // Each job gets its own sequence_writer: outputs it remembers from an
+    // earlier job may since have been rewritten or removed.
+    auto convert_file = [&](const std::string& inputKey)
+    {
+        const batch_input input{inputKey, relative_parent(inputKey)};
+        sequence_writer writer(options, cache ? &*cache : nullptr);
+        std::vector<sequence_output> previous;
+        {
+            std::lock_guard lock(stateMutex);
+            if (const auto known = state.find(inputKey); known != state.end())
+            {
+                previous = known->second;
+            }
+        }
+
+        std::vector<sequence_output> current;
+        std::size_t written = 0;
+        std::error_code error;
+        const bool exists = std::filesystem::is_regular_file(input.path, error);
+        build_manifest::input_state recorded{};
+        if (exists)
+        {
+            if (manifest)
+            {
+                const std::filesystem::directory_entry entry(input.path);
+                recorded.size = entry.file_size();
+                recorded.time = static_cast<std::int64_t>(entry.last_write_time().time_since_epoch().count());
+            }
+            const auto xmiData = read_file(input.path);
+            if (manifest)
+            {
+                recorded.hash = hash_bytes(xmiData);
+            }
+            const auto sequences = xmi2mid::sequence_infos(xmiData);
+            std::filesystem::create_directories(outputDirectory / input.relative_parent);
+
+            for (const xmi2mid::sequence_info& sequence : sequences)
+            {
+                sequence_output entry{writer.key(xmiData, sequence),
+                                      batch_output_path(input, outputDirectory, sequence.index, sequences.size())
+                                          .string()};
+                const bool unchanged = sequence.index < previous.size() &&
+                                       previous[sequence.index].key == entry.key &&
+                                       previous[sequence.index].path == entry.path;
+                if (!unchanged)
+                {
+                    writer.write(xmiData, sequence, entry.path);
+                    ++written;
+                }
+                recorded.outputs.push_back(entry.path);
+                current.push_back(std::move(entry));
+            }
+        }
+
+        std::size_t removed = 0;
+        for (const sequence_output& old : previous)
+        {
+            const bool kept = std::any_of(current.begin(), current.end(), [&](const sequence_output& entry)
+            {
+                return entry.path == old.path;
+            });
+            if (!kept && std::filesystem::remove(old.path, error))
+            {
+                ++removed;
+            }
+        }
+
+        if (manifest)
+        {
+            std::lock_guard lock(manifestMutex);
+            if (exists)
+            {
+                manifest->update(inputKey, std::move(recorded));
+            }
+            else
+            {
+                manifest->erase(inputKey);
+            }
+        }
+
+        {
+            std::lock_guard lock(stateMutex);
+            if (current.empty())
+            {
+                state.erase(inputKey);
+            }
+            else
+            {
+                state[inputKey] = std::move(current);
+            }
+        }
+
+        std::lock_guard lock(outputMutex);
+        std::cout << "Updated " << inputKey << ": " << written << " sequence(s) converted, " << removed
+                  << " output(s) removed\n"
+                  << std::flush;
+    };
+
+    auto save_manifest = [&]
+    {
+        try
+        {
+            manifest->save();
+        }
+        catch (const std::exception& failure)
+        {
+            std::lock_guard lock(outputMutex);
+            std::cerr << "Error: " << failure.what() << '\n';
+        }
+    };
+
+    install_stop_handlers();
+
+    std::optional<thread_pool> workers;
+    {
+        const stop_signals_blocked blocked;
+        workers.emplace();
+    }
+    thread_pool& pool = *workers;
+
+    auto dispatch = [&]
+    {
+        std::lock_guard lock(stateMutex);
+        for (auto path = pending.begin(); path != pending.end();)
+        {
+            if (inFlight.contains(*path))
+            {
+                ++path;
+                continue;
+            }
+
+            inFlight.insert(*path);
+            pool.submit([&, inputKey = *path]
+            {
+                try
+                {
+                    convert_file(inputKey);
+                }
+                catch (const std::exception& failure)
+                {
+                    std::lock_guard outputLock(outputMutex);
+                    std::cerr << "Error: " << inputKey << ": " << failure.what() << '\n';
+                }
+
+                {
+                    std::lock_guard stateLock(stateMutex);
+                    inFlight.erase(inputKey);
+                }
+                const std::uint64_t one = 1;
+                [[maybe_unused]] const ssize_t signalled = ::write(jobDone, &one, sizeof(one));
+            });
+            path = pending.erase(path);
+        }
+    };
+
+    std::cout << "Watching " << inputDirectory.string() << " for XMI changes\n" << std::flush;
+
+    alignas(inotify_event) char buffer[64 * 1024];
+    auto burstStart = std::chrono::steady_clock::now();
+    bool collecting = false;
+
+    while (stopRequested == 0)
+    {
+        int timeout = collecting ? static_cast<int>(QuietPeriod.count()) : -1;
+        bool idle = !collecting && pending.empty();
+        if (idle)
+        {
+            std::lock_guard lock(stateMutex);
+            idle = inFlight.empty();
+        }
+        if (idle && manifest)
+        {
+            save_manifest();
+        }
+        if (idle && cache && cache->grown())
+        {
+            const auto now = std::chrono::steady_clock::now();
+            if (now - lastEvict >= EvictInterval)
+            {
+                cache->evict();
+                lastEvict = now;
+            }
+            else
+            {
+                timeout = static_cast<int>(
+                    std::chrono::ceil<std::chrono::milliseconds>(lastEvict + EvictInterval - now).count());
+            }
+        }
+        pollfd descriptors[2] = {{notify, POLLIN, 0}, {jobDone, POLLIN, 0}};
+        const int ready = ::poll(descriptors, 2, timeout);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "poll");
+        }
+
+        if ((descriptors[1].revents & POLLIN) != 0)
+        {
+            std::uint64_t finished = 0;
+            [[maybe_unused]] const ssize_t drained = ::read(jobDone, &finished, sizeof(finished));
+        }
+
+        if ((descriptors[0].revents & POLLIN) != 0)
+        {
+            for (;;)
+            {
+                const ssize_t length = ::read(notify, buffer, sizeof(buffer));
+                if (length <= 0)
+                {
+                    break;
+                }
+
+                for (const char* cursor = buffer; cursor < buffer + length;)
+                {
+                    const auto* event = reinterpret_cast<const inotify_event*>(cursor);
+                    cursor += sizeof(inotify_event) + event->len;
+
+                    const auto directory = watches.find(event->wd);
+                    if (directory == watches.end() || event->len == 0)
+                    {
+                        if ((event->mask & IN_IGNORED) != 0)
+                        {
+                            watches.erase(event->wd);
+                        }
+                        continue;
+                    }
+
+                    const std::filesystem::path path = directory->second / event->name;
+                    if ((event->mask & IN_ISDIR) != 0)
+                    {
+                        if ((event->mask & (IN_MOVED_FROM | IN_DELETE)) != 0)
+                        {
+                            // Every input below is gone; their jobs remove
+                            // the outputs. A moved-away tree keeps its
+                            // watches, so drop them.
+                            {
+                                std::lock_guard lock(stateMutex);
+                                for (const auto& known : state)
+                                {
+                                    if (is_within(known.first, path))
+                                    {
+                                        pending.insert(known.first);
+                                    }
+                                }
+                            }
+                            for (auto watch = watches.begin(); watch != watches.end();)
+                            {
+                                if (is_within(watch->second, path))
+                                {
+                                    ::inotify_rm_watch(notify, watch->first);
+                                    watch = watches.erase(watch);
+                                }
+                                else
+                                {
+                                    ++watch;
+                                }
+                            }
+                        }
+                        else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0)
+                        {
+                            add_watch(path);
+                            for_each_entry(path, [&](const std::filesystem::path& item, bool isDirectory)
+                            {
+                                if (isDirectory)
+                                {
+                                    add_watch(item);
+                                }
+                                else if (is_xmi_path(item))
+                                {
+                                    pending.insert(item.string());
+                                }
+                            });
+                        }
+                        continue;
+                    }
+
+                    if (is_xmi_path(path) && (event->mask & IN_CREATE) == 0)
+                    {
+                        pending.insert(path.string());
+                    }
+                }
+            }
+
+            if (!collecting)
+            {
+                collecting = true;
+                burstStart = std::chrono::steady_clock::now();
+            }
+        }
+
+        // Until the quiet period passes, keep collecting, whatever woke us.
+        if (collecting && ready > 0 && std::chrono::steady_clock::now() - burstStart < MaxCoalesce)
+        {
+            continue;
+        }
+
+        collecting = false;
+        dispatch();
+    }
+
+    pool.wait();
+    if (manifest)
+    {
+        save_manifest();
+    }
+    ::close(jobDone);
+    ::close(notify);
+    std::cout << "Stopped watching " << inputDirectory.string() << '\n';
+}
+#endif
+
+// Server protocol, used by --serve and --client. Integers are little-endian.
+//   request:  u8 source ('B' payload is XMI bytes, 'P' payload is a path the
+//             server reads, only with --allow-paths),
+//             u32 sequence index or AllSequences, u32 payload length, payload
+//   response: u8 status 0, u32 count, count x (u32 length, MIDI bytes)
+//             u8 status 1, u32 length, error message
+constexpr std::uint32_t AllSequences = 0xFFFFFFFFU;
+
+#if defined(__unix__) || defined(__APPLE__)
+constexpr std::uint32_t MaxRequestPayload = 256U * 1024U * 1024U;
+// Request and response bytes one connection may hold before the server stops
+// reading from it. A single request may still be up to MaxRequestPayload.
+constexpr std::size_t MaxQueuedBytes = std::size_t{64} << 20;
+
+struct server_request
+{
+    std::uint8_t source = 'B';
+    std::uint32_t sequence = 0;
+    std::vector<std::uint8_t> payload;
+};
+
+void append_le32(std::vector<std::uint8_t>& bytes, std::uint32_t value)
+{
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        bytes.push_back(static_cast<std::uint8_t>(value >> shift));
+    }
+}
+
+std::uint32_t checked_length(std::size_t size)
+{
+    if (size > std::numeric_limits<std::uint32_t>::max())
+    {
+        throw std::runtime_error("Message is too large for the server protocol");
+    }
+    return static_cast<std::uint32_t>(size);
+}
+
+// Returns false on end of stream before the first byte.
+bool read_exact(int descriptor, void* buffer, std::size_t size)
+{
+    auto* cursor = static_cast<char*>(buffer);
+    std::size_t done = 0;
+    while (done < size)
+    {
+        const ssize_t count = ::read(descriptor, cursor + done, size - done);
+        if (count < 0)
+        {
+            if (errno == EINTR && stopRequested == 0)
+            {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+        if (count == 0)
+        {
+            if (done == 0)
+            {
+                return false;
+            }
+            throw std::runtime_error("Truncated server message");
+        }
+        done += static_cast<std::size_t>(count);
+    }
+    return true;
+}
+
+void write_exact(int descriptor, std::span<const std::uint8_t> bytes)
+{
+    std::size_t done = 0;
+    while (done < bytes.size())
+    {
+        const ssize_t count = ::write(descriptor, bytes.data() + done, bytes.size() - done);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "write");
+        }
+        done += static_cast<std::size_t>(count);
+    }
+}
+
+// Calls wait_for_room(length) once the header is read, before the payload is
+// allocated.
+template <typename WaitForRoom>
+std::optional<server_request> read_request(int descriptor, WaitForRoom wait_for_room)
+{
+    std::uint8_t header[9];
+    if (!read_exact(descriptor, header, sizeof(header)))
+    {
+        return std::nullopt;
+    }
+
+    server_request request;
+    request.source = header[0];
+    request.sequence = read_le32(header + 1);
+    const std::uint32_t length = read_le32(header + 5);
+    if (length > MaxRequestPayload)
+    {
+        throw std::runtime_error("Server request payload is too large");
+    }
+
+    wait_for_room(length);
+    request.payload.resize(length);
+    if (length != 0 && !read_exact(descriptor, request.payload.data(), length))
+    {
+        throw std::runtime_error("Truncated server message");
+    }
+    return request;
+}
+
+// Converts with --unroll-loops and --mt32-to-gm as given to --serve. Path
+// requests are refused unless --allow-paths was given.
+std::vector<std::uint8_t> build_response(const cli_options& options, bool allowPaths,
+                                         const server_request& request)
+{
+    std::vector<std::uint8_t> response;
+    try
+    {
+        std::vector<std::uint8_t> fileData;
+        std::span<const std::uint8_t> xmi = request.payload;
+        if (request.source == 'P')
+        {
+            if (!allowPaths)
+            {
+                throw std::runtime_error("Path requests need --serve --allow-paths");
+            }
+            fileData = read_file(std::string(request.payload.begin(), request.payload.end()));
+            xmi = fileData;
+        }
+        else if (request.source != 'B')
+        {
+            throw std::runtime_error("Unknown server request source");
+        }
+
+        std::vector<std::vector<std::uint8_t>> midis;
+        if (request.sequence == AllSequences)
+        {
+            const std::size_t count = xmi2mid::sequence_infos(xmi).size();
+            midis.reserve(count);
+            for (std::size_t index = 0; index < count; ++index)
+            {
+                midis.push_back(convert_sequence(options.unroll_loops, options.conversion, xmi, index));
+            }
+        }
+        else
+        {
+            midis.push_back(convert_sequence(options.unroll_loops, options.conversion, xmi, request.sequence));
+        }
+
+        std::size_t size = 5;
+        for (const auto& midi : midis)
+        {
+            size += 4 + midi.size();
+        }
+        response.reserve(size);
+        response.push_back(0);
+        append_le32(response, checked_length(midis.size()));
+        for (const auto& midi : midis)
+        {
+            append_le32(response, checked_length(midi.size()));
+            response.insert(response.end(), midi.begin(), midi.end());
+        }
+    }
+    catch (const std::exception& error)
+    {
+        const std::string_view message = error.what();
+        response.clear();
+        response.push_back(1);
+        append_le32(response, checked_length(message.size()));
+        response.insert(response.end(), message.begin(), message.end());
+    }
+    return response;
+}
+
+// Reads requests from input until end of stream and converts them on the
+// pool. A writer thread sends responses in request order, so a client may
+// pipeline requests on one connection. Reading pauses while the requests and
+// responses still held exceed MaxQueuedBytes.
+void serve_connection(const cli_options& options, bool allowPaths, int input, int output, thread_pool& pool)
+{
+    struct pending_response
+    {
+        std::vector<std::uint8_t> bytes;
+        bool ready = false;
+    };
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::shared_ptr<pending_response>> responses;
+    std::size_t queuedBytes = 0;
+    bool finished = false;
+
+    std::thread writer([&]
+    {
+        bool connected = true;
+        for (;;)
+        {
+            std::unique_lock lock(mutex);
+            changed.wait(lock, [&]
+            {
+                return (!responses.empty() && responses.front()->ready) || (finished && responses.empty());
+            });
+            if (responses.empty())
+            {
+                return;
+            }
+
+            const std::shared_ptr<pending_response> response = std::move(responses.front());
+            responses.pop_front();
+            lock.unlock();
+
+            if (connected)
+            {
+                try
+                {
+                    write_exact(output, response->bytes);
+                }
+                catch (const std::exception&)
+                {
+                    connected = false;
+                }
+            }
+
+            lock.lock();
+            queuedBytes -= response->bytes.size();
+            changed.notify_all();
+        }
+    });
+
+    auto wait_for_room = [&](std::size_t length)
+    {
+        std::unique_lock lock(mutex);
+        changed.wait(lock, [&] { return queuedBytes == 0 || queuedBytes + length <= MaxQueuedBytes; });
+        queuedBytes += length;
+    };
+
+    try
+    {
+        while (auto request = read_request(input, wait_for_room))
+        {
+            auto response = std::make_shared<pending_response>();
+            {
+                std::lock_guard lock(mutex);
+                responses.push_back(response);
+            }
+
+            pool.submit([&options, allowPaths, &mutex, &changed, &queuedBytes, response,
+                         request = std::move(*request)]
+            {
+                std::vector<std::uint8_t> bytes = build_response(options, allowPaths, request);
+                // Notify under the lock: once the writer sees the last
+                // response, this connection's frame may be destroyed.
+                std::lock_guard lock(mutex);
+                queuedBytes += bytes.size();
+                queuedBytes -= request.payload.size();
+                response->bytes = std::move(bytes);
+                response->ready = true;
+                changed.notify_all();
+            });
+        }
+    }
+    catch (const std::exception& error)
+    {
+        if (stopRequested == 0)
+        {
+            std::cerr << "Error: " << error.what() << '\n';
+        }
+    }
+
+    {
+        std::lock_guard lock(mutex);
+        finished = true;
+        changed.notify_all();
+    }
+    writer.join();
+}
+
+sockaddr_un socket_address(const std::filesystem::path& socketPath)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    const std::string& native = socketPath.native();
+    if (native.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error("Socket path is too long: " + native);
+    }
+    std::copy(native.begin(), native.end(), address.sun_path);
+    return address;
+}
+
+// Serves requests on stdin/stdout, or on a Unix domain socket when a path is
+// given. The socket is created for the current user only. Each socket
+// connection has its own reader and writer threads; all conversions share one
+// worker pool.
+void run_server(const cli_options& options, bool allowPaths, const std::optional<std::filesystem::path>& socketPath)
+{
+    std::signal(SIGPIPE, SIG_IGN);
+    std::optional<thread_pool> workers;
+    {
+        const stop_signals_blocked blocked;
+        workers.emplace();
+    }
+    thread_pool& pool = *workers;
+
+    if (!socketPath)
+    {
+        serve_connection(options, allowPaths, STDIN_FILENO, STDOUT_FILENO, pool);
+        pool.wait();
+        return;
+    }
+
+    const sockaddr_un address = socket_address(*socketPath);
+    const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+
+    std::error_code error;
+    if (std::filesystem::is_socket(*socketPath, error))
+    {
+        std::filesystem::remove(*socketPath, error);
+    }
+    const mode_t previousMask = ::umask(0077);
+    const int bound = ::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    ::umask(previousMask);
+    if (bound != 0 || ::listen(listener, SOMAXCONN) != 0)
+    {
+        const int failure = errno;
+        ::close(listener);
+        throw std::system_error(failure, std::generic_category(), "Cannot listen on " + socketPath->string());
+    }
+
+    struct connection
+    {
+        int descriptor;
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    std::vector<connection> connections;
+
+    install_stop_handlers();
+    std::cout << "Listening on " << socketPath->string() << " with " << pool.size() << " worker(s)\n" << std::flush;
+
+    while (stopRequested == 0)
+    {
+        const int client = ::accept(listener, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "accept");
+        }
+
+        std::erase_if(connections, [](connection& open)
+        {
+            if (!*open.done)
+            {
+                return false;
+            }
+            open.thread.join();
+            return true;
+        });
+
+        auto done = std::make_shared<std::atomic<bool>>(false);
+        const stop_signals_blocked blocked;
+        connections.push_back({client, std::thread([client, done, &options, allowPaths, &pool]
+        {
+            serve_connection(options, allowPaths, client, client, pool);
+            ::close(client);
+            *done = true;
+        }), done});
+    }
+
+    for (connection& open : connections)
+    {
+        if (!*open.done)
+        {
+            ::shutdown(open.descriptor, SHUT_RD);
+        }
+        open.thread.join();
+    }
+    pool.wait();
+    ::close(listener);
+    std::filesystem::remove(*socketPath, error);
+    std::cout << "Stopped listening on " << socketPath->string() << '\n';
+}
+
+// Sends the same request repeatedly over one connection and reports the
+// round-trip latency, then writes the MIDI files from the last response.
+void run_client(const std::filesystem::path& socketPath, std::size_t repeat, std::uint32_t sequence, bool sendPath,
+                const std::filesystem::path& inputPath, const std::filesystem::path& outputTarget)
+{
+    std::vector<std::uint8_t> payload;
+    if (sendPath)
+    {
+        const std::string path = std::filesystem::absolute(inputPath).string();
+        payload.assign(path.begin(), path.end());
+    }
+    else
+    {
+        payload = read_file(inputPath);
+    }
+
+    std::vector<std::uint8_t> request;
+    request.reserve(9 + payload.size());
+    request.push_back(sendPath ? 'P' : 'B');
+    append_le32(request, sequence);
+    append_le32(request, checked_length(payload.size()));
+    request.insert(request.end(), payload.begin(), payload.end());
+
+    const sockaddr_un address = socket_address(socketPath);
+    const int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || ::connect(server, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        const int failure = errno;
+        if (server >= 0)
+        {
+            ::close(server);
+        }
+        throw std::system_error(failure, std::generic_category(), "Cannot connect to " + socketPath.string());
+    }
+
+    std::vector<double> latencies;
+    latencies.reserve(repeat);
+    std::vector<std::vector<std::uint8_t>> midis;
+    try
+    {
+        for (std::size_t iteration = 0; iteration < repeat; ++iteration)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            write_exact(server, request);
+
+            std::uint8_t header[5];
+            if (!read_exact(server, header, sizeof(header)))
+            {
+                throw std::runtime_error("Server closed the connection");
+            }
+
+            midis.clear();
+            if (header[0] != 0)
+            {
+                std::string message(read_le32(header + 1), '\0');
+                if (!message.empty() && !read_exact(server, message.data(), message.size()))
+                {
+                    throw std::runtime_error("Truncated server message");
+                }
+                throw std::runtime_error(message);
+            }
+
+            for (std::uint32_t index = 0, count = read_le32(header + 1); index < count; ++index)
+            {
+                std::uint8_t length[4];
+                if (!read_exact(server, length, sizeof(length)))
+                {
+                    throw std::runtime_error("Truncated server message");
+                }
+
+                auto& midi = midis.emplace_back(read_le32(length));
+                if (!midi.empty() && !read_exact(server, midi.data(), midi.size()))
+                {
+                    throw std::runtime_error("Truncated server message");
+                }
+            }
+
+            const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+            latencies.push_back(elapsed.count());
+        }
+    }
+    catch (...)
+    {
+        ::close(server);
+        throw;
+    }
+    ::close(server);
+
+    if (sequence == AllSequences)
+    {
+        for (std::size_t index = 0; index < midis.size(); ++index)
+        {
+            write_file(sequence_output_path(inputPath, outputTarget, index, midis.size()), midis[index]);
+        }
+    }
+    else if (!midis.empty())
+    {
+        write_file(outputTarget, midis.front());
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    double total = 0.0;
+    for (const double latency : latencies)
+    {
+        total += latency;
+    }
+    std::cout << std::fixed << std::setprecision(1) << "Sent " << latencies.size() << " request(s) for "
+              << inputPath.string() << ": min " << latencies.front() << " us, median "
+              << latencies[latencies.size() / 2] << " us, mean " << total / static_cast<double>(latencies.size())
+              << " us\n";
+}
+#endif
+
+// Removes leading global options from the argument list.
+cli_options parse_global_options(std::vector<char*>& arguments)
+{
+    cli_options options{};
+    while (arguments.size() > 2)
+    {
+        const std::string_view option = arguments[1];
+        if (option == "--mt32-to-gm")
+        {
+            options.conversion.patches = xmi2mid::patch_map::mt32_to_gm;
+            arguments.erase(arguments.begin() + 1);
+            continue;
+        }
+        if (option == "--break-ends-loop")
+        {
+            options.break_ends_loop = true;
+            arguments.erase(arguments.begin() + 1);
+            continue;
+        }
+        if (option == "--cache")
+        {
+            options.cache_directory = arguments[2];
+        }
+        else if (option == "--cache-limit")
+        {
+            options.cache_limit = parse_byte_size(arguments[2]);
+        }
+        else if (option == "--manifest")
+        {
+            options.manifest_path = arguments[2];
+        }
+        else if (option == "--unroll-loops")
+        {
+            const std::size_t plays = parse_sequence_index(arguments[2]);
+            if (plays == 0 || plays > std::numeric_limits<std::uint32_t>::max())
+            {
+                throw std::runtime_error("Invalid loop play count " + std::string(arguments[2]));
+            }
+            options.unroll_loops = xmi2mid::loop_options{static_cast<std::uint32_t>(plays)};
+        }
+        else
+        {
+            break;
+        }
+        arguments.erase(arguments.begin() + 1, arguments.begin() + 3);
+    }
+    if (options.unroll_loops)
+    {
+        options.unroll_loops->break_ends_loop = options.break_ends_loop;
+    }
+    return options;
+}
+
+void print_usage(const char* program)
+{
+    std::cerr << "Usage:\n"
+              << "  " << program << " Reference/AIL2/DEMO.XMI demo.mid\n"
+              << "  " << program << " --sequence 0 Reference/AIL2/DEMO.XMI demo.mid\n"
+              << "  " << program << " --all Reference/AIL2/DEMO.XMI demo\n"
+              << "  " << program << " --list [--durations] Reference/AIL2/DEMO.XMI\n"
+              << "  " << program << " --list --count [--verify] input.xmi|inputdir [...]\n"
+              << "  " << program << " --timbres Reference/AIL2/DEMO.XMI\n"
+              << "  " << program << " --branch marker|all [--sequence N] input.xmi output\n"
+              << "  " << program << " --markers [--sequence N] input.xmi output.mid\n"
+              << "  " << program << " --trace [--sequence N] [--ticks N] [--branch-at tick:marker ...] input.xmi\n"
+              << "  " << program
+              << " --render-wav [--opl3] [--rate N] [--sequence N|--all] input.xmi timbres.ad output.wav\n"
+              << "  " << program << " --playback [--seek-interval N] [--sequence N|--all] input.xmi output.xpb\n"
+              << "  " << program << " --bench-playback [--repeat N] input.xmi\n"
+              << "  " << program << " --encode [--quantization 120] demo.xmi one.mid [two.mid ...]\n"
+              << "  " << program << " --extract [--sequence N] input.xmi output.xmi\n"
+              << "  " << program << " --merge output.xmi input.xmi [...]\n"
+              << "  " << program << " --analyze input.xmi|inputdir [...]\n"
+              << "  " << program << " --scan blob outdir\n"
+              << "  " << program << " --batch outdir input.xmi|inputdir [...]\n"
+              << "  " << program << " --watch inputdir outdir\n"
+              << "  " << program << " --serve [--allow-paths] [socket]\n"
+              << "  " << program << " --client socket [--repeat N] [--sequence N|--all] [--path] input.xmi output\n"
+              << "\n"
+              << "Options before the command:\n"
+              << "  --cache dir          reuse converted sequences from an on-disk cache\n"
+              << "  --cache-limit bytes  evict the oldest cache entries past this size (K, M, G suffixes)\n"
+              << "  --manifest file      with --batch, only convert inputs changed since the last run\n"
+              << "  --unroll-loops N     expand For/Next loops; loops marked infinite play N times\n"
+              << "  --break-ends-loop    let Break (117 below 64) end a loop in --unroll-loops and --trace\n"
+              << "  --mt32-to-gm         map MT-32 programs and rhythm keys to General MIDI\n";
+}
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    try
+    {
+        std::vector<char*> arguments(argv, argv + argc);
+        const cli_options options = parse_global_options(arguments);
+        argc = static_cast<int>(arguments.size());
+        argv = arguments.data();
+
+        const std::string_view command = argv[1];
+
+        if (command == "--help" || command == "-h")
+        {
+            print_usage(argv[0]);
+            return 0;
+        }
+
+        if (command == "--list" && argc >= 4 && std::string_view(argv[2]) == "--count")
+        {
+            const bool verify = std::string_view(argv[3]) == "--verify";
+            if (argc < (verify ? 5 : 4))
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            print_sequence_counts(collect_batch_inputs(std::span<char* const>(argv + (verify ? 4 : 3), argv + argc)),
+                                  verify);
+            return 0;
+        }
+
+        if (command == "--list")
+        {
+            const bool durations = argc == 4 && std::string_view(argv[2]) == "--durations";
+            if (argc != 3 && !durations)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::filesystem::path inputPath = argv[argc - 1];
+            const auto xmiData = read_file(inputPath);
+            print_sequence_list(inputPath, xmiData, xmi2mid::sequence_infos(xmiData), durations);
+            return 0;
+        }
+
+        if (command == "--timbres")
+        {
+            if (argc != 3)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::filesystem::path inputPath = argv[2];
+            const auto xmiData = read_file(inputPath);
+            const auto required = xmi2mid::required_timbres(xmiData);
+            std::cout << inputPath.string() << ": " << required.size() << " required timbre(s)\n";
+            for (const xmi2mid::timbre_request timbre : required)
+            {
+                std::cout << "  bank " << static_cast<int>(timbre.bank) << " patch "
+                          << static_cast<int>(timbre.patch) << '\n';
+            }
+            return 0;
+        }
+
+        if (command == "--sequence")
+        {
+            if (argc != 5)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::size_t sequenceIndex = parse_sequence_index(argv[2]);
+            const std::filesystem::path inputPath = argv[3];
+            const std::filesystem::path outputPath = argv[4];
+            const auto xmiData = read_file(inputPath);
+            const auto sequences = xmi2mid::sequence_infos(xmiData);
+            if (sequenceIndex >= sequences.size())
+            {
+                throw std::runtime_error("Invalid XMI: sequence index " + std::to_string(sequenceIndex) +
+                                         " is out of range for " + std::to_string(sequences.size()) +
+                                         " sequence(s)");
+            }
+
+            sequence_writer writer(options);
+            writer.write(xmiData, sequences[sequenceIndex], outputPath);
+            std::cout << "Converted sequence " << sequenceIndex << " from "
+                      << inputPath.string() << " to " << outputPath.string() << '\n';
+            return 0;
+        }
+
+        if (command == "--all")
+        {
+            if (argc != 4)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::filesystem::path inputPath = argv[2];
+            const std::filesystem::path outputTarget = argv[3];
+            const auto xmiData = read_file(inputPath);
+            const auto sequences = xmi2mid::sequence_infos(xmiData);
+            sequence_writer writer(options);
+
+            for (std::size_t index = 0; index < sequences.size(); ++index)
+            {
+                const std::filesystem::path outputPath =
+                    sequence_output_path(inputPath, outputTarget, index, sequences.size());
+                writer.write(xmiData, sequences[index], outputPath);
+                std::cout << "Converted sequence " << index << " from "
+                          << inputPath.string() << " to " << outputPath.string() << '\n';
+            }
+            return 0;
+        }
+
+        if (command == "--markers")
+        {
+            int argument = 2;
+            std::size_t sequenceIndex = 0;
+            if (argc > argument + 1 && std::string_view(argv[argument]) == "--sequence")
+            {
+                sequenceIndex = parse_sequence_index(argv[argument + 1]);
+                argument += 2;
+            }
+
+            if (argc != argument + 2)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::filesystem::path inputPath = argv[argument];
+            const std::filesystem::path outputPath = argv[argument + 1];
+            std::filesystem::path tablePath = outputPath;
+            tablePath += ".markers";
+
+            const auto xmiData = read_file(inputPath);
+            const xmi2mid::marked_midi marked = xmi2mid::convert_with_markers(xmiData, sequenceIndex);
+
+            std::string table = "# xmi2mid markers v1: MTrk offset, channel, marker\n";
+            for (const xmi2mid::midi_marker& marker : marked.markers)
+            {
+                table += std::to_string(marker.offset) + '\t' + std::to_string(marker.channel) + '\t' +
+                         xmi2mid::marker_text(marker.kind, marker.value) + '\n';
+            }
+
+            write_file(outputPath, marked.midi);
+            write_file(tablePath, {reinterpret_cast<const std::uint8_t*>(table.data()), table.size()});
+            std::cout << "Converted sequence " << sequenceIndex << " from " << inputPath.string() << " to "
+                      << outputPath.string() << " with " << marked.markers.size() << " marker(s) in "
+                      << tablePath.string() << '\n';
+            return 0;
+        }
+
+        if (command == "--trace")
+        {
+            std::size_t sequenceIndex = 0;
+            std::uint32_t maxTicks = DefaultTraceTicks;
+            std::vector<branch_request> branches;
+            int argument = 2;
+            for (; argument + 1 < argc; argument += 2)
+            {
+                const std::string_view option = argv[argument];
+                if (option == "--sequence")
+                {
+                    sequenceIndex = parse_sequence_index(argv[argument + 1]);
+                }
+                else if (option == "--ticks")
+                {
+                    const std::size_t ticks = parse_sequence_index(argv[argument + 1]);
+                    if (ticks > std::numeric_limits<std::uint32_t>::max())
+                    {
+                        throw std::runtime_error("Invalid tick count " + std::string(argv[argument + 1]));
+                    }
+                    maxTicks = static_cast<std::uint32_t>(ticks);
+                }
+                else if (option == "--branch-at")
+                {
+                    branches.push_back(parse_branch_request(argv[argument + 1]));
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            if (argc != argument + 1)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::filesystem::path inputPath = argv[argument];
+            xmi2mid::sequencer_options sequencerOptions;
+            sequencerOptions.break_ends_loop = options.break_ends_loop;
+            print_trace(inputPath, read_file(inputPath), sequenceIndex, maxTicks, std::move(branches),
+                        sequencerOptions);
+            return 0;
+        }
+
+        if (command == "--render-wav")
+        {
+            std::size_t sequenceIndex = 0;
+            bool allSequences = false;
+            xmi2mid::opl_render_options renderOptions;
+            int argument = 2;
+            for (; argument < argc; ++argument)
+            {
+                const std::string_view option = argv[argument];
+                if (option == "--opl3")
+                {
+                    renderOptions.chip = xmi2mid::opl_chip_type::opl3;
+                }
+                else if (option == "--all")
+                {
+                    allSequences = true;
+                }
+                else if (option == "--sequence" && argument + 1 < argc)
+                {
+                    sequenceIndex = parse_sequence_index(argv[++argument]);
+                    allSequences = false;
+                }
+                else if (option == "--rate" && argument + 1 < argc)
+                {
+                    const std::size_t rate = parse_sequence_index(argv[++argument]);
+                    if (rate < 8000 || rate > 192000)
+                    {
+                        throw std::runtime_error("Invalid sample rate " + std::string(argv[argument]));
+                    }
+                    renderOptions.sample_rate = static_cast<std::uint32_t>(rate);
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            if (argc != argument + 3)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            render_wav_files(argv[argument], argv[argument + 1], argv[argument + 2], sequenceIndex, allSequences,
+                             renderOptions);
+            return 0;
+        }
+
+        if (command == "--playback")
+        {
+            std::size_t sequenceIndex = 0;
+            bool allSequences = false;
+            xmi2mid::playback_options options;
+            int argument = 2;
+            for (; argument < argc; ++argument)
+            {
+                const std::string_view option = argv[argument];
+                if (option == "--all")
+                {
+                    allSequences = true;
+                }
+                else if (option == "--sequence" && argument + 1 < argc)
+                {
+                    sequenceIndex = parse_sequence_index(argv[++argument]);
+                    allSequences = false;
+                }
+                else if (option == "--seek-interval" && argument + 1 < argc)
+                {
+                    const std::size_t interval = parse_sequence_index(argv[++argument]);
+                    if (interval > std::numeric_limits<std::uint32_t>::max())
+                    {
+                        throw std::runtime_error("Invalid seek interval " + std::string(argv[argument]));
+                    }
+                    options.seek_interval = static_cast<std::uint32_t>(interval);
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            if (argc != argument + 2)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            write_playback_files(argv[argument], argv[argument + 1], sequenceIndex, allSequences, options);
+            return 0;
+        }
+
+        if (command == "--bench-playback")
+        {
+            std::size_t repeat = 1000;
+            int argument = 2;
+            if (argc > argument + 1 && std::string_view(argv[argument]) == "--repeat")
+            {
+                repeat = parse_sequence_index(argv[argument + 1]);
+                argument += 2;
+            }
+
+            if (argc != argument + 1 || repeat == 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            bench_playback(argv[argument], repeat);
+            return 0;
+        }
+
+        if (command == "--branch")
+        {
+            int argument = 3;
+            std::size_t sequenceIndex = 0;
+            if (argc > argument + 1 && std::string_view(argv[argument]) == "--sequence")
+            {
+                sequenceIndex = parse_sequence_index(argv[argument + 1]);
+                argument += 2;
+            }
+
+            if (argc != argument + 2)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::string_view markerText = argv[2];
+            const std::filesystem::path inputPath = argv[argument];
+            const std::filesystem::path outputTarget = argv[argument + 1];
+            const auto xmiData = read_file(inputPath);
+            const std::size_t sequenceCount = xmi2mid::sequence_infos(xmiData).size();
+
+            if (markerText == "all")
+            {
+                const auto renders = xmi2mid::convert_branches(xmiData, sequenceIndex);
+                for (const xmi2mid::branch_render& render : renders)
+                {
+                    const std::filesystem::path outputPath =
+                        branch_output_path(inputPath, outputTarget, sequenceIndex, sequenceCount, render.marker);
+                    write_file(outputPath, render.midi);
+                    std::cout << "Converted sequence " << sequenceIndex << " branch " << render.marker << " from "
+                              << inputPath.string() << " to " << outputPath.string() << '\n';
+                }
+                if (renders.empty())
+                {
+                    std::cout << "Sequence " << sequenceIndex << " of " << inputPath.string()
+                              << " has no branch markers\n";
+                }
+                return 0;
+            }
+
+            const std::size_t marker = parse_sequence_index(markerText);
+            if (marker > std::numeric_limits<std::uint16_t>::max())
+            {
+                throw std::runtime_error("Invalid branch marker " + std::string(markerText));
+            }
+
+            write_file(outputTarget,
+                       xmi2mid::convert_from_branch(xmiData, sequenceIndex, static_cast<std::uint16_t>(marker)));
+            std::cout << "Converted sequence " << sequenceIndex << " branch " << marker << " from "
+                      << inputPath.string() << " to " << outputTarget.string() << '\n';
+            return 0;
+        }
+
+        if (command == "--encode")
+        {
+            int argument = 2;
+            xmi2mid::encode_options options{};
+            if (argc > argument + 1 && std::string_view(argv[argument]) == "--quantization")
+            {
+                const std::size_t quantization = parse_sequence_index(argv[argument + 1]);
+                if (quantization == 0 || quantization > std::numeric_limits<std::uint32_t>::max())
+                {
+                    throw std::runtime_error("Invalid quantization rate " + std::string(argv[argument + 1]));
+                }
+                options.quantization = static_cast<std::uint32_t>(quantization);
+                argument += 2;
+            }
+
+            if (argc - argument < 2)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::filesystem::path outputPath = argv[argument++];
+            std::vector<std::filesystem::path> inputPaths(argv + argument, argv + argc);
+            std::vector<std::vector<std::uint8_t>> midiFiles;
+            std::vector<std::span<const std::uint8_t>> midiSpans;
+            midiFiles.reserve(inputPaths.size());
+            midiSpans.reserve(inputPaths.size());
+
+            for (const std::filesystem::path& inputPath : inputPaths)
+            {
+                midiFiles.push_back(read_file(inputPath));
+                midiSpans.emplace_back(midiFiles.back());
+            }
+
+            const auto xmiData = xmi2mid::encode(midiSpans, options);
+            write_file(outputPath, xmiData);
+
+            for (std::size_t index = 0; index < inputPaths.size(); ++index)
+            {
+                std::cout << "Encoded " << inputPaths[index].string() << " as sequence " << index
+                          << " of " << outputPath.string() << '\n';
+            }
+            return 0;
+        }
+
+        if (command == "--extract")
+        {
+            int argument = 2;
+            std::optional<std::size_t> sequenceIndex;
+            if (argc > argument + 1 && std::string_view(argv[argument]) == "--sequence")
+            {
+                sequenceIndex = parse_sequence_index(argv[argument + 1]);
+                argument += 2;
+            }
+
+            if (argc - argument != 2)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::filesystem::path inputPath = argv[argument];
+            const std::filesystem::path outputTarget = argv[argument + 1];
+            const catalog_source input = read_catalog_source(inputPath);
+            if (sequenceIndex && *sequenceIndex >= input.sequences.size())
+            {
+                throw std::runtime_error("Invalid XMI: sequence index " + std::to_string(*sequenceIndex) +
+                                         " is out of range for " + std::to_string(input.sequences.size()) +
+                                         " sequence(s)");
+            }
+
+            for (std::size_t index = 0; index < input.sequences.size(); ++index)
+            {
+                if (sequenceIndex && index != *sequenceIndex)
+                {
+                    continue;
+                }
+
+                const std::filesystem::path outputPath =
+                    sequenceIndex ? outputTarget
+                                  : suffixed_output_path(inputPath, outputTarget,
+                                                         sequence_suffix(index, input.sequences.size()), ".xmi");
+                const catalog_source extracted[] = {{inputPath, {input.sequences[index]}}};
+                write_catalog(outputPath, extracted);
+                std::cout << "Extracted sequence " << index << " from " << inputPath.string() << " to "
+                          << outputPath.string() << '\n';
+            }
+            return 0;
+        }
+
+        if (command == "--merge")
+        {
+            if (argc < 4)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::filesystem::path outputPath = argv[2];
+            std::vector<catalog_source> inputs;
+            std::size_t sequenceCount = 0;
+            for (int argument = 3; argument < argc; ++argument)
+            {
+                inputs.push_back(read_catalog_source(argv[argument]));
+                sequenceCount += inputs.back().sequences.size();
+            }
+
+            write_catalog(outputPath, inputs);
+            std::cout << "Merged " << sequenceCount << " sequence(s) from " << inputs.size() << " file(s) into "
+                      << outputPath.string() << '\n';
+            return 0;
+        }
+
+        if (command == "--scan")
+        {
+            if (argc != 4)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            run_scan(options, argv[2], argv[3]);
+            return 0;
+        }
+
+        if (command == "--analyze")
+        {
+            if (argc < 3)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            run_analyze(collect_batch_inputs(std::span<char* const>(argv + 2, argv + argc)));
+            return 0;
+        }
+
+        if (command == "--batch")
+        {
+            if (argc < 4)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            const std::filesystem::path outputDirectory = argv[2];
+            const auto inputs = collect_batch_inputs(std::span<char* const>(argv + 3, argv + argc));
+            const std::vector<std::filesystem::path> roots(argv + 3, argv + argc);
+            const batch_summary summary = run_batch(options, outputDirectory, inputs, roots);
+
+            std::cout << "Converted " << summary.sequences << " sequence(s) from " << summary.changed_files
+                      << " of " << summary.files << " file(s) to " << outputDirectory.string() << " ("
+                      << summary.reused << " reused, " << summary.removed << " stale output(s) removed";
+            if (summary.failed != 0)
+            {
+                std::cout << ", " << summary.failed << " file(s) failed";
+            }
+            std::cout << ")\n";
+            return summary.failed == 0 ? 0 : 1;
+        }
+
+        if (command == "--watch")
+        {
+            if (argc != 4)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+#if defined(__linux__)
+            run_watch(options, argv[2], argv[3]);
+            return 0;
+#else
+            throw std::runtime_error("--watch requires Linux inotify");
+#endif
+        }
+
+        if (command == "--serve")
+        {
+            int argument = 2;
+            const bool allowPaths = argc > argument && std::string_view(argv[argument]) == "--allow-paths";
+            if (allowPaths)
+            {
+                ++argument;
+            }
+            if (argc > argument + 1)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            if (options.cache_directory || options.manifest_path)
+            {
+                throw std::runtime_error("--serve does not use --cache or --manifest");
+            }
+
+#if defined(__unix__) || defined(__APPLE__)
+            std::optional<std::filesystem::path> socketPath;
+            if (argc == argument + 1)
+            {
+                socketPath = argv[argument];
+            }
+            run_server(options, allowPaths, socketPath);
+            return 0;
+#else
+            throw std::runtime_error("--serve requires a POSIX system");
+#endif
+        }
+
+        if (command == "--client")
+        {
+            int argument = 3;
+            std::size_t repeat = 1;
+            std::uint32_t sequence = 0;
+            bool sendPath = false;
+            while (argc > argument)
+            {
+                const std::string_view option = argv[argument];
+                if (option == "--repeat" && argc > argument + 1)
+                {
+                    repeat = parse_sequence_index(argv[argument + 1]);
+                    argument += 2;
+                }
+                else if (option == "--sequence" && argc > argument + 1)
+                {
+                    const std::size_t index = parse_sequence_index(argv[argument + 1]);
+                    if (index >= AllSequences)
+                    {
+                        throw std::runtime_error("Invalid sequence index " + std::string(argv[argument + 1]));
+                    }
+                    sequence = static_cast<std::uint32_t>(index);
+                    argument += 2;
+                }
+                else if (option == "--all")
+                {
+                    sequence = AllSequences;
+                    ++argument;
+                }
+                else if (option == "--path")
+                {
+                    sendPath = true;
+                    ++argument;
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            if (argc != argument + 2 || repeat == 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+#if defined(__unix__) || defined(__APPLE__)
+            run_client(argv[2], repeat, sequence, sendPath, argv[argument], argv[argument + 1]);
             return 0;
+#else
+            throw std::runtime_error("--client requires a POSIX system");
+#endif
         }
 
         if (argc == 3)
@@ -251,8 +4728,8 @@ int main(int argc, char* argv[])
             const std::filesystem::path inputPath = argv[1];
             const std::filesystem::path outputPath = argv[2];
             const auto xmiData = read_file(inputPath);
-            const auto midiData = xmi2mid::convert(xmiData);
-            write_file(outputPath, midiData);
+            sequence_writer writer(options);
+            writer.write(xmiData, xmi2mid::sequence_infos(xmiData).front(), outputPath);
             std::cout << "Converted sequence 0 from "
                       << inputPath.string() << " to " << outputPath.string() << '\n';
             return 0;
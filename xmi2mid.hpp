@@ -1,19 +1,45 @@
 #ifndef XMI2MID_HPP
 #define XMI2MID_HPP
 
+// Defining XMI2MID_FREESTANDING keeps only what runs without a heap,
+// exceptions, or the hosted library: parsing and try_convert_to().
 #include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <expected>
+#include <iterator>
 #include <limits>
+#include <optional>
 #include <span>
+#include <string_view>
+#include <utility>
+
+#if !defined(__cpp_lib_expected)
+#error "xmi2mid.hpp requires C++23 and std::expected"
+#endif
+
+#if !defined(XMI2MID_FREESTANDING)
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <numbers>
 #include <stdexcept>
 #include <string>
-#include <string_view>
+#include <tuple>
 #include <vector>
+#endif
 
 namespace xmi2mid
 {
+// One RBRN entry: a Controller 120 marker and its byte offset in EVNT.
+struct branch_point
+{
+    std::uint16_t marker = 0;
+    std::uint32_t offset = 0;
+};
+
 struct sequence_info
 {
     std::size_t index = 0;
@@ -23,41 +49,102 @@ struct sequence_info
     std::size_t event_size = 0;
     bool has_timb = false;
     bool has_rbrn = false;
+    // TIMB and RBRN payloads. Conversion reads neither, so their contents are
+    // checked only by timbres() and branch_points().
+    std::size_t timb_offset = 0;
+    std::size_t timb_size = 0;
+    std::size_t rbrn_offset = 0;
+    std::size_t rbrn_size = 0;
 };
 
-namespace detail
+// What the try_ functions report instead of throwing. The throwing functions
+// raise std::runtime_error with the same description.
+enum class error_code : std::uint8_t
 {
-inline void need_bytes(const std::uint8_t* cursor, const std::uint8_t* end, std::size_t count,
-                       std::string_view context)
+    empty_file,
+    missing_sequence,      // no FORM XMID
+    sequence_out_of_range, // offset is the end of the data
+    truncated_chunk,       // an IFF chunk runs past its parent or the data
+    chunk_too_small,       // FORM or CAT shorter than its type tag
+    missing_evnt,
+    branch_outside_evnt,
+    truncated_event,       // EVNT ends inside an event
+    varlen_too_large,      // variable-length integer over five bytes
+    directory_mismatch,    // XDIR INFO count differs from the catalog
+    too_many_note_offs,    // more notes sounding than the renderer queues
+    zero_tempo,            // Set Tempo with a zero-length quarter note
+    sequence_too_long      // time or output size past 32 bits
+};
+
+// An error_code and the byte offset in the XMI data where it was found.
+struct error
 {
-    if (cursor > end || count > static_cast<std::size_t>(end - cursor))
+    error_code code = error_code::empty_file;
+    std::size_t offset = 0;
+
+    friend bool operator==(const error&, const error&) = default;
+};
+
+inline std::string_view describe(error_code code)
+{
+    switch (code)
     {
-        throw std::runtime_error("Invalid XMI: truncated " + std::string(context));
+    case error_code::empty_file:
+        return "Invalid XMI: empty file";
+    case error_code::missing_sequence:
+        return "Invalid XMI: missing FORM XMID sequence";
+    case error_code::sequence_out_of_range:
+        return "Invalid XMI: sequence index is out of range";
+    case error_code::truncated_chunk:
+        return "Invalid XMI: truncated chunk";
+    case error_code::chunk_too_small:
+        return "Invalid XMI: FORM or CAT chunk is too small";
+    case error_code::missing_evnt:
+        return "Invalid XMI: FORM XMID is missing EVNT chunk";
+    case error_code::branch_outside_evnt:
+        return "Invalid XMI: RBRN offset is outside EVNT";
+    case error_code::truncated_event:
+        return "Invalid XMI: truncated event";
+    case error_code::varlen_too_large:
+        return "Invalid XMI: variable-length integer is too large";
+    case error_code::directory_mismatch:
+        return "Invalid XMI: XDIR INFO count does not match the catalog";
+    case error_code::too_many_note_offs:
+        return "Too many pending note-off events";
+    case error_code::zero_tempo:
+        return "Invalid MIDI tempo: zero quarter-note length";
+    case error_code::sequence_too_long:
+        return "Invalid XMI: sequence is too long";
     }
+    return "Invalid XMI";
 }
 
-inline bool has_tag(const std::uint8_t* cursor, const std::uint8_t* end, std::string_view tag)
+template <typename T>
+using result = std::expected<T, error>;
+
+namespace detail
 {
-    return cursor <= end && tag.size() <= static_cast<std::size_t>(end - cursor) &&
-           std::equal(tag.begin(), tag.end(), cursor);
+inline std::unexpected<error> failure_at(error_code code, std::span<const std::uint8_t> xmi,
+                                         const std::uint8_t* cursor)
+{
+    return std::unexpected(error{code, static_cast<std::size_t>(cursor - xmi.data())});
 }
 
-inline std::uint32_t read_be32(const std::uint8_t*& cursor, const std::uint8_t* end)
+inline bool has_bytes(const std::uint8_t* cursor, const std::uint8_t* end, std::size_t count)
 {
-    need_bytes(cursor, end, 4, "32-bit integer");
-    const std::uint32_t value = (static_cast<std::uint32_t>(cursor[0]) << 24) |
-                                (static_cast<std::uint32_t>(cursor[1]) << 16) |
-                                (static_cast<std::uint32_t>(cursor[2]) << 8) |
-                                static_cast<std::uint32_t>(cursor[3]);
-    cursor += 4;
-    return value;
+    return cursor <= end && count <= static_cast<std::size_t>(end - cursor);
 }
 
-inline const std::uint8_t* chunk_payload_end(const std::uint8_t* payload, const std::uint8_t* limit,
-                                             std::uint32_t length, std::string_view context)
+inline bool has_tag(const std::uint8_t* cursor, const std::uint8_t* end, std::string_view tag)
 {
-    need_bytes(payload, limit, length, context);
-    return payload + length;
+    return cursor <= end && tag.size() <= static_cast<std::size_t>(end - cursor) &&
+           std::equal(tag.begin(), tag.end(), cursor);
+}
+
+inline std::uint32_t load_be32(const std::uint8_t* bytes)
+{
+    return (static_cast<std::uint32_t>(bytes[0]) << 24) | (static_cast<std::uint32_t>(bytes[1]) << 16) |
+           (static_cast<std::uint32_t>(bytes[2]) << 8) | static_cast<std::uint32_t>(bytes[3]);
 }
 
 inline const std::uint8_t* next_chunk(const std::uint8_t* payloadEnd, const std::uint8_t* limit,
@@ -76,45 +163,73 @@ inline std::size_t offset_of(std::span<const std::uint8_t> xmi, const std::uint8
     return static_cast<std::size_t>(cursor - xmi.data());
 }
 
-inline void scan_form_xmid(std::span<const std::uint8_t> xmi, const std::uint8_t* chunkStart,
-                           const std::uint8_t* payload, const std::uint8_t* chunkEnd,
-                           std::uint32_t length, std::vector<sequence_info>& sequences)
+// RBRN: LE16 entry count, then per entry an LE16 marker and an LE32 offset
+// from the start of the EVNT payload.
+inline std::size_t branch_count(const std::uint8_t* table)
+{
+    return static_cast<std::size_t>(table[0]) | (static_cast<std::size_t>(table[1]) << 8);
+}
+
+inline branch_point load_branch(const std::uint8_t* table, std::size_t index)
+{
+    const std::uint8_t* const entry = table + 2 + index * 6;
+    branch_point branch{};
+    branch.marker = static_cast<std::uint16_t>(entry[0] | (entry[1] << 8));
+    branch.offset = static_cast<std::uint32_t>(entry[2]) | (static_cast<std::uint32_t>(entry[3]) << 8) |
+                    (static_cast<std::uint32_t>(entry[4]) << 16) | (static_cast<std::uint32_t>(entry[5]) << 24);
+    return branch;
+}
+
+// Fills `info` and returns true when the FORM chunk is an XMID sequence.
+inline result<bool> scan_form_xmid(std::span<const std::uint8_t> xmi, const std::uint8_t* chunkStart,
+                                   const std::uint8_t* payload, const std::uint8_t* chunkEnd,
+                                   std::uint32_t length, std::size_t index, sequence_info& info)
 {
     if (length < 4)
     {
-        throw std::runtime_error("Invalid XMI: FORM chunk is too small");
+        return failure_at(error_code::chunk_too_small, xmi, chunkStart);
     }
 
     if (!has_tag(payload, chunkEnd, "XMID"))
     {
-        return;
+        return false;
     }
 
-    sequence_info info{};
-    info.index = sequences.size();
+    info = sequence_info{};
+    info.index = index;
     info.form_offset = offset_of(xmi, chunkStart);
     info.form_size = static_cast<std::size_t>(8) + length;
 
     const std::uint8_t* local = payload + 4;
     while (local < chunkEnd)
     {
-        need_bytes(local, chunkEnd, 8, "sequence chunk header");
+        if (!has_bytes(local, chunkEnd, 8))
+        {
+            return failure_at(error_code::truncated_chunk, xmi, local);
+        }
+        const std::uint8_t* const localStart = local;
         const bool isTimb = has_tag(local, chunkEnd, "TIMB");
         const bool isRbrn = has_tag(local, chunkEnd, "RBRN");
         const bool isEvnt = has_tag(local, chunkEnd, "EVNT");
-        local += 4;
-        const std::uint32_t localLength = read_be32(local, chunkEnd);
-        const std::uint8_t* const localPayload = local;
-        const std::uint8_t* const localEnd =
-            chunk_payload_end(localPayload, chunkEnd, localLength, "sequence chunk");
+        const std::uint32_t localLength = load_be32(local + 4);
+        const std::uint8_t* const localPayload = local + 8;
+        if (!has_bytes(localPayload, chunkEnd, localLength))
+        {
+            return failure_at(error_code::truncated_chunk, xmi, localStart);
+        }
+        const std::uint8_t* const localEnd = localPayload + localLength;
 
         if (isTimb)
         {
             info.has_timb = true;
+            info.timb_offset = offset_of(xmi, localPayload);
+            info.timb_size = localLength;
         }
         else if (isRbrn)
         {
             info.has_rbrn = true;
+            info.rbrn_offset = offset_of(xmi, localPayload);
+            info.rbrn_size = localLength;
         }
         else if (isEvnt)
         {
@@ -127,445 +242,6423 @@ inline void scan_form_xmid(std::span<const std::uint8_t> xmi, const std::uint8_t
 
     if (info.event_size == 0)
     {
-        throw std::runtime_error("Invalid XMI: FORM XMID is missing EVNT chunk");
+        return failure_at(error_code::missing_evnt, xmi, chunkStart);
     }
+    return true;
+}
+}
 
-    sequences.push_back(info);
+#if !defined(XMI2MID_FREESTANDING)
+inline std::string to_string(const error& failure)
+{
+    return std::string(describe(failure.code)) + " at byte " + std::to_string(failure.offset);
 }
 
-inline void scan_catalog_xmid(std::span<const std::uint8_t> xmi, const std::uint8_t* payload,
-                              const std::uint8_t* chunkEnd, std::uint32_t length,
-                              std::vector<sequence_info>& sequences)
+namespace detail
 {
-    if (length < 4)
+// Raises an error from the throwing API. Without exceptions the program stops
+// instead; such builds use the try_ functions.
+[[noreturn]] inline void fail(const std::string& message)
+{
+#if defined(__cpp_exceptions)
+    throw std::runtime_error(message);
+#else
+    static_cast<void>(message);
+    std::abort();
+#endif
+}
+
+[[noreturn]] inline void fail(const error& failure)
+{
+    fail(to_string(failure));
+}
+
+template <typename T>
+T value_or_fail(result<T> value)
+{
+    if (!value)
     {
-        throw std::runtime_error("Invalid XMI: CAT chunk is too small");
+        fail(value.error());
     }
+    return std::move(*value);
+}
 
-    if (!has_tag(payload, chunkEnd, "XMID"))
+inline void value_or_fail(const result<void>& value)
+{
+    if (!value)
     {
-        return;
+        fail(value.error());
     }
+}
 
-    const std::uint8_t* child = payload + 4;
-    while (child < chunkEnd)
+inline void need_bytes(const std::uint8_t* cursor, const std::uint8_t* end, std::size_t count,
+                       std::string_view context)
+{
+    if (!has_bytes(cursor, end, count))
     {
-        need_bytes(child, chunkEnd, 8, "CAT child chunk header");
-        const std::uint8_t* const childStart = child;
-        const bool isForm = has_tag(child, chunkEnd, "FORM");
-        child += 4;
-        const std::uint32_t childLength = read_be32(child, chunkEnd);
-        const std::uint8_t* const childPayload = child;
-        const std::uint8_t* const childEnd =
-            chunk_payload_end(childPayload, chunkEnd, childLength, "CAT child chunk");
+        detail::fail("Invalid XMI: truncated " + std::string(context));
+    }
+}
 
-        if (isForm)
-        {
-            scan_form_xmid(xmi, childStart, childPayload, childEnd, childLength, sequences);
-        }
+inline std::uint32_t read_be32(const std::uint8_t*& cursor, const std::uint8_t* end)
+{
+    need_bytes(cursor, end, 4, "32-bit integer");
+    const std::uint32_t value = load_be32(cursor);
+    cursor += 4;
+    return value;
+}
 
-        child = next_chunk(childEnd, chunkEnd, childLength);
-    }
+inline const std::uint8_t* chunk_payload_end(const std::uint8_t* payload, const std::uint8_t* limit,
+                                             std::uint32_t length, std::string_view context)
+{
+    need_bytes(payload, limit, length, context);
+    return payload + length;
 }
 }
+#endif
 
-inline std::vector<sequence_info> sequence_infos(std::span<const std::uint8_t> xmi)
+namespace detail
 {
-    if (xmi.empty())
+inline std::size_t varlen_size(std::uint32_t value)
+{
+    std::size_t count = 1;
+    while ((value >>= 7) != 0)
     {
-        throw std::runtime_error("Invalid XMI: empty file");
+        ++count;
     }
+    return count;
+}
 
-    std::vector<sequence_info> sequences;
-    const std::uint8_t* root = xmi.data();
-    const std::uint8_t* const end = root + xmi.size();
-
-    while (root < end)
+inline std::uint8_t* write_varlen(std::uint8_t* out, std::uint32_t value)
+{
+    const std::size_t count = varlen_size(value);
+    for (std::size_t i = count; i != 0; --i)
     {
-        detail::need_bytes(root, end, 8, "root IFF chunk header");
-        const std::uint8_t* const rootStart = root;
-        const bool isForm = detail::has_tag(root, end, "FORM");
-        const bool isCatalog = detail::has_tag(root, end, "CAT ");
-        root += 4;
-        const std::uint32_t rootLength = detail::read_be32(root, end);
-        const std::uint8_t* const rootPayload = root;
-        const std::uint8_t* const rootEnd =
-            detail::chunk_payload_end(rootPayload, end, rootLength, "root IFF chunk");
-
-        if (isForm)
-        {
-            detail::scan_form_xmid(xmi, rootStart, rootPayload, rootEnd, rootLength, sequences);
-        }
-        else if (isCatalog)
-        {
-            detail::scan_catalog_xmid(xmi, rootPayload, rootEnd, rootLength, sequences);
-        }
-
-        root = detail::next_chunk(rootEnd, end, rootLength);
+        const std::uint8_t continuation = i == count ? 0x00 : 0x80;
+        out[i - 1] = static_cast<std::uint8_t>((value & 0x7F) | continuation);
+        value >>= 7;
     }
+    return out + count;
+}
 
-    if (sequences.empty())
+template <typename Bytes>
+void append_varlen(Bytes& bytes, std::uint32_t value)
+{
+    std::array<std::uint8_t, 5> encoded{};
+    std::uint8_t* const encodedEnd = write_varlen(encoded.data(), value);
+    bytes.insert(bytes.end(), encoded.data(), encodedEnd);
+}
+
+template <typename Bytes>
+void append_tag(Bytes& bytes, std::string_view tag)
+{
+    for (const char ch : tag)
     {
-        throw std::runtime_error("Invalid XMI: missing FORM XMID sequence");
+        bytes.push_back(static_cast<std::uint8_t>(ch));
     }
-
-    return sequences;
 }
 
-inline std::size_t sequence_count(std::span<const std::uint8_t> xmi)
+template <typename Bytes>
+void append_be32(Bytes& bytes, std::uint32_t value)
 {
-    return sequence_infos(xmi).size();
+    bytes.push_back(static_cast<std::uint8_t>(value >> 24));
+    bytes.push_back(static_cast<std::uint8_t>(value >> 16));
+    bytes.push_back(static_cast<std::uint8_t>(value >> 8));
+    bytes.push_back(static_cast<std::uint8_t>(value));
 }
 
-inline std::vector<std::uint8_t> convert(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+template <typename Bytes>
+void patch_be32(Bytes& bytes, std::size_t offset, std::uint32_t value)
 {
-    struct NoteOffEvent
-    {
-        std::uint32_t delta = 0;
-        std::uint8_t status = 0;
-        std::uint8_t note = 0;
-    };
+    bytes[offset] = static_cast<std::uint8_t>(value >> 24);
+    bytes[offset + 1] = static_cast<std::uint8_t>(value >> 16);
+    bytes[offset + 2] = static_cast<std::uint8_t>(value >> 8);
+    bytes[offset + 3] = static_cast<std::uint8_t>(value);
+}
 
-    constexpr std::size_t MaxNoteOffs = 1000;
-    constexpr std::uint32_t DefaultTempo = 120;
-    constexpr std::uint32_t XmiFreq = 120;
-    constexpr std::uint32_t DefaultTimebase = XmiFreq * 60 / DefaultTempo;
-    constexpr std::uint32_t DefaultQuarterNoteMicros = 60 * 1'000'000 / DefaultTempo;
-    constexpr std::uint16_t MidiTimebase = 960;
-    constexpr std::size_t TrackLengthOffset = 18;
-    constexpr std::size_t TrackDataOffset = 22;
+}
 
-    if (xmi.empty())
+namespace detail
+{
+// Walks the IFF chunks of an XMI image one FORM XMID at a time: root FORM
+// XMID chunks, and the FORM children of CAT XMID.
+class sequence_walker
+{
+public:
+    sequence_walker() = default;
+
+    explicit sequence_walker(std::span<const std::uint8_t> xmi)
+        : xmi_(xmi), root_(xmi.data()), end_(xmi.data() + xmi.size())
     {
-        throw std::runtime_error("Invalid XMI: empty file");
     }
 
-    const std::uint8_t* cursor = xmi.data();
-
-    auto need_bytes = [](const std::uint8_t* cursor, const std::uint8_t* end, std::size_t count,
-                         std::string_view context)
+    // Fills `info` with the next sequence and returns its FORM chunk, or
+    // nullptr past the last one.
+    result<const std::uint8_t*> next(std::size_t index, sequence_info& info)
     {
-        if (cursor > end || count > static_cast<std::size_t>(end - cursor))
+        for (;;)
         {
-            throw std::runtime_error("Invalid XMI: truncated " + std::string(context));
-        }
-    };
+            if (child_ != nullptr && child_ < childEnd_)
+            {
+                const std::uint8_t* const childStart = child_;
+                result<const std::uint8_t*> childEnd = chunk(child_, childEnd_);
+                if (!childEnd)
+                {
+                    return childEnd;
+                }
+                const std::uint32_t childLength = load_be32(childStart + 4);
+                child_ = next_chunk(*childEnd, childEnd_, childLength);
+                if (has_tag(childStart, childEnd_, "FORM"))
+                {
+                    const result<bool> isSequence =
+                        scan_form_xmid(xmi_, childStart, childStart + 8, *childEnd, childLength, index, info);
+                    if (!isSequence)
+                    {
+                        return std::unexpected(isSequence.error());
+                    }
+                    if (*isSequence)
+                    {
+                        return childStart;
+                    }
+                }
+                continue;
+            }
 
-    auto skip_bytes = [&](const std::uint8_t*& cursor, const std::uint8_t* end, std::size_t count,
-                          std::string_view context)
-    {
-        need_bytes(cursor, end, count, context);
-        cursor += count;
-    };
+            if (root_ >= end_)
+            {
+                return nullptr;
+            }
 
-    auto append_be32 = [](std::vector<std::uint8_t>& bytes, std::uint32_t value)
-    {
-        bytes.push_back(static_cast<std::uint8_t>(value >> 24));
-        bytes.push_back(static_cast<std::uint8_t>(value >> 16));
-        bytes.push_back(static_cast<std::uint8_t>(value >> 8));
-        bytes.push_back(static_cast<std::uint8_t>(value));
-    };
+            const std::uint8_t* const rootStart = root_;
+            result<const std::uint8_t*> rootEnd = chunk(root_, end_);
+            if (!rootEnd)
+            {
+                return rootEnd;
+            }
+            const std::uint32_t rootLength = load_be32(rootStart + 4);
+            const std::uint8_t* const rootPayload = rootStart + 8;
+            root_ = next_chunk(*rootEnd, end_, rootLength);
 
-    auto patch_be32 = [](std::vector<std::uint8_t>& bytes, std::size_t offset, std::uint32_t value)
-    {
-        bytes[offset] = static_cast<std::uint8_t>(value >> 24);
-        bytes[offset + 1] = static_cast<std::uint8_t>(value >> 16);
-        bytes[offset + 2] = static_cast<std::uint8_t>(value >> 8);
-        bytes[offset + 3] = static_cast<std::uint8_t>(value);
-    };
+            if (has_tag(rootStart, end_, "FORM"))
+            {
+                const result<bool> isSequence =
+                    scan_form_xmid(xmi_, rootStart, rootPayload, *rootEnd, rootLength, index, info);
+                if (!isSequence)
+                {
+                    return std::unexpected(isSequence.error());
+                }
+                if (*isSequence)
+                {
+                    return rootStart;
+                }
+            }
+            else if (has_tag(rootStart, end_, "CAT "))
+            {
+                if (rootLength < 4)
+                {
+                    return failure_at(error_code::chunk_too_small, xmi_, rootStart);
+                }
+                if (has_tag(rootPayload, *rootEnd, "XMID"))
+                {
+                    child_ = rootPayload + 4;
+                    childEnd_ = *rootEnd;
+                }
+            }
+        }
+    }
 
-    auto read_varlen = [&](const std::uint8_t*& cursor, const std::uint8_t* end) -> std::uint32_t
+private:
+    // Checks the chunk header at `start` and returns the end of its payload.
+    result<const std::uint8_t*> chunk(const std::uint8_t* start, const std::uint8_t* limit) const
     {
-        std::uint32_t value = 0;
-        for (int byteCount = 0; byteCount < 5; ++byteCount)
+        if (!has_bytes(start, limit, 8) || !has_bytes(start + 8, limit, load_be32(start + 4)))
         {
-            need_bytes(cursor, end, 1, "variable-length integer");
-            const std::uint8_t byte = *cursor++;
-            value = (value << 7) | (byte & 0x7F);
-            if ((byte & 0x80) == 0)
-            {
-                return value;
-            }
+            return failure_at(error_code::truncated_chunk, xmi_, start);
         }
-        throw std::runtime_error("Invalid XMI: variable-length integer is too large");
-    };
+        return start + 8 + load_be32(start + 4);
+    }
+
+    std::span<const std::uint8_t> xmi_;
+    const std::uint8_t* root_ = nullptr;
+    const std::uint8_t* end_ = nullptr;
+    const std::uint8_t* child_ = nullptr;
+    const std::uint8_t* childEnd_ = nullptr;
+};
+}
 
-    auto append_varlen = [](std::vector<std::uint8_t>& bytes, std::uint32_t value)
+#if !defined(XMI2MID_FREESTANDING)
+// Forward range over the sequences of an XMI image, parsed one at a time as
+// iteration reaches them, so finding sequence N stops at the Nth FORM XMID as
+// find_seq in XMIDI.ASM does. Nothing is allocated. Errors in chunks not
+// reached yet are not seen.
+class sequence_range
+{
+public:
+    class iterator
     {
-        std::array<std::uint8_t, 5> encoded{};
-        std::size_t count = 0;
-        encoded[count++] = static_cast<std::uint8_t>(value & 0x7F);
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = sequence_info;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const sequence_info*;
+        using reference = const sequence_info&;
 
-        while ((value >>= 7) != 0)
+        iterator() = default;
+
+        explicit iterator(std::span<const std::uint8_t> xmi) : walker_(xmi)
         {
-            encoded[count++] = static_cast<std::uint8_t>((value & 0x7F) | 0x80);
+            advance();
         }
 
-        while (count != 0)
+        reference operator*() const
         {
-            bytes.push_back(encoded[--count]);
+            return info_;
         }
-    };
 
-    auto read_xmi_delta = [&](const std::uint8_t*& cursor, const std::uint8_t* end) -> std::uint32_t
-    {
-        std::uint32_t delay = 0;
-        while (cursor != end && *cursor == 0x7F)
+        pointer operator->() const
         {
-            delay += *cursor++;
+            return &info_;
         }
 
-        need_bytes(cursor, end, 1, "XMI delta");
-        return delay + *cursor++;
-    };
+        iterator& operator++()
+        {
+            advance();
+            return *this;
+        }
 
-    auto scale_delta = [](std::uint32_t delta, std::uint32_t quarterNoteMicros) -> std::uint32_t
-    {
-        const std::uint64_t denominator = static_cast<std::uint64_t>(quarterNoteMicros) * DefaultTimebase;
-        if (denominator == 0)
+        iterator operator++(int)
         {
-            throw std::runtime_error("Invalid MIDI tempo: zero quarter-note length");
+            iterator previous = *this;
+            advance();
+            return previous;
         }
 
-        const std::uint64_t numerator =
-            static_cast<std::uint64_t>(delta) * MidiTimebase * DefaultQuarterNoteMicros;
-        return static_cast<std::uint32_t>((numerator + denominator / 2) / denominator);
-    };
+        friend bool operator==(const iterator& left, const iterator& right)
+        {
+            return left.form_ == right.form_;
+        }
 
-    auto append_scaled_delta = [&](std::vector<std::uint8_t>& midi, std::uint32_t delta,
-                                   std::uint32_t quarterNoteMicros)
-    {
-        append_varlen(midi, scale_delta(delta, quarterNoteMicros));
+    private:
+        void advance()
+        {
+            form_ = detail::value_or_fail(walker_.next(form_ == nullptr ? 0 : info_.index + 1, info_));
+        }
+
+        detail::sequence_walker walker_;
+        const std::uint8_t* form_ = nullptr;
+        sequence_info info_;
     };
 
-    auto append_bytes = [&](std::vector<std::uint8_t>& midi, const std::uint8_t*& cursor,
-                            const std::uint8_t* end, std::size_t count)
+    explicit sequence_range(std::span<const std::uint8_t> xmi) : xmi_(xmi)
     {
-        need_bytes(cursor, end, count, "event payload");
-        midi.insert(midi.end(), cursor, cursor + count);
-        cursor += count;
-    };
+    }
 
-    auto channel_event_size = [](std::uint8_t status) -> std::size_t
+    iterator begin() const
     {
-        switch (status & 0xF0)
-        {
-        case 0x80:
-        case 0x90:
-        case 0xA0:
-        case 0xB0:
-        case 0xE0:
-            return 3;
-        case 0xC0:
-        case 0xD0:
-            return 2;
-        default:
-            return 0;
-        }
-    };
+        return iterator(xmi_);
+    }
 
-    const auto sequences = sequence_infos(xmi);
-    if (sequenceIndex >= sequences.size())
+    iterator end() const
     {
-        throw std::runtime_error("Invalid XMI: sequence index " + std::to_string(sequenceIndex) +
-                                 " is out of range for " + std::to_string(sequences.size()) + " sequence(s)");
+        return {};
     }
 
-    const sequence_info& sequence = sequences[sequenceIndex];
-    cursor = xmi.data() + sequence.event_offset;
-    const std::uint8_t* const eventEnd = cursor + sequence.event_size;
+private:
+    std::span<const std::uint8_t> xmi_;
+};
 
-    std::vector<std::uint8_t> midi;
-    midi.reserve((xmi.size() * 2) + TrackDataOffset);
-    midi.insert(midi.end(), {'M', 'T', 'h', 'd'});
-    append_be32(midi, 6);
-    midi.push_back(0);
-    midi.push_back(0);
-    midi.push_back(0);
-    midi.push_back(1);
-    midi.push_back(static_cast<std::uint8_t>(MidiTimebase >> 8));
-    midi.push_back(static_cast<std::uint8_t>(MidiTimebase));
-    midi.insert(midi.end(), {'M', 'T', 'r', 'k', 0, 0, 0, 0});
-
-    std::array<NoteOffEvent, MaxNoteOffs> noteOffs{};
-    std::size_t noteOffCount = 0;
-    std::uint32_t quarterNoteMicros = DefaultQuarterNoteMicros;
-    bool expectDelta = true;
-
-    auto append_note_off = [&](const NoteOffEvent& event)
-    {
-        midi.push_back(event.status & 0x8F);
-        midi.push_back(event.note);
-        midi.push_back(0x7F);
-    };
+inline sequence_range sequences(std::span<const std::uint8_t> xmi)
+{
+    return sequence_range(xmi);
+}
+
+inline result<std::vector<sequence_info>> try_sequence_infos(std::span<const std::uint8_t> xmi)
+{
+    if (xmi.empty())
+    {
+        return std::unexpected(error{error_code::empty_file, 0});
+    }
 
-    auto queue_note_off = [&](std::uint32_t delta, std::uint8_t status, std::uint8_t note)
+    std::vector<sequence_info> infos;
+    detail::sequence_walker walker(xmi);
+    sequence_info info;
+    for (;;)
     {
-        if (noteOffCount == noteOffs.size())
+        const result<const std::uint8_t*> form = walker.next(infos.size(), info);
+        if (!form)
         {
-            throw std::runtime_error("Too many pending note-off events");
+            return std::unexpected(form.error());
         }
-
-        const auto first = noteOffs.begin();
-        const auto last = first + static_cast<std::ptrdiff_t>(noteOffCount);
-        const auto insertAt = std::upper_bound(first, last, delta, [](std::uint32_t value, const NoteOffEvent& event)
+        if (*form == nullptr)
         {
-            return value < event.delta;
-        });
+            break;
+        }
+        infos.push_back(info);
+    }
+    if (infos.empty())
+    {
+        return std::unexpected(error{error_code::missing_sequence, 0});
+    }
 
-        std::move_backward(insertAt, last, last + 1);
-        *insertAt = NoteOffEvent{delta, status, note};
-        ++noteOffCount;
-    };
+    return infos;
+}
 
-    auto pop_note_off = [&]
-    {
-        const NoteOffEvent event = noteOffs[0];
-        append_scaled_delta(midi, event.delta, quarterNoteMicros);
-        append_note_off(event);
+inline std::vector<sequence_info> sequence_infos(std::span<const std::uint8_t> xmi)
+{
+    return detail::value_or_fail(try_sequence_infos(xmi));
+}
 
-        for (std::size_t i = 1; i < noteOffCount; ++i)
-        {
-            noteOffs[i].delta -= event.delta;
-        }
+// One TIMB entry: a timbre the sequence needs loaded before it plays.
+struct timbre_request
+{
+    std::uint8_t patch = 0;
+    std::uint8_t bank = 0;
 
-        std::move(noteOffs.begin() + 1, noteOffs.begin() + static_cast<std::ptrdiff_t>(noteOffCount),
-                  noteOffs.begin());
-        --noteOffCount;
-    };
+    friend bool operator==(const timbre_request&, const timbre_request&) = default;
+};
 
-    auto begin_event = [&]
+// Non-owning view of a TIMB chunk's patch/bank pairs, read in place from the
+// XMI bytes.
+class timbre_view
+{
+public:
+    class iterator
     {
-        if (expectDelta)
+    public:
+        using value_type = timbre_request;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        explicit iterator(const std::uint8_t* pair) : pair_(pair)
         {
-            append_scaled_delta(midi, 0, quarterNoteMicros);
         }
-        expectDelta = true;
-    };
 
-    while (cursor < eventEnd)
-    {
-        if (*cursor < 0x80)
+        timbre_request operator*() const
         {
-            std::uint32_t delay = read_xmi_delta(cursor, eventEnd);
-
-            while (noteOffCount != 0 && delay > noteOffs[0].delta)
-            {
-                delay -= noteOffs[0].delta;
-                pop_note_off();
-            }
-
-            for (std::size_t i = 0; i < noteOffCount; ++i)
-            {
-                noteOffs[i].delta -= delay;
-            }
+            return {pair_[0], pair_[1]};
+        }
 
-            append_scaled_delta(midi, delay, quarterNoteMicros);
-            expectDelta = false;
-            continue;
+        iterator& operator++()
+        {
+            pair_ += 2;
+            return *this;
         }
 
-        const std::uint8_t status = *cursor;
-        if (status == 0xFF)
+        iterator operator++(int)
         {
-            need_bytes(cursor, eventEnd, 2, "meta event");
-            const std::uint8_t metaType = cursor[1];
-            begin_event();
+            iterator previous = *this;
+            pair_ += 2;
+            return previous;
+        }
 
-            if (metaType == 0x2F)
-            {
-                cursor += 2;
-                const std::uint32_t metaLength = read_varlen(cursor, eventEnd);
-                skip_bytes(cursor, eventEnd, metaLength, "end-of-track payload");
+        friend bool operator==(const iterator&, const iterator&) = default;
 
-                for (std::size_t i = 0; i < noteOffCount; ++i)
-                {
-                    append_note_off(noteOffs[i]);
-                    append_scaled_delta(midi, 0, quarterNoteMicros);
-                }
+    private:
+        const std::uint8_t* pair_ = nullptr;
+    };
 
-                midi.push_back(0xFF);
-                midi.push_back(0x2F);
-                midi.push_back(0);
-                break;
-            }
+    timbre_view() = default;
 
-            midi.push_back(*cursor++);
-            midi.push_back(*cursor++);
-            const std::uint8_t* const lengthStart = cursor;
-            const std::uint32_t metaLength = read_varlen(cursor, eventEnd);
-            midi.insert(midi.end(), lengthStart, cursor);
-            need_bytes(cursor, eventEnd, metaLength, "meta payload");
+    explicit timbre_view(std::span<const std::uint8_t> pairs) : pairs_(pairs)
+    {
+    }
 
-            if (metaType == 0x51 && metaLength == 3)
-            {
-                quarterNoteMicros = (static_cast<std::uint32_t>(cursor[0]) << 16) |
-                                    (static_cast<std::uint32_t>(cursor[1]) << 8) |
-                                    static_cast<std::uint32_t>(cursor[2]);
-            }
+    std::size_t size() const
+    {
+        return pairs_.size() / 2;
+    }
 
-            midi.insert(midi.end(), cursor, cursor + metaLength);
-            cursor += metaLength;
-        }
+    bool empty() const
+    {
+        return pairs_.size() < 2;
+    }
+
+    timbre_request operator[](std::size_t index) const
+    {
+        return {pairs_[index * 2], pairs_[(index * 2) + 1]};
+    }
+
+    iterator begin() const
+    {
+        return iterator(pairs_.data());
+    }
+
+    iterator end() const
+    {
+        return iterator(pairs_.data() + (size() * 2));
+    }
+
+private:
+    std::span<const std::uint8_t> pairs_;
+};
+
+namespace detail
+{
+// Returns the payload of a chunk recorded in `sequence`, or an error when it
+// does not fit in `xmi`.
+inline result<std::span<const std::uint8_t>> recorded_chunk(std::span<const std::uint8_t> xmi, std::size_t offset,
+                                                            std::size_t size)
+{
+    if (offset > xmi.size() || size > xmi.size() - offset)
+    {
+        return std::unexpected(error{error_code::truncated_chunk, xmi.size()});
+    }
+    return xmi.subspan(offset, size);
+}
+}
+
+// TIMB: LE16 entry count, then a patch and a bank byte per entry.
+inline result<timbre_view> try_timbres(std::span<const std::uint8_t> xmi, const sequence_info& sequence)
+{
+    if (!sequence.has_timb)
+    {
+        return timbre_view{};
+    }
+    const result<std::span<const std::uint8_t>> chunk =
+        detail::recorded_chunk(xmi, sequence.timb_offset, sequence.timb_size);
+    if (!chunk)
+    {
+        return std::unexpected(chunk.error());
+    }
+
+    const std::uint8_t* const payload = chunk->data();
+    const std::uint8_t* const end = payload + chunk->size();
+    if (!detail::has_bytes(payload, end, 2))
+    {
+        return detail::failure_at(error_code::truncated_chunk, xmi, payload);
+    }
+    const std::size_t count = static_cast<std::size_t>(payload[0]) | (static_cast<std::size_t>(payload[1]) << 8);
+    if (!detail::has_bytes(payload + 2, end, count * 2))
+    {
+        return detail::failure_at(error_code::truncated_chunk, xmi, payload + 2);
+    }
+    return timbre_view(std::span<const std::uint8_t>(payload + 2, count * 2));
+}
+
+inline timbre_view timbres(std::span<const std::uint8_t> xmi, const sequence_info& sequence)
+{
+    return detail::value_or_fail(try_timbres(xmi, sequence));
+}
+
+// The RBRN entries of a sequence, in table order. Every offset must fall
+// inside EVNT.
+inline result<std::vector<branch_point>> try_branch_points(std::span<const std::uint8_t> xmi,
+                                                           const sequence_info& sequence)
+{
+    if (!sequence.has_rbrn)
+    {
+        return std::vector<branch_point>{};
+    }
+    const result<std::span<const std::uint8_t>> chunk =
+        detail::recorded_chunk(xmi, sequence.rbrn_offset, sequence.rbrn_size);
+    if (!chunk)
+    {
+        return std::unexpected(chunk.error());
+    }
+
+    const std::uint8_t* const table = chunk->data();
+    const std::uint8_t* const end = table + chunk->size();
+    if (!detail::has_bytes(table, end, 2))
+    {
+        return detail::failure_at(error_code::truncated_chunk, xmi, table);
+    }
+    const std::size_t count = detail::branch_count(table);
+    if (!detail::has_bytes(table + 2, end, count * 6))
+    {
+        return detail::failure_at(error_code::truncated_chunk, xmi, table + 2);
+    }
+
+    std::vector<branch_point> branches;
+    branches.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const branch_point branch = detail::load_branch(table, i);
+        if (branch.offset >= sequence.event_size)
+        {
+            return std::unexpected(error{error_code::branch_outside_evnt, sequence.form_offset});
+        }
+        branches.push_back(branch);
+    }
+    return branches;
+}
+
+inline std::vector<branch_point> branch_points(std::span<const std::uint8_t> xmi, const sequence_info& sequence)
+{
+    return detail::value_or_fail(try_branch_points(xmi, sequence));
+}
+
+// Every distinct timbre requested by any sequence, in first-request order.
+inline std::vector<timbre_request> required_timbres(std::span<const std::uint8_t> xmi)
+{
+    std::array<std::uint64_t, 65536 / 64> seen{};
+    std::vector<timbre_request> required;
+    for (const sequence_info& sequence : sequence_infos(xmi))
+    {
+        for (const timbre_request timbre : timbres(xmi, sequence))
+        {
+            const std::size_t key = (static_cast<std::size_t>(timbre.bank) << 8) | timbre.patch;
+            const std::uint64_t bit = std::uint64_t{1} << (key & 63);
+            if ((seen[key >> 6] & bit) == 0)
+            {
+                seen[key >> 6] |= bit;
+                required.push_back(timbre);
+            }
+        }
+    }
+    return required;
+}
+
+// Sequence count from the INFO chunk of a leading FORM XDIR, as MIDIFORM
+// writes it, or nullopt when there is none. Only the directory chunk is read,
+// so a prefix of the file is enough.
+inline std::optional<std::size_t> directory_sequence_count(std::span<const std::uint8_t> xmi)
+{
+    if (xmi.size() < 12)
+    {
+        return std::nullopt;
+    }
+
+    const std::uint8_t* cursor = xmi.data();
+    const std::uint8_t* const end = cursor + xmi.size();
+    if (!detail::has_tag(cursor, end, "FORM") || !detail::has_tag(cursor + 8, end, "XDIR"))
+    {
+        return std::nullopt;
+    }
+
+    cursor += 4;
+    const std::uint32_t length = detail::read_be32(cursor, end);
+    if (length < 4 || length > static_cast<std::size_t>(end - cursor))
+    {
+        return std::nullopt;
+    }
+
+    const std::uint8_t* const directoryEnd = cursor + length;
+    cursor += 4;
+    while (directoryEnd - cursor >= 8)
+    {
+        const bool isInfo = detail::has_tag(cursor, directoryEnd, "INFO");
+        cursor += 4;
+        const std::uint32_t chunkLength = detail::read_be32(cursor, directoryEnd);
+        if (chunkLength > static_cast<std::size_t>(directoryEnd - cursor))
+        {
+            return std::nullopt;
+        }
+        if (isInfo && chunkLength >= 2)
+        {
+            const std::size_t count = static_cast<std::size_t>(cursor[0]) | (static_cast<std::size_t>(cursor[1]) << 8);
+            return count == 0 ? std::nullopt : std::optional<std::size_t>(count);
+        }
+        cursor = detail::next_chunk(cursor + chunkLength, directoryEnd, chunkLength);
+    }
+    return std::nullopt;
+}
+
+enum class directory_check : std::uint8_t
+{
+    trust, // use the XDIR INFO count when there is one
+    verify // also walk the catalog and throw if the counts differ
+};
+
+namespace detail
+{
+inline result<std::size_t> walk_sequence_count(std::span<const std::uint8_t> xmi)
+{
+    if (xmi.empty())
+    {
+        return std::unexpected(error{error_code::empty_file, 0});
+    }
+
+    std::size_t count = 0;
+    sequence_walker walker(xmi);
+    sequence_info info;
+    for (;;)
+    {
+        const result<const std::uint8_t*> form = walker.next(count, info);
+        if (!form)
+        {
+            return std::unexpected(form.error());
+        }
+        if (*form == nullptr)
+        {
+            break;
+        }
+        ++count;
+    }
+    if (count == 0)
+    {
+        return std::unexpected(error{error_code::missing_sequence, 0});
+    }
+    return count;
+}
+}
+
+// Returns the number of sequences. With an XDIR INFO count this reads only the
+// directory; otherwise, or with directory_check::verify, it walks the catalog
+// without building sequence_info values.
+inline result<std::size_t> try_sequence_count(std::span<const std::uint8_t> xmi,
+                                              directory_check check = directory_check::trust)
+{
+    const std::optional<std::size_t> directoryCount = directory_sequence_count(xmi);
+    if (directoryCount && check == directory_check::trust)
+    {
+        return *directoryCount;
+    }
+
+    const result<std::size_t> count = detail::walk_sequence_count(xmi);
+    if (count && directoryCount && *directoryCount != *count)
+    {
+        return std::unexpected(error{error_code::directory_mismatch, 0});
+    }
+    return count;
+}
+
+inline std::size_t sequence_count(std::span<const std::uint8_t> xmi, directory_check check = directory_check::trust)
+{
+    const result<std::size_t> count = try_sequence_count(xmi, check);
+    if (!count && count.error().code == error_code::directory_mismatch)
+    {
+        detail::fail("Invalid XMI: XDIR INFO lists " + std::to_string(*directory_sequence_count(xmi)) +
+                     " sequence(s) but the catalog has " + std::to_string(*detail::walk_sequence_count(xmi)));
+    }
+    return detail::value_or_fail(count);
+}
+
+// An XMI image found inside other data: FORM XDIR with its CAT XMID, a bare
+// CAT XMID, or a bare FORM XMID.
+struct embedded_xmi
+{
+    std::size_t offset = 0;
+    std::size_t size = 0;
+    std::size_t sequence_count = 0;
+};
+
+namespace detail
+{
+// Returns the size of the XMI image whose root chunk starts at `start`, or 0
+// when the chunk lengths do not fit or it does not parse as XMI.
+inline std::size_t embedded_size(std::span<const std::uint8_t> data, std::size_t start, bool directory,
+                                 std::size_t& sequenceCount)
+{
+    const std::uint8_t* const end = data.data() + data.size();
+    const std::size_t available = data.size() - start;
+    const std::uint8_t* length = data.data() + start + 4;
+    std::size_t size = std::size_t{8} + read_be32(length, end);
+    if (size > available)
+    {
+        return 0;
+    }
+
+    if (directory)
+    {
+        size += size & 1;
+        if (size + 12 > available)
+        {
+            return 0;
+        }
+        const std::uint8_t* const catalog = data.data() + start + size;
+        if (!has_tag(catalog, end, "CAT ") || !has_tag(catalog + 8, end, "XMID"))
+        {
+            return 0;
+        }
+        length = catalog + 4;
+        size += std::size_t{8} + read_be32(length, end);
+        if (size > available)
+        {
+            return 0;
+        }
+    }
+
+    const result<std::size_t> count = walk_sequence_count(data.subspan(start, size));
+    if (!count)
+    {
+        return 0;
+    }
+    sequenceCount = *count;
+    return size;
+}
+}
+
+// Finds XMI images whose root chunk starts in [first, last), checking each
+// FORM XDIR, CAT XMID, or FORM XMID signature with the sequence_infos() chunk
+// walk. Images may extend past `last`, so a large buffer can be split into
+// shards scanned separately; a hit nested in an earlier image is skipped.
+inline std::vector<embedded_xmi> find_embedded(std::span<const std::uint8_t> data, std::size_t first,
+                                               std::size_t last)
+{
+    std::vector<embedded_xmi> found;
+    last = std::min(last, data.size());
+    if (first >= last || data.size() < 12)
+    {
+        return found;
+    }
+
+    // Every signature has an 'X' eight bytes after its start, so memchr can
+    // skip ahead at memory speed and only 'X' bytes are looked at closely.
+    const std::uint8_t* const begin = data.data();
+    const std::uint8_t* const end = begin + data.size();
+    std::size_t position = first + 8;
+    const std::size_t stop = std::min(last + 8, data.size() - 3);
+    while (position < stop)
+    {
+        const auto* const x = static_cast<const std::uint8_t*>(std::memchr(begin + position, 'X', stop - position));
+        if (x == nullptr)
+        {
+            break;
+        }
+        position = static_cast<std::size_t>(x - begin) + 1;
+
+        const std::uint8_t* const start = x - 8;
+        const bool directory = detail::has_tag(start, end, "FORM") && detail::has_tag(x, end, "XDIR");
+        const bool image = directory ||
+                           ((detail::has_tag(start, end, "FORM") || detail::has_tag(start, end, "CAT ")) &&
+                            detail::has_tag(x, end, "XMID"));
+        if (!image)
+        {
+            continue;
+        }
+
+        const std::size_t offset = static_cast<std::size_t>(start - begin);
+        std::size_t sequences = 0;
+        const std::size_t size = detail::embedded_size(data, offset, directory, sequences);
+        if (size != 0)
+        {
+            found.push_back({offset, size, sequences});
+            position = offset + size + 8;
+        }
+    }
+    return found;
+}
+
+inline std::vector<embedded_xmi> find_embedded(std::span<const std::uint8_t> data)
+{
+    return find_embedded(data, 0, data.size());
+}
+#endif
+
+enum class patch_map : std::uint8_t
+{
+    none,
+    mt32_to_gm // Roland MT-32 presets and rhythm keys to General MIDI
+};
+
+struct convert_options
+{
+    // Applied to Program Change and channel 10 Note On events as they are
+    // written.
+    patch_map patches = patch_map::none;
+};
+
+namespace detail
+{
+struct note_off_event
+{
+    std::uint32_t delta = 0;
+    std::uint8_t status = 0;
+    std::uint8_t note = 0;
+
+    friend bool operator==(const note_off_event&, const note_off_event&) = default;
+};
+
+inline std::expected<std::uint32_t, error_code> parse_xmi_varlen(const std::uint8_t*& cursor,
+                                                                 const std::uint8_t* end)
+{
+    std::uint32_t value = 0;
+    for (int byteCount = 0; byteCount < 5; ++byteCount)
+    {
+        if (cursor >= end)
+        {
+            return std::unexpected(error_code::truncated_event);
+        }
+        const std::uint8_t byte = *cursor++;
+        value = (value << 7) | (byte & 0x7F);
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+    return std::unexpected(error_code::varlen_too_large);
+}
+
+#if !defined(XMI2MID_FREESTANDING)
+inline std::uint32_t read_xmi_varlen(const std::uint8_t*& cursor, const std::uint8_t* end)
+{
+    const std::expected<std::uint32_t, error_code> value = parse_xmi_varlen(cursor, end);
+    if (!value)
+    {
+        detail::fail(std::string(describe(value.error())));
+    }
+    return *value;
+}
+#endif
+
+// AIL sequence controllers, handled by the driver instead of the synthesizer.
+inline constexpr std::uint8_t ForController = 116;
+inline constexpr std::uint8_t NextController = 117;
+inline constexpr std::uint8_t ClearBeatBarController = 118;
+inline constexpr std::uint8_t CallbackController = 119;
+inline constexpr std::uint8_t BranchController = 120;
+inline constexpr std::uint8_t FirstSequenceController = ForController;
+inline constexpr std::uint8_t LastSequenceController = BranchController;
+inline constexpr std::uint8_t BreakThreshold = 64;
+
+inline constexpr std::uint8_t PatchBankController = 114;
+inline constexpr std::uint8_t RhythmChannel = 9;
+
+// General MIDI program for each MT-32 built-in preset (Acou Piano 1 through
+// Jungle Tune).
+inline constexpr std::array<std::uint8_t, 128> Mt32ToGmProgram = {
+    0,   1,   0,   4,   5,   4,   5,   3,   16,  17,  18,  16,  19,  19,  20,  21,  // pianos, organs
+    6,   6,   6,   7,   7,   7,   8,   8,   62,  63,  62,  63,  38,  39,  38,  39,  // keys, synth brass/bass
+    88,  75,  52,  92,  97,  99,  98,  85,  98,  96,  68,  75,  81,  100, 53,  80,  // synth effects
+    48,  49,  48,  45,  40,  40,  42,  42,  43,  46,  46,  24,  25,  26,  27,  104, // strings, guitars
+    32,  32,  33,  34,  36,  37,  35,  35,  73,  73,  72,  72,  74,  75,  64,  65,  // basses, flutes, saxes
+    66,  67,  71,  71,  68,  69,  70,  22,  56,  56,  57,  57,  60,  60,  58,  61,  // reeds, brass
+    61,  11,  11,  98,  14,  9,   14,  13,  12,  107, 20,  77,  78,  78,  76,  76,  // mallets, ethnic, winds
+    47,  117, 118, 118, 118, 116, 115, 119, 115, 112, 55,  124, 123, 0,   14,  117, // percussion, effects
+};
+
+// The MT-32 rhythm part already uses the GM key layout for its default
+// sounds, except Quijada, which GM calls Vibraslap.
+inline constexpr std::array<std::uint8_t, 128> identity_bytes()
+{
+    std::array<std::uint8_t, 128> bytes{};
+    for (std::size_t i = 0; i < bytes.size(); ++i)
+    {
+        bytes[i] = static_cast<std::uint8_t>(i);
+    }
+    return bytes;
+}
+
+inline constexpr std::array<std::uint8_t, 128> Mt32RhythmToGm = []
+{
+    std::array<std::uint8_t, 128> keys = identity_bytes();
+    keys[73] = 58;
+    return keys;
+}();
+
+inline std::size_t channel_event_size(std::uint8_t status)
+{
+    switch (status & 0xF0)
+    {
+    case 0x80:
+    case 0x90:
+    case 0xA0:
+    case 0xB0:
+    case 0xE0:
+        return 3;
+    case 0xC0:
+    case 0xD0:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+// Parses the catalog only as far as the requested sequence.
+inline result<sequence_info> try_find_sequence(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    if (xmi.empty())
+    {
+        return std::unexpected(error{error_code::empty_file, 0});
+    }
+
+    sequence_walker walker(xmi);
+    sequence_info info;
+    for (std::size_t index = 0;; ++index)
+    {
+        const result<const std::uint8_t*> form = walker.next(index, info);
+        if (!form)
+        {
+            return std::unexpected(form.error());
+        }
+        if (*form == nullptr)
+        {
+            return std::unexpected(
+                error{index == 0 ? error_code::missing_sequence : error_code::sequence_out_of_range,
+                      index == 0 ? 0 : xmi.size()});
+        }
+        if (index == sequenceIndex)
+        {
+            return info;
+        }
+    }
+}
+
+#if !defined(XMI2MID_FREESTANDING)
+// Throws for an error from a try_ function given `sequenceIndex`, naming the
+// sequence count when the index was out of range.
+[[noreturn]] inline void fail_sequence(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                       const error& failure)
+{
+    if (failure.code == error_code::sequence_out_of_range)
+    {
+        fail("Invalid XMI: sequence index " + std::to_string(sequenceIndex) + " is out of range for " +
+             std::to_string(*walk_sequence_count(xmi)) + " sequence(s)");
+    }
+    fail(failure);
+}
+
+inline sequence_info find_sequence(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    result<sequence_info> sequence = try_find_sequence(xmi, sequenceIndex);
+    if (!sequence)
+    {
+        fail_sequence(xmi, sequenceIndex, sequence.error());
+    }
+    return std::move(*sequence);
+}
+#endif
+
+inline constexpr std::size_t MaxNoteOffs = 1000;
+
+// One MIDI Format 0 file rendered from an EVNT stream. Note On durations
+// become queued Note Offs, and 120 Hz XMI deltas are scaled to MidiTimebase
+// ticks at the current tempo. Bytes is the output container; see
+// convert_into(). NoteOffs holds the queue: a std::array, or a std::span over
+// a pool the caller owns.
+template <typename Bytes, typename NoteOffs = std::array<note_off_event, MaxNoteOffs>>
+class basic_smf_render
+{
+public:
+    static constexpr std::size_t MaxNoteOffs = detail::MaxNoteOffs;
+    static constexpr std::uint32_t DefaultTempo = 120;
+    static constexpr std::uint32_t XmiFreq = 120;
+    static constexpr std::uint32_t DefaultTimebase = XmiFreq * 60 / DefaultTempo;
+    static constexpr std::uint32_t DefaultQuarterNoteMicros = 60 * 1'000'000 / DefaultTempo;
+    static constexpr std::uint16_t MidiTimebase = 960;
+    static constexpr std::size_t TrackLengthOffset = 18;
+    static constexpr std::size_t TrackDataOffset = 22;
+    static constexpr double MinSpeed = 0.25;
+    static constexpr double MaxSpeed = 64;
+
+    explicit basic_smf_render(std::size_t reserveBytes, Bytes midi = Bytes{}) : midi_(std::move(midi))
+    {
+        midi_.reserve(reserveBytes + TrackDataOffset);
+        append_tag(midi_, "MThd");
+        append_be32(midi_, 6);
+        append_be32(midi_, 1);
+        midi_.push_back(static_cast<std::uint8_t>(MidiTimebase >> 8));
+        midi_.push_back(static_cast<std::uint8_t>(MidiTimebase));
+        append_tag(midi_, "MTrk");
+        append_be32(midi_, 0);
+    }
+
+    basic_smf_render(std::size_t reserveBytes, Bytes midi, NoteOffs noteOffs)
+        : basic_smf_render(reserveBytes, std::move(midi))
+    {
+        noteOffs_ = noteOffs;
+    }
+
+    void delay(std::uint32_t delay)
+    {
+        while (noteOffCount_ != 0 && delay > noteOffs_[0].delta)
+        {
+            delay -= noteOffs_[0].delta;
+            pop_note_off();
+        }
+
+        for (std::size_t i = 0; i < noteOffCount_; ++i)
+        {
+            noteOffs_[i].delta -= delay;
+        }
+
+        lastDeltaStart_ = midi_.size();
+        lastDelta_ = carry_ + delay;
+        append_scaled_delta(delay);
+        expectDelta_ = false;
+    }
+
+    // Leaves the current event out of the output. A delta already written for
+    // it is removed and carried into the next delta, so timing is unchanged.
+    void drop()
+    {
+        if (!expectDelta_)
+        {
+            midi_.resize(lastDeltaStart_);
+            carry_ = lastDelta_;
+            expectDelta_ = true;
+        }
+    }
+
+    // Copies a complete meta event; tempo events also change delta scaling.
+    void meta(const std::uint8_t* event, const std::uint8_t* eventEnd, std::uint8_t type,
+              const std::uint8_t* payload, std::uint32_t length)
+    {
+        begin_event();
+        if (type == 0x51 && length == 3)
+        {
+            quarterNoteMicros_ = (static_cast<std::uint32_t>(payload[0]) << 16) |
+                                 (static_cast<std::uint32_t>(payload[1]) << 8) |
+                                 static_cast<std::uint32_t>(payload[2]);
+        }
+        midi_.insert(midi_.end(), event, eventEnd);
+    }
+
+    void end_of_track()
+    {
+        begin_event();
+        for (std::size_t i = 0; i < noteOffCount_; ++i)
+        {
+            append_note_off(noteOffs_[i]);
+            append_scaled_delta(0);
+        }
+
+        midi_.push_back(0xFF);
+        midi_.push_back(0x2F);
+        midi_.push_back(0);
+    }
+
+    void sysex(const std::uint8_t* event, const std::uint8_t* eventEnd)
+    {
+        begin_event();
+        midi_.insert(midi_.end(), event, eventEnd);
+    }
+
+    void channel(const std::uint8_t* event, std::size_t size)
+    {
+        begin_event();
+        if (patchMap_ == patch_map::mt32_to_gm)
+        {
+            append_gm_channel(event, size);
+            return;
+        }
+        midi_.insert(midi_.end(), event, event + size);
+    }
+
+    void note_on(const std::uint8_t* event, std::uint32_t duration)
+    {
+        if (patchMap_ == patch_map::mt32_to_gm && (event[0] & 0x0F) == RhythmChannel)
+        {
+            const std::uint8_t remapped[3] = {event[0], Mt32RhythmToGm[event[1] & 0x7F], event[2]};
+            channel(remapped, 3);
+            queue_note_off(duration, remapped[0], remapped[1]);
+            return;
+        }
+        channel(event, 3);
+        queue_note_off(duration, event[0], event[1]);
+    }
+
+    void set_patch_map(patch_map map)
+    {
+        patchMap_ = map;
+    }
+
+#if !defined(XMI2MID_FREESTANDING)
+    // Scales every delta so the output plays `speed` times as fast. Tempo meta
+    // events are kept as they are.
+    void set_speed(double speed)
+    {
+        if (!(speed >= MinSpeed && speed <= MaxSpeed))
+        {
+            detail::fail("Invalid tempo scale: must be from 0.25 to 64");
+        }
+        tickScale_ = static_cast<std::uint64_t>(std::llround(static_cast<double>(DefaultTickScale) / speed));
+    }
+#endif
+
+    void skip()
+    {
+        expectDelta_ = true;
+    }
+
+    // Writes a text meta event in place of the current event and returns the
+    // offset of its delta from the start of the MTrk data.
+    std::size_t replace_with_text(std::uint8_t type, std::string_view text)
+    {
+        const std::size_t deltaStart = expectDelta_ ? midi_.size() : lastDeltaStart_;
+        begin_event();
+        midi_.push_back(0xFF);
+        midi_.push_back(type);
+        append_varlen(midi_, static_cast<std::uint32_t>(text.size()));
+        append_tag(midi_, text);
+        return deltaStart - TrackDataOffset;
+    }
+
+#if !defined(XMI2MID_FREESTANDING)
+    // Everything that decides the bytes written for the events that follow.
+    struct state
+    {
+        std::vector<note_off_event> note_offs;
+        std::uint32_t quarter_note_micros = 0;
+        std::uint32_t carry = 0;
+        bool expect_delta = true;
+        std::size_t output_size = 0;
+        std::array<std::uint8_t, 16> banks{};
+    };
+
+    void save_state(state& saved) const
+    {
+        saved.note_offs.assign(noteOffs_.begin(), noteOffs_.begin() + static_cast<std::ptrdiff_t>(noteOffCount_));
+        saved.quarter_note_micros = quarterNoteMicros_;
+        saved.carry = carry_;
+        saved.expect_delta = expectDelta_;
+        saved.output_size = midi_.size();
+        saved.banks = banks_;
+    }
+
+    bool same_state(const state& saved) const
+    {
+        return saved.quarter_note_micros == quarterNoteMicros_ && saved.carry == carry_ &&
+               saved.expect_delta == expectDelta_ && saved.banks == banks_ &&
+               std::equal(saved.note_offs.begin(), saved.note_offs.end(), noteOffs_.begin(),
+                          noteOffs_.begin() + static_cast<std::ptrdiff_t>(noteOffCount_));
+    }
+
+    // Appends copies of the output written since `from`.
+    void repeat_output(std::size_t from, std::size_t times)
+    {
+        const std::size_t length = midi_.size() - from;
+        const std::size_t start = midi_.size();
+        midi_.resize(start + (length * times));
+        std::uint8_t* const bytes = midi_.data();
+        for (std::size_t i = 0; i < times; ++i)
+        {
+            std::copy_n(bytes + from, length, bytes + start + (i * length));
+        }
+    }
+#endif
+
+    // The first error met so far. Later events are still accepted, but the
+    // output is not valid MIDI.
+    std::optional<error_code> failure() const
+    {
+        return failure_;
+    }
+
+    std::expected<Bytes, error_code> try_take()
+    {
+        const std::size_t trackLength = midi_.size() - TrackDataOffset;
+        if (!failure_ && trackLength > std::numeric_limits<std::uint32_t>::max())
+        {
+            failure_ = error_code::sequence_too_long;
+        }
+        if (failure_)
+        {
+            return std::unexpected(*failure_);
+        }
+
+        patch_be32(midi_, TrackLengthOffset, static_cast<std::uint32_t>(trackLength));
+        return std::move(midi_);
+    }
+
+#if !defined(XMI2MID_FREESTANDING)
+    Bytes take()
+    {
+        std::expected<Bytes, error_code> midi = try_take();
+        if (!midi)
+        {
+            detail::fail(std::string(describe(midi.error())));
+        }
+        return std::move(*midi);
+    }
+#endif
+
+private:
+    // Numerator of scale_delta() at normal speed.
+    static constexpr std::uint64_t DefaultTickScale = std::uint64_t{MidiTimebase} * DefaultQuarterNoteMicros;
+
+    std::uint32_t scale_delta(std::uint32_t delta)
+    {
+        const std::uint64_t denominator = static_cast<std::uint64_t>(quarterNoteMicros_) * DefaultTimebase;
+        if (denominator == 0)
+        {
+            failure_ = failure_.value_or(error_code::zero_tempo);
+            return 0;
+        }
+
+        const std::uint64_t numerator = static_cast<std::uint64_t>(delta) * tickScale_;
+        return static_cast<std::uint32_t>((numerator + denominator / 2) / denominator);
+    }
+
+    void append_scaled_delta(std::uint32_t delta)
+    {
+        append_varlen(midi_, scale_delta(carry_ + delta));
+        carry_ = 0;
+    }
+
+    void append_note_off(const note_off_event& event)
+    {
+        midi_.push_back(event.status & 0x8F);
+        midi_.push_back(event.note);
+        midi_.push_back(0x7F);
+    }
+
+    void queue_note_off(std::uint32_t delta, std::uint8_t status, std::uint8_t note)
+    {
+        if (noteOffCount_ == noteOffs_.size())
+        {
+            failure_ = failure_.value_or(error_code::too_many_note_offs);
+            return;
+        }
+
+        const auto first = noteOffs_.begin();
+        const auto last = first + static_cast<std::ptrdiff_t>(noteOffCount_);
+        const auto insertAt = std::upper_bound(first, last, delta, [](std::uint32_t value, const note_off_event& event)
+        {
+            return value < event.delta;
+        });
+
+        std::move_backward(insertAt, last, last + 1);
+        *insertAt = note_off_event{delta, status, note};
+        ++noteOffCount_;
+    }
+
+    void pop_note_off()
+    {
+        const note_off_event event = noteOffs_[0];
+        append_scaled_delta(event.delta);
+        append_note_off(event);
+
+        for (std::size_t i = 1; i < noteOffCount_; ++i)
+        {
+            noteOffs_[i].delta -= event.delta;
+        }
+
+        std::move(noteOffs_.begin() + 1, noteOffs_.begin() + static_cast<std::ptrdiff_t>(noteOffCount_),
+                  noteOffs_.begin());
+        --noteOffCount_;
+    }
+
+    void begin_event()
+    {
+        if (expectDelta_)
+        {
+            append_scaled_delta(0);
+        }
+        expectDelta_ = true;
+    }
+
+    // MT32.INC plays a built-in preset for a Program Change in bank 0 and a
+    // custom timbre in any other bank, so only bank 0 programs are mapped.
+    // The MT-32 rhythm part ignores Program Change; GM gets the standard kit.
+    void append_gm_channel(const std::uint8_t* event, std::size_t size)
+    {
+        const std::uint8_t channel = event[0] & 0x0F;
+        switch (event[0] & 0xF0)
+        {
+        case 0xC0:
+            midi_.push_back(event[0]);
+            midi_.push_back(channel == RhythmChannel ? 0
+                            : banks_[channel] == 0   ? Mt32ToGmProgram[event[1] & 0x7F]
+                                                     : event[1]);
+            return;
+        case 0xB0:
+            if (event[1] == PatchBankController)
+            {
+                banks_[channel] = event[2];
+            }
+            break;
+        default:
+            break;
+        }
+        midi_.insert(midi_.end(), event, event + size);
+    }
+
+    Bytes midi_;
+    NoteOffs noteOffs_{};
+    std::size_t noteOffCount_ = 0;
+    std::uint32_t quarterNoteMicros_ = DefaultQuarterNoteMicros;
+    bool expectDelta_ = true;
+    std::uint32_t carry_ = 0;
+    std::uint32_t lastDelta_ = 0;
+    std::size_t lastDeltaStart_ = 0;
+    patch_map patchMap_ = patch_map::none;
+    std::array<std::uint8_t, 16> banks_{};
+    std::uint64_t tickScale_ = DefaultTickScale;
+    std::optional<error_code> failure_;
+};
+
+#if !defined(XMI2MID_FREESTANDING)
+using smf_render = basic_smf_render<std::vector<std::uint8_t>>;
+#endif
+
+// Parses an EVNT stream once and forwards each event to the sink. The sink's
+// at() is called at every event boundary, and its end_of_track() returns
+// whether decoding continues. A sink with failure() stops decoding when that
+// returns an error_code, which is reported at the event it was given.
+template <typename Sink>
+result<void> try_decode_events(std::span<const std::uint8_t> xmi, const std::uint8_t* cursor,
+                               const std::uint8_t* const eventEnd, Sink& sink)
+{
+    const std::uint8_t* event = cursor;
+    const auto sink_failure = [&]() -> result<void>
+    {
+        if constexpr (requires { sink.failure(); })
+        {
+            if (const std::optional<error_code> code = sink.failure())
+            {
+                return failure_at(*code, xmi, event);
+            }
+        }
+        return {};
+    };
+
+    while (cursor < eventEnd)
+    {
+        if (result<void> failed = sink_failure(); !failed)
+        {
+            return failed;
+        }
+
+        event = cursor;
+        sink.at(cursor);
+        if (*cursor < 0x80)
+        {
+            std::uint32_t delay = 0;
+            while (cursor != eventEnd && *cursor == 0x7F)
+            {
+                delay += *cursor++;
+            }
+            if (cursor == eventEnd)
+            {
+                return failure_at(error_code::truncated_event, xmi, event);
+            }
+            sink.delay(delay + *cursor++);
+            continue;
+        }
+
+        const std::uint8_t status = *cursor;
+        if (status == 0xFF)
+        {
+            if (!has_bytes(cursor, eventEnd, 2))
+            {
+                return failure_at(error_code::truncated_event, xmi, event);
+            }
+            const std::uint8_t metaType = cursor[1];
+            cursor += 2;
+            const std::expected<std::uint32_t, error_code> metaLength = parse_xmi_varlen(cursor, eventEnd);
+            if (!metaLength)
+            {
+                return failure_at(metaLength.error(), xmi, event);
+            }
+            if (!has_bytes(cursor, eventEnd, *metaLength))
+            {
+                return failure_at(error_code::truncated_event, xmi, event);
+            }
+
+            const std::uint8_t* const payload = cursor;
+            cursor += *metaLength;
+            if (metaType == 0x2F)
+            {
+                if (!sink.end_of_track())
+                {
+                    return sink_failure();
+                }
+                continue;
+            }
+            sink.meta(event, cursor, metaType, payload, *metaLength);
+        }
         else if (status == 0xF0 || status == 0xF7)
         {
-            begin_event();
-            midi.push_back(*cursor++);
-            const std::uint8_t* const lengthStart = cursor;
-            const std::uint32_t sysexLength = read_varlen(cursor, eventEnd);
-            midi.insert(midi.end(), lengthStart, cursor);
-            append_bytes(midi, cursor, eventEnd, sysexLength);
+            ++cursor;
+            const std::expected<std::uint32_t, error_code> sysexLength = parse_xmi_varlen(cursor, eventEnd);
+            if (!sysexLength)
+            {
+                return failure_at(sysexLength.error(), xmi, event);
+            }
+            if (!has_bytes(cursor, eventEnd, *sysexLength))
+            {
+                return failure_at(error_code::truncated_event, xmi, event);
+            }
+            cursor += *sysexLength;
+            sink.sysex(event, cursor);
+        }
+        else
+        {
+            const std::size_t eventSize = channel_event_size(status);
+            if (eventSize == 0)
+            {
+                ++cursor;
+                sink.skip();
+                continue;
+            }
+
+            if (!has_bytes(cursor, eventEnd, eventSize))
+            {
+                return failure_at(error_code::truncated_event, xmi, event);
+            }
+            cursor += eventSize;
+            if constexpr (requires { sink.ail_controller(event, cursor); })
+            {
+                if ((status & 0xF0) == 0xB0 && event[1] >= FirstSequenceController &&
+                    event[1] <= LastSequenceController)
+                {
+                    cursor = sink.ail_controller(event, cursor);
+                    continue;
+                }
+            }
+
+            if ((status & 0xF0) == 0x90)
+            {
+                const std::expected<std::uint32_t, error_code> duration = parse_xmi_varlen(cursor, eventEnd);
+                if (!duration)
+                {
+                    return failure_at(duration.error(), xmi, event);
+                }
+                sink.note_on(event, *duration);
+            }
+            else
+            {
+                sink.channel(event, eventSize);
+            }
+        }
+    }
+    return sink_failure();
+}
+
+#if !defined(XMI2MID_FREESTANDING)
+template <typename Sink>
+void decode_events(std::span<const std::uint8_t> xmi, const std::uint8_t* cursor, const std::uint8_t* const eventEnd,
+                   Sink& sink)
+{
+    value_or_fail(try_decode_events(xmi, cursor, eventEnd, sink));
+}
+#endif
+
+// Sink for a single render that stops at End of Track.
+template <typename Bytes, typename NoteOffs = std::array<note_off_event, MaxNoteOffs>>
+struct basic_single_render_sink : basic_smf_render<Bytes, NoteOffs>
+{
+    using basic_smf_render<Bytes, NoteOffs>::basic_smf_render;
+
+    void at(const std::uint8_t*) const
+    {
+    }
+
+    bool end_of_track()
+    {
+        basic_smf_render<Bytes, NoteOffs>::end_of_track();
+        return false;
+    }
+};
+
+// Output for try_convert_to(): keeps what fits in a caller buffer and counts
+// the rest, so the caller learns the size it needs.
+class fixed_bytes
+{
+public:
+    explicit fixed_bytes(std::span<std::uint8_t> buffer) : buffer_(buffer)
+    {
+    }
+
+    void reserve(std::size_t) const
+    {
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    std::size_t end() const
+    {
+        return size_;
+    }
+
+    // Only shrinks; the renderer never grows its output this way.
+    void resize(std::size_t size)
+    {
+        size_ = size;
+    }
+
+    std::uint8_t& operator[](std::size_t index)
+    {
+        return index < buffer_.size() ? buffer_[index] : overflow_;
+    }
+
+    void push_back(std::uint8_t byte)
+    {
+        (*this)[size_++] = byte;
+    }
+
+    void insert(std::size_t at, const std::uint8_t* first, const std::uint8_t* last)
+    {
+        const std::size_t count = static_cast<std::size_t>(last - first);
+        if (at < buffer_.size())
+        {
+            std::copy_n(first, std::min(count, buffer_.size() - at), buffer_.data() + at);
+        }
+        size_ = at + count;
+    }
+
+private:
+    std::span<std::uint8_t> buffer_;
+    std::size_t size_ = 0;
+    std::uint8_t overflow_ = 0;
+};
+
+#if !defined(XMI2MID_FREESTANDING)
+using single_render_sink = basic_single_render_sink<std::vector<std::uint8_t>>;
+
+// Sink that starts one render at each branch offset and feeds every started,
+// unfinished render from the same pass over the EVNT stream.
+class branch_render_sink
+{
+public:
+    struct start_point
+    {
+        const std::uint8_t* position = nullptr;
+        std::size_t render = 0;
+    };
+
+    branch_render_sink(std::vector<smf_render>& renders, std::vector<start_point> starts)
+        : renders_(renders), starts_(std::move(starts))
+    {
+        std::stable_sort(starts_.begin(), starts_.end(), [](const start_point& left, const start_point& right)
+        {
+            return left.position < right.position;
+        });
+        active_.reserve(starts_.size());
+    }
+
+    void at(const std::uint8_t* cursor)
+    {
+        while (nextStart_ < starts_.size() && starts_[nextStart_].position <= cursor)
+        {
+            if (starts_[nextStart_].position != cursor)
+            {
+                detail::fail("Invalid XMI: RBRN offset is not at an event boundary");
+            }
+            active_.push_back(starts_[nextStart_++].render);
+        }
+    }
+
+    void delay(std::uint32_t delay)
+    {
+        for (const std::size_t render : active_)
+        {
+            renders_[render].delay(delay);
+        }
+    }
+
+    void meta(const std::uint8_t* event, const std::uint8_t* eventEnd, std::uint8_t type,
+              const std::uint8_t* payload, std::uint32_t length)
+    {
+        for (const std::size_t render : active_)
+        {
+            renders_[render].meta(event, eventEnd, type, payload, length);
+        }
+    }
+
+    bool end_of_track()
+    {
+        for (const std::size_t render : active_)
+        {
+            renders_[render].end_of_track();
+        }
+        active_.clear();
+        return nextStart_ < starts_.size();
+    }
+
+    void sysex(const std::uint8_t* event, const std::uint8_t* eventEnd)
+    {
+        for (const std::size_t render : active_)
+        {
+            renders_[render].sysex(event, eventEnd);
+        }
+    }
+
+    void channel(const std::uint8_t* event, std::size_t size)
+    {
+        for (const std::size_t render : active_)
+        {
+            renders_[render].channel(event, size);
+        }
+    }
+
+    void note_on(const std::uint8_t* event, std::uint32_t duration)
+    {
+        for (const std::size_t render : active_)
+        {
+            renders_[render].note_on(event, duration);
+        }
+    }
+
+    void skip()
+    {
+        for (const std::size_t render : active_)
+        {
+            renders_[render].skip();
+        }
+    }
+
+private:
+    std::vector<smf_render>& renders_;
+    std::vector<start_point> starts_;
+    std::vector<std::size_t> active_;
+    std::size_t nextStart_ = 0;
+};
+#endif
+}
+
+using note_off_event = detail::note_off_event;
+inline constexpr std::size_t MaxNoteOffs = detail::MaxNoteOffs;
+
+// What try_convert_to() wrote: the size of the whole MIDI file, and how many
+// more bytes the buffer needed to hold it, 0 when the file is complete.
+struct fixed_conversion
+{
+    std::size_t size = 0;
+    std::size_t missing = 0;
+};
+
+// convert() without the heap: the MIDI goes into `midi` and pending Note Offs
+// into `noteOffs`. When `missing` is not 0 the buffer holds only a prefix;
+// call again with `size` bytes. A pool too small for the notes sounding at
+// once gives error_code::too_many_note_offs; MaxNoteOffs always suffices for
+// files convert() accepts.
+inline result<fixed_conversion> try_convert_to(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                               std::span<std::uint8_t> midi, std::span<note_off_event> noteOffs,
+                                               const convert_options& options = {})
+{
+    const result<sequence_info> sequence = detail::try_find_sequence(xmi, sequenceIndex);
+    if (!sequence)
+    {
+        return std::unexpected(sequence.error());
+    }
+    const std::uint8_t* const eventStart = xmi.data() + sequence->event_offset;
+
+    detail::basic_single_render_sink<detail::fixed_bytes, std::span<note_off_event>> render(
+        0, detail::fixed_bytes(midi), noteOffs);
+    render.set_patch_map(options.patches);
+    if (result<void> decoded = detail::try_decode_events(xmi, eventStart, eventStart + sequence->event_size, render);
+        !decoded)
+    {
+        return std::unexpected(decoded.error());
+    }
+
+    const std::expected<detail::fixed_bytes, error_code> track = render.try_take();
+    if (!track)
+    {
+        return std::unexpected(error{track.error(), sequence->event_offset});
+    }
+    const std::size_t size = track->size();
+    return fixed_conversion{size, size > midi.size() ? size - midi.size() : 0};
+}
+
+#if !defined(XMI2MID_FREESTANDING)
+
+// convert() writing into `midi`, which is returned. Bytes can be any
+// container with std::vector's reserve(), resize(), size(), data(),
+// operator[], push_back(), and insert() at end(), such as a growable file
+// mapping, so the MIDI never needs a second buffer.
+template <typename Bytes>
+result<Bytes> try_convert_into(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex, Bytes midi,
+                               const convert_options& options = {})
+{
+    const result<sequence_info> sequence = detail::try_find_sequence(xmi, sequenceIndex);
+    if (!sequence)
+    {
+        return std::unexpected(sequence.error());
+    }
+    const std::uint8_t* const eventStart = xmi.data() + sequence->event_offset;
+
+    detail::basic_single_render_sink<Bytes> render(sequence->event_size * 2, std::move(midi));
+    render.set_patch_map(options.patches);
+    if (result<void> decoded = detail::try_decode_events(xmi, eventStart, eventStart + sequence->event_size, render);
+        !decoded)
+    {
+        return std::unexpected(decoded.error());
+    }
+
+    std::expected<Bytes, error_code> track = render.try_take();
+    if (!track)
+    {
+        return std::unexpected(error{track.error(), sequence->event_offset});
+    }
+    return std::move(*track);
+}
+
+template <typename Bytes>
+Bytes convert_into(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex, Bytes midi,
+                   const convert_options& options = {})
+{
+    result<Bytes> converted = try_convert_into(xmi, sequenceIndex, std::move(midi), options);
+    if (!converted)
+    {
+        detail::fail_sequence(xmi, sequenceIndex, converted.error());
+    }
+    return std::move(*converted);
+}
+
+// Reports failures as values: no exception is thrown and no message is built,
+// which suits sweeps over corpora with many damaged files and builds without
+// exceptions.
+inline result<std::vector<std::uint8_t>> try_convert(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                                     const convert_options& options = {})
+{
+    return try_convert_into(xmi, sequenceIndex, std::vector<std::uint8_t>{}, options);
+}
+
+inline std::vector<std::uint8_t> convert(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                         const convert_options& options = {})
+{
+    return convert_into(xmi, sequenceIndex, std::vector<std::uint8_t>{}, options);
+}
+
+// Event transforms for convert() and convert_unrolled(). Each one edits a
+// channel event in place and returns false to leave it out of the output.
+
+// Moves notes by a number of semitones, except on the rhythm channel (10).
+// Notes moved outside 0 to 127 are left out.
+struct transpose
+{
+    int semitones = 0;
+
+    bool channel(std::uint8_t* event) const
+    {
+        if ((event[0] & 0x0F) == detail::RhythmChannel || (event[0] & 0xF0) > 0xA0)
+        {
+            return true;
+        }
+        const int note = (event[1] & 0x7F) + semitones;
+        if (note < 0 || note > 0x7F)
+        {
+            return false;
+        }
+        event[1] = static_cast<std::uint8_t>(note);
+        return true;
+    }
+};
+
+// Moves each channel's events to channels[channel].
+struct channel_map
+{
+    std::array<std::uint8_t, 16> channels = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+    bool channel(std::uint8_t* event) const
+    {
+        event[0] = static_cast<std::uint8_t>((event[0] & 0xF0) | (channels[event[0] & 0x0F] & 0x0F));
+        return true;
+    }
+};
+
+// Replaces Note On velocities on the channels whose bit is set. A velocity of
+// 0 is a Note Off and is kept; the curve cannot turn a note into one.
+struct velocity_curve
+{
+    std::array<std::uint8_t, 128> velocities = detail::identity_bytes();
+    std::uint16_t channels = 0xFFFF;
+
+    bool channel(std::uint8_t* event) const
+    {
+        if ((event[0] & 0xF0) == 0x90 && event[2] != 0 && ((channels >> (event[0] & 0x0F)) & 1) != 0)
+        {
+            event[2] = std::max<std::uint8_t>(velocities[event[2] & 0x7F] & 0x7F, 1);
+        }
+        return true;
+    }
+};
+
+// Plays the sequence `factor` times as fast, from 0.25 to 64, by scaling
+// deltas.
+struct tempo_scale
+{
+    double factor = 1.0;
+
+    double speed() const
+    {
+        return factor;
+    }
+
+    bool channel(std::uint8_t*) const
+    {
+        return true;
+    }
+};
+
+// Keeps only the channels and event types whose bits are set.
+struct event_filter
+{
+    static constexpr std::uint8_t NoteOff = 1 << 0;
+    static constexpr std::uint8_t NoteOn = 1 << 1;
+    static constexpr std::uint8_t KeyPressure = 1 << 2;
+    static constexpr std::uint8_t ControlChange = 1 << 3;
+    static constexpr std::uint8_t ProgramChange = 1 << 4;
+    static constexpr std::uint8_t ChannelPressure = 1 << 5;
+    static constexpr std::uint8_t PitchBend = 1 << 6;
+    static constexpr std::uint8_t SystemExclusive = 1 << 7;
+
+    std::uint16_t channels = 0xFFFF;
+    std::uint8_t events = 0xFF;
+
+    bool channel(const std::uint8_t* event) const
+    {
+        return ((channels >> (event[0] & 0x0F)) & 1) != 0 && ((events >> ((event[0] >> 4) - 8)) & 1) != 0;
+    }
+
+    bool sysex() const
+    {
+        return (events & SystemExclusive) != 0;
+    }
+};
+
+// Transforms run in the order given, so a transpose after a channel_map skips
+// the remapped rhythm channel. The chain is a type, so each combination is
+// compiled into the decode loop.
+template <typename... Transforms>
+struct transform_chain
+{
+    explicit transform_chain(Transforms... transforms) : steps(std::move(transforms)...)
+    {
+    }
+
+    std::tuple<Transforms...> steps;
+};
+
+namespace detail
+{
+// Render sink that passes each event through a transform chain before the
+// render writes it. Events a transform leaves out are dropped with their delta
+// carried into the next event.
+template <typename Sink, typename... Transforms>
+class transform_sink : public Sink
+{
+public:
+    template <typename... Args>
+    explicit transform_sink(const std::tuple<Transforms...>& steps, Args... args) : Sink(args...), steps_(steps)
+    {
+        double speed = 1.0;
+        std::apply([&speed](const auto&... step)
+        {
+            ((speed *= step_speed(step)), ...);
+        }, steps_);
+        if (speed != 1.0)
+        {
+            this->set_speed(speed);
+        }
+    }
+
+    void channel(const std::uint8_t* event, std::size_t size)
+    {
+        std::uint8_t edited[3] = {event[0], event[1], size > 2 ? event[2] : std::uint8_t{0}};
+        if (edit(edited))
+        {
+            Sink::channel(edited, size);
+            return;
+        }
+        this->drop();
+    }
+
+    void note_on(const std::uint8_t* event, std::uint32_t duration)
+    {
+        std::uint8_t edited[3] = {event[0], event[1], event[2]};
+        if (edit(edited))
+        {
+            Sink::note_on(edited, duration);
+            return;
+        }
+        this->drop();
+    }
+
+    void sysex(const std::uint8_t* event, const std::uint8_t* eventEnd)
+    {
+        const bool keep = std::apply([](const auto&... step)
+        {
+            return (keep_sysex(step) && ...);
+        }, steps_);
+        if (keep)
+        {
+            Sink::sysex(event, eventEnd);
+            return;
+        }
+        this->drop();
+    }
+
+    // For and Next steer the loop sink and never reach the output, so they
+    // are not filtered; the other AIL controllers are written like any
+    // Control Change.
+    const std::uint8_t* ail_controller(const std::uint8_t* event, const std::uint8_t* next)
+        requires requires(Sink& sink) { sink.ail_controller(event, next); }
+    {
+        std::uint8_t edited[3] = {event[0], event[1], event[2]};
+        if (edit(edited))
+        {
+            return Sink::ail_controller(edited, next);
+        }
+        if (event[1] == ForController || event[1] == NextController)
+        {
+            return Sink::ail_controller(event, next);
+        }
+        this->drop();
+        return next;
+    }
+
+private:
+    template <typename Step>
+    static double step_speed(const Step& step)
+    {
+        if constexpr (requires { step.speed(); })
+        {
+            return step.speed();
+        }
+        return 1.0;
+    }
+
+    template <typename Step>
+    static bool keep_sysex(const Step& step)
+    {
+        if constexpr (requires { step.sysex(); })
+        {
+            return step.sysex();
+        }
+        return true;
+    }
+
+    bool edit(std::uint8_t* event) const
+    {
+        return std::apply([event](const auto&... step)
+        {
+            return (step.channel(event) && ...);
+        }, steps_);
+    }
+
+    const std::tuple<Transforms...>& steps_;
+};
+}
+
+// Converts one sequence with each event passed through `transforms` as it is
+// written. Converting without a chain does not run this code at all.
+template <typename... Transforms>
+std::vector<std::uint8_t> convert(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                  const transform_chain<Transforms...>& transforms, const convert_options& options = {})
+{
+    if (xmi.empty())
+    {
+        detail::fail("Invalid XMI: empty file");
+    }
+
+    const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+    const std::uint8_t* const eventStart = xmi.data() + sequence.event_offset;
+
+    detail::transform_sink<detail::single_render_sink, Transforms...> render(transforms.steps, sequence.event_size * 2);
+    render.set_patch_map(options.patches);
+    detail::decode_events(xmi, eventStart, eventStart + sequence.event_size, render);
+    return render.take();
+}
+
+namespace detail
+{
+// Returns the end of the EVNT event at `cursor`, or `end` when it is
+// truncated. A run of delay bytes is one event, as try_decode_events() reads it.
+inline const std::uint8_t* skip_event(const std::uint8_t* cursor, const std::uint8_t* end)
+{
+    auto skip_payload = [end](const std::uint8_t* payload)
+    {
+        const std::expected<std::uint32_t, error_code> length = parse_xmi_varlen(payload, end);
+        return length && has_bytes(payload, end, *length) ? payload + *length : end;
+    };
+
+    const std::uint8_t status = *cursor;
+    if (status < 0x80)
+    {
+        while (cursor != end && *cursor == 0x7F)
+        {
+            ++cursor;
+        }
+        return cursor == end ? end : cursor + 1;
+    }
+    if (status == 0xFF)
+    {
+        return has_bytes(cursor, end, 2) ? skip_payload(cursor + 2) : end;
+    }
+    if (status == 0xF0 || status == 0xF7)
+    {
+        return skip_payload(cursor + 1);
+    }
+
+    const std::size_t size = channel_event_size(status);
+    if (size == 0)
+    {
+        return cursor + 1;
+    }
+    if (!has_bytes(cursor, end, size))
+    {
+        return end;
+    }
+    cursor += size;
+    if ((status & 0xF0) == 0x90 && !parse_xmi_varlen(cursor, end))
+    {
+        return end;
+    }
+    return cursor;
+}
+
+// Throws unless every branch starts an EVNT event. Event sizes are walked
+// from the start of EVNT, since a jump into the middle of an event would
+// decode its data bytes as events.
+inline void check_branch_boundaries(const sequence_info& sequence, const std::uint8_t* eventStart,
+                                    std::span<const branch_point> branches)
+{
+    std::vector<std::uint32_t> offsets;
+    offsets.reserve(branches.size());
+    for (const branch_point& branch : branches)
+    {
+        offsets.push_back(branch.offset);
+    }
+    std::sort(offsets.begin(), offsets.end());
+
+    const std::uint8_t* const eventEnd = eventStart + sequence.event_size;
+    const std::uint8_t* cursor = eventStart;
+    for (const std::uint32_t offset : offsets)
+    {
+        const std::uint8_t* const target = eventStart + offset;
+        while (cursor < target)
+        {
+            cursor = skip_event(cursor, eventEnd);
+        }
+        if (cursor != target)
+        {
+            fail("Invalid XMI: RBRN offset is not at an event boundary");
+        }
+    }
+}
+
+// Throws unless `branch` points at its own Controller 120 event, or at the
+// delay before it, as MIDIFORM logs the offset before writing the interval.
+// Only bytes from the offset on are read.
+inline void check_branch_target(const sequence_info& sequence, const std::uint8_t* eventStart,
+                                const branch_point& branch)
+{
+    const std::uint8_t* const eventEnd = eventStart + sequence.event_size;
+    const std::uint8_t* cursor = eventStart + branch.offset;
+    while (cursor != eventEnd && *cursor < 0x80)
+    {
+        ++cursor;
+    }
+    if (!has_bytes(cursor, eventEnd, 3) || (cursor[0] & 0xF0) != 0xB0 || cursor[1] != BranchController ||
+        cursor[2] != branch.marker)
+    {
+        fail("Invalid XMI: RBRN offset does not point at its branch controller");
+    }
+}
+}
+
+// Renders a sequence from one RBRN entry, as AIL_branch_index() would jump
+// there: decoding starts at the recorded EVNT offset with default tempo and no
+// pending notes. Events before the branch are never read; the offset must
+// point at the branch's own Controller 120 event.
+inline std::vector<std::uint8_t> convert_from_branch(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                                     std::uint16_t marker)
+{
+    const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+    const std::vector<branch_point> branches = branch_points(xmi, sequence);
+    const auto branch = std::find_if(branches.begin(), branches.end(),
+                                     [marker](const branch_point& point) { return point.marker == marker; });
+    if (branch == branches.end())
+    {
+        detail::fail("Invalid XMI: sequence " + std::to_string(sequenceIndex) +
+                                 " has no branch marker " + std::to_string(marker));
+    }
+
+    const std::uint8_t* const eventStart = xmi.data() + sequence.event_offset;
+    detail::check_branch_target(sequence, eventStart, *branch);
+    const std::size_t remaining = sequence.event_size - branch->offset;
+    detail::single_render_sink render(remaining * 2);
+    detail::decode_events(xmi, eventStart + branch->offset, eventStart + sequence.event_size, render);
+    return render.take();
+}
+
+struct branch_render
+{
+    std::uint16_t marker = 0;
+    std::vector<std::uint8_t> midi;
+};
+
+// Renders every RBRN entry of a sequence, in table order, with the same
+// result as convert_from_branch() for each marker. The EVNT stream is parsed
+// once from the earliest branch; each render joins at its own offset.
+inline std::vector<branch_render> convert_branches(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+    const std::vector<branch_point> branches = branch_points(xmi, sequence);
+    const std::uint8_t* const eventStart = xmi.data() + sequence.event_offset;
+    const std::uint8_t* const eventEnd = eventStart + sequence.event_size;
+    detail::check_branch_boundaries(sequence, eventStart, branches);
+    for (const branch_point& branch : branches)
+    {
+        detail::check_branch_target(sequence, eventStart, branch);
+    }
+
+    std::vector<detail::smf_render> renders;
+    std::vector<detail::branch_render_sink::start_point> starts;
+    renders.reserve(branches.size());
+    starts.reserve(branches.size());
+    for (const branch_point& branch : branches)
+    {
+        starts.push_back({eventStart + branch.offset, renders.size()});
+        renders.emplace_back((sequence.event_size - branch.offset) * 2);
+    }
+
+    if (!starts.empty())
+    {
+        detail::branch_render_sink sink(renders, std::move(starts));
+        const std::uint8_t* const first =
+            eventStart + std::min_element(branches.begin(), branches.end(),
+                                          [](const branch_point& left, const branch_point& right)
+                                          {
+                                              return left.offset < right.offset;
+                                          })->offset;
+        detail::decode_events(xmi, first, eventEnd, sink);
+    }
+
+    std::vector<branch_render> results;
+    results.reserve(renders.size());
+    for (std::size_t i = 0; i < renders.size(); ++i)
+    {
+        results.push_back({branches[i].marker, renders[i].take()});
+    }
+    return results;
+}
+
+// Whether a Break (117 below 64) ends the innermost loop, as XMIDI.TXT
+// describes. XMIDI.ASM ignores it, so neither loop_options nor
+// sequencer_options does by default.
+inline constexpr bool BreakEndsLoopByDefault = false;
+
+struct loop_options
+{
+    // Total plays of a loop whose For value is 0 (loop forever).
+    std::uint32_t infinite_loop_plays = 2;
+    bool break_ends_loop = BreakEndsLoopByDefault;
+};
+
+namespace detail
+{
+// Sink that unrolls AIL For/Next loops the way XMIDI.ASM runs them: up to four
+// nested loops, a For (116) takes the first free slot and resumes after itself,
+// and a Next (117, value >= 64) repeats the innermost loop. A Break (value < 64)
+// is ignored unless `breakEndsLoop` is set, which ends the innermost loop. The
+// controllers themselves are left out of the output.
+//
+// Note Offs stay queued across a jump, as in AIL. When an iteration ends in the
+// same render and loop state it started in, the remaining iterations would
+// write the same bytes, so they are copied instead of decoded again.
+template <typename Bytes>
+class basic_loop_render_sink : public basic_smf_render<Bytes>
+{
+public:
+    static constexpr std::size_t MaxLoopNesting = 4;
+
+    basic_loop_render_sink(std::size_t reserveBytes, std::uint32_t infinitePlays, bool breakEndsLoop,
+                           Bytes midi = Bytes{})
+        : basic_smf_render<Bytes>(reserveBytes, std::move(midi)),
+          infinitePlays_(std::max<std::uint32_t>(infinitePlays, 1)), breakEndsLoop_(breakEndsLoop)
+    {
+    }
+
+    void at(const std::uint8_t*) const
+    {
+    }
+
+    bool end_of_track()
+    {
+        basic_smf_render<Bytes>::end_of_track();
+        return false;
+    }
+
+    // Returns where decoding continues after a controller from 116 to 120.
+    const std::uint8_t* ail_controller(const std::uint8_t* event, const std::uint8_t* next)
+    {
+        if (event[1] != ForController && event[1] != NextController)
+        {
+            this->channel(event, 3);
+            return next;
+        }
+
+        this->drop();
+        const std::uint8_t value = event[2];
+
+        if (event[1] == ForController)
+        {
+            for (loop_slot& loop : loops_)
+            {
+                if (!loop.position.active)
+                {
+                    loop.position = {true, value, 1, next};
+                    start_iteration(loop);
+                    break;
+                }
+            }
+            return next;
+        }
+
+        const auto innermost = std::find_if(loops_.rbegin(), loops_.rend(), [](const loop_slot& loop)
+        {
+            return loop.position.active;
+        });
+        if (innermost == loops_.rend())
+        {
+            return next;
+        }
+
+        loop_slot& loop = *innermost;
+        if (value < BreakThreshold)
+        {
+            if (breakEndsLoop_)
+            {
+                loop.position.active = false;
+            }
+            return next;
+        }
+
+        std::uint32_t remainingPlays = 0;
+        if (loop.position.count == 0)
+        {
+            remainingPlays = infinitePlays_ - loop.position.played;
+        }
+        else
+        {
+            remainingPlays = --loop.position.count;
+        }
+
+        if (remainingPlays == 0)
+        {
+            loop.position.active = false;
+            return next;
+        }
+
+        if (this->same_state(loop.iteration) && other_loops_unchanged(loop))
+        {
+            this->repeat_output(loop.iteration.output_size, remainingPlays);
+            loop.position.active = false;
+            return next;
+        }
+
+        ++loop.position.played;
+        start_iteration(loop);
+        return loop.position.body;
+    }
+
+private:
+    using state = typename basic_smf_render<Bytes>::state;
+
+    struct loop_position
+    {
+        bool active = false;
+        std::uint32_t count = 0;
+        std::uint32_t played = 0;
+        const std::uint8_t* body = nullptr;
+
+        friend bool operator==(const loop_position&, const loop_position&) = default;
+    };
+
+    struct loop_slot
+    {
+        loop_position position;
+        state iteration;
+        std::array<loop_position, MaxLoopNesting> others{};
+    };
+
+    void start_iteration(loop_slot& loop)
+    {
+        this->save_state(loop.iteration);
+        for (std::size_t i = 0; i < MaxLoopNesting; ++i)
+        {
+            loop.others[i] = &loops_[i] == &loop ? loop_position{} : loops_[i].position;
+        }
+    }
+
+    bool other_loops_unchanged(const loop_slot& loop) const
+    {
+        for (std::size_t i = 0; i < MaxLoopNesting; ++i)
+        {
+            if (&loops_[i] != &loop && loops_[i].position != loop.others[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::array<loop_slot, MaxLoopNesting> loops_{};
+    std::uint32_t infinitePlays_ = 1;
+    bool breakEndsLoop_ = BreakEndsLoopByDefault;
+};
+
+using loop_render_sink = basic_loop_render_sink<std::vector<std::uint8_t>>;
+}
+
+// convert_unrolled() writing into `midi`, as convert_into() does.
+template <typename Bytes>
+Bytes convert_unrolled_into(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex, Bytes midi,
+                            const loop_options& options = {}, const convert_options& conversion = {})
+{
+    const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+    const std::uint8_t* const eventStart = xmi.data() + sequence.event_offset;
+
+    detail::basic_loop_render_sink<Bytes> render(sequence.event_size * 2, options.infinite_loop_plays,
+                                                 options.break_ends_loop, std::move(midi));
+    render.set_patch_map(conversion.patches);
+    detail::decode_events(xmi, eventStart, eventStart + sequence.event_size, render);
+    return render.take();
+}
+
+// Converts one sequence with For/Next loops unrolled into linear MIDI, for
+// players that ignore controllers 116 and 117.
+inline std::vector<std::uint8_t> convert_unrolled(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                                  const loop_options& options = {},
+                                                  const convert_options& conversion = {})
+{
+    return convert_unrolled_into(xmi, sequenceIndex, std::vector<std::uint8_t>{}, options, conversion);
+}
+
+// convert_unrolled() with each written event passed through `transforms`.
+template <typename... Transforms>
+std::vector<std::uint8_t> convert_unrolled(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                           const transform_chain<Transforms...>& transforms,
+                                           const loop_options& options = {}, const convert_options& conversion = {})
+{
+    const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+    const std::uint8_t* const eventStart = xmi.data() + sequence.event_offset;
+
+    detail::transform_sink<detail::loop_render_sink, Transforms...> render(transforms.steps, sequence.event_size * 2,
+                                                                           options.infinite_loop_plays,
+                                                                           options.break_ends_loop);
+    render.set_patch_map(conversion.patches);
+    detail::decode_events(xmi, eventStart, eventStart + sequence.event_size, render);
+    return render.take();
+}
+
+enum class marker_kind : std::uint8_t
+{
+    loop_start,
+    loop_end,
+    loop_break,
+    clear_beat_bar,
+    callback,
+    branch
+};
+
+// One AIL controller turned into a meta event. offset is the position of the
+// event's delta, counted from the first byte after the MTrk chunk header.
+struct midi_marker
+{
+    std::uint32_t offset = 0;
+    marker_kind kind = marker_kind::loop_start;
+    std::uint8_t channel = 0;
+    std::uint8_t value = 0;
+};
+
+struct marked_midi
+{
+    std::vector<std::uint8_t> midi;
+    std::vector<midi_marker> markers;
+};
+
+// Meta event text for a marker: loopStart:N, loopEnd, loopBreak, clearBeatBar,
+// callback:N, or branch:N.
+inline std::string marker_text(marker_kind kind, std::uint8_t value)
+{
+    switch (kind)
+    {
+    case marker_kind::loop_start:
+        return "loopStart:" + std::to_string(value);
+    case marker_kind::loop_end:
+        return "loopEnd";
+    case marker_kind::loop_break:
+        return "loopBreak";
+    case marker_kind::clear_beat_bar:
+        return "clearBeatBar";
+    case marker_kind::callback:
+        return "callback:" + std::to_string(value);
+    case marker_kind::branch:
+        return "branch:" + std::to_string(value);
+    }
+    return {};
+}
+
+namespace detail
+{
+// Sink that writes controllers 116 to 120 as Marker meta events, or a Cue Point
+// for callbacks, and records where each one landed.
+class marker_render_sink : public smf_render
+{
+public:
+    static constexpr std::uint8_t MarkerMeta = 0x06;
+    static constexpr std::uint8_t CuePointMeta = 0x07;
+
+    using smf_render::smf_render;
+
+    void at(const std::uint8_t*) const
+    {
+    }
+
+    bool end_of_track()
+    {
+        smf_render::end_of_track();
+        return false;
+    }
+
+    const std::uint8_t* ail_controller(const std::uint8_t* event, const std::uint8_t* next)
+    {
+        midi_marker marker{};
+        marker.channel = static_cast<std::uint8_t>(event[0] & 0x0F);
+        marker.value = event[2];
+        switch (event[1])
+        {
+        case ForController:
+            marker.kind = marker_kind::loop_start;
+            break;
+        case NextController:
+            marker.kind = marker.value < BreakThreshold ? marker_kind::loop_break : marker_kind::loop_end;
+            break;
+        case ClearBeatBarController:
+            marker.kind = marker_kind::clear_beat_bar;
+            break;
+        case CallbackController:
+            marker.kind = marker_kind::callback;
+            break;
+        default:
+            marker.kind = marker_kind::branch;
+            break;
+        }
+
+        const std::uint8_t type = marker.kind == marker_kind::callback ? CuePointMeta : MarkerMeta;
+        const std::size_t offset = replace_with_text(type, marker_text(marker.kind, marker.value));
+        if (offset > std::numeric_limits<std::uint32_t>::max())
+        {
+            detail::fail("MIDI track is too large");
+        }
+        marker.offset = static_cast<std::uint32_t>(offset);
+        markers.push_back(marker);
+        return next;
+    }
+
+    std::vector<midi_marker> markers;
+};
+}
+
+// Converts one sequence with AIL loop, beat/bar, callback, and branch
+// controllers written as meta events, plus a table of their MTrk offsets so a
+// player can jump to a loop start without scanning.
+inline marked_midi convert_with_markers(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+    const std::uint8_t* const eventStart = xmi.data() + sequence.event_offset;
+
+    detail::marker_render_sink render(sequence.event_size * 2);
+    detail::decode_events(xmi, eventStart, eventStart + sequence.event_size, render);
+    return {render.take(), std::move(render.markers)};
+}
+
+struct tempo_change
+{
+    std::uint64_t tick = 0; // 120 Hz ticks from the start
+    std::uint32_t quarter_note_micros = 0;
+};
+
+// Catalog facts about one sequence, gathered without writing MIDI. Times are
+// in 120 Hz ticks; the length is measured as sequence_duration() does.
+struct sequence_analysis
+{
+    static constexpr std::uint8_t FirstAilController = 110;
+    static constexpr std::uint8_t LastAilController = 120;
+
+    std::uint64_t ticks = 0;
+    double seconds = 0;
+    std::array<std::uint32_t, 16> notes{}; // Note Ons per channel
+    // Range of notes outside the rhythm channel (10); lowest > highest when
+    // there are none.
+    std::uint8_t lowest_note = 0x7F;
+    std::uint8_t highest_note = 0;
+    std::uint32_t peak_polyphony = 0;
+    std::array<bool, 128> programs{};
+    std::vector<tempo_change> tempo_changes;
+    std::uint64_t sysex_bytes = 0;
+    std::array<std::uint32_t, LastAilController - FirstAilController + 1> ail_controllers{};
+};
+
+namespace detail
+{
+// Sink that only follows time. A sequence ends at End of Track, where AIL and
+// convert() stop every note; a stream without one ends when its last note
+// does.
+class duration_sink
+{
+public:
+    void at(const std::uint8_t*) const
+    {
+    }
+
+    void delay(std::uint32_t delay)
+    {
+        tick_ += delay;
+    }
+
+    void meta(const std::uint8_t*, const std::uint8_t*, std::uint8_t, const std::uint8_t*, std::uint32_t) const
+    {
+    }
+
+    bool end_of_track()
+    {
+        ended_ = true;
+        return false;
+    }
+
+    void sysex(const std::uint8_t*, const std::uint8_t*) const
+    {
+    }
+
+    void channel(const std::uint8_t*, std::size_t) const
+    {
+    }
+
+    void note_on(const std::uint8_t*, std::uint32_t duration)
+    {
+        lastNoteEnd_ = std::max(lastNoteEnd_, tick_ + duration);
+    }
+
+    void skip() const
+    {
+    }
+
+    std::uint64_t tick() const
+    {
+        return tick_;
+    }
+
+    std::uint64_t ticks() const
+    {
+        return ended_ ? tick_ : std::max(tick_, lastNoteEnd_);
+    }
+
+private:
+    std::uint64_t tick_ = 0;
+    std::uint64_t lastNoteEnd_ = 0;
+    bool ended_ = false;
+};
+
+// Sink that only counts. Sounding notes are kept as a min-heap of end ticks
+// for the polyphony peak.
+class analysis_sink : public duration_sink
+{
+public:
+    explicit analysis_sink(sequence_analysis& analysis) : analysis_(analysis)
+    {
+    }
+
+    void meta(const std::uint8_t*, const std::uint8_t*, std::uint8_t type, const std::uint8_t* payload,
+              std::uint32_t length)
+    {
+        if (type == 0x51 && length == 3)
+        {
+            analysis_.tempo_changes.push_back({tick(), (static_cast<std::uint32_t>(payload[0]) << 16) |
+                                                          (static_cast<std::uint32_t>(payload[1]) << 8) |
+                                                          static_cast<std::uint32_t>(payload[2])});
+        }
+    }
+
+    void sysex(const std::uint8_t* event, const std::uint8_t* eventEnd)
+    {
+        const std::uint8_t* payload = event + 1;
+        analysis_.sysex_bytes += read_xmi_varlen(payload, eventEnd);
+    }
+
+    void channel(const std::uint8_t* event, std::size_t)
+    {
+        if ((event[0] & 0xF0) == 0xC0)
+        {
+            analysis_.programs[event[1] & 0x7F] = true;
+        }
+        else if ((event[0] & 0xF0) == 0xB0 && event[1] >= sequence_analysis::FirstAilController &&
+                 event[1] <= sequence_analysis::LastAilController)
+        {
+            ++analysis_.ail_controllers[event[1] - sequence_analysis::FirstAilController];
+        }
+    }
+
+    void note_on(const std::uint8_t* event, std::uint32_t duration)
+    {
+        if (event[2] == 0)
+        {
+            return;
+        }
+        duration_sink::note_on(event, duration);
+
+        const std::uint8_t channel = event[0] & 0x0F;
+        const std::uint8_t note = event[1] & 0x7F;
+        ++analysis_.notes[channel];
+        if (channel != RhythmChannel)
+        {
+            analysis_.lowest_note = std::min(analysis_.lowest_note, note);
+            analysis_.highest_note = std::max(analysis_.highest_note, note);
+        }
+
+        while (!sounding_.empty() && sounding_.front() <= tick())
+        {
+            std::pop_heap(sounding_.begin(), sounding_.end(), std::greater<>{});
+            sounding_.pop_back();
+        }
+        sounding_.push_back(tick() + duration);
+        std::push_heap(sounding_.begin(), sounding_.end(), std::greater<>{});
+        analysis_.peak_polyphony =
+            std::max(analysis_.peak_polyphony, static_cast<std::uint32_t>(sounding_.size()));
+    }
+
+private:
+    sequence_analysis& analysis_;
+    std::vector<std::uint64_t> sounding_;
+};
+}
+
+// Analyzes one sequence in a single decode pass, without building MIDI.
+inline sequence_analysis analyze(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+    const std::uint8_t* const eventStart = xmi.data() + sequence.event_offset;
+
+    sequence_analysis analysis{};
+    detail::analysis_sink sink(analysis);
+    detail::decode_events(xmi, eventStart, eventStart + sequence.event_size, sink);
+    analysis.ticks = sink.ticks();
+    analysis.seconds = static_cast<double>(analysis.ticks) / detail::smf_render::XmiFreq;
+    return analysis;
+}
+
+// Wall-clock length of one sequence in seconds, from its delays and note
+// durations only. XMI delays are fixed 120 Hz intervals, so tempo events do
+// not change it.
+inline double sequence_duration(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+    const std::uint8_t* const eventStart = xmi.data() + sequence.event_offset;
+
+    detail::duration_sink sink;
+    detail::decode_events(xmi, eventStart, eventStart + sequence.event_size, sink);
+    return static_cast<double>(sink.ticks()) / detail::smf_render::XmiFreq;
+}
+
+// One sequence decoded into parallel columns, one entry per event in stream
+// order, which is time order. Note Ons carry their duration in 120 Hz ticks
+// instead of a separate Note Off. Meta events have status 0xFF and their type
+// in data1, and SysEx has status 0xF0 or 0xF7; event i owns payload bytes
+// payload_offsets[i] to payload_offsets[i + 1]. The last event is End of
+// Track unless the stream lacks one.
+struct event_table
+{
+    std::vector<std::uint32_t> ticks;
+    std::vector<std::uint64_t> micros;
+    std::vector<std::uint8_t> status;
+    std::vector<std::uint8_t> data1;
+    std::vector<std::uint8_t> data2;
+    std::vector<std::uint32_t> durations;
+    std::vector<std::uint32_t> payload_offsets;
+    std::vector<std::uint8_t> payload;
+
+    std::size_t size() const
+    {
+        return status.size();
+    }
+
+    std::span<const std::uint8_t> event_payload(std::size_t index) const
+    {
+        return std::span<const std::uint8_t>(payload).subspan(
+            payload_offsets[index], payload_offsets[index + 1] - payload_offsets[index]);
+    }
+};
+
+namespace detail
+{
+// Sink that counts the events and payload bytes decode() stores, so each
+// column is allocated once at its exact size.
+struct event_count_sink
+{
+    std::size_t events = 0;
+    std::size_t payloadBytes = 0;
+
+    void at(const std::uint8_t*) const
+    {
+    }
+
+    void delay(std::uint32_t) const
+    {
+    }
+
+    void meta(const std::uint8_t*, const std::uint8_t*, std::uint8_t, const std::uint8_t*, std::uint32_t length)
+    {
+        ++events;
+        payloadBytes += length;
+    }
+
+    bool end_of_track()
+    {
+        ++events;
+        return false;
+    }
+
+    void sysex(const std::uint8_t* event, const std::uint8_t* eventEnd)
+    {
+        const std::uint8_t* payload = event + 1;
+        read_xmi_varlen(payload, eventEnd);
+        ++events;
+        payloadBytes += static_cast<std::size_t>(eventEnd - payload);
+    }
+
+    void channel(const std::uint8_t*, std::size_t)
+    {
+        ++events;
+    }
+
+    void note_on(const std::uint8_t*, std::uint32_t)
+    {
+        ++events;
+    }
+
+    void skip() const
+    {
+    }
+};
+
+class event_table_sink
+{
+public:
+    explicit event_table_sink(event_table& table) : table_(table)
+    {
+    }
+
+    void at(const std::uint8_t*) const
+    {
+    }
+
+    void delay(std::uint32_t delay)
+    {
+        if (delay > std::numeric_limits<std::uint32_t>::max() - tick_)
+        {
+            failure_ = error_code::sequence_too_long;
+            return;
+        }
+        tick_ += delay;
+    }
+
+    std::optional<error_code> failure() const
+    {
+        return failure_;
+    }
+
+    void meta(const std::uint8_t*, const std::uint8_t*, std::uint8_t type, const std::uint8_t* payload,
+              std::uint32_t length)
+    {
+        append(0xFF, type, 0, 0);
+        table_.payload.insert(table_.payload.end(), payload, payload + length);
+        table_.payload_offsets.push_back(static_cast<std::uint32_t>(table_.payload.size()));
+    }
+
+    bool end_of_track()
+    {
+        append(0xFF, 0x2F, 0, 0);
+        table_.payload_offsets.push_back(static_cast<std::uint32_t>(table_.payload.size()));
+        return false;
+    }
+
+    void sysex(const std::uint8_t* event, const std::uint8_t* eventEnd)
+    {
+        const std::uint8_t* payload = event + 1;
+        read_xmi_varlen(payload, eventEnd);
+        append(event[0], 0, 0, 0);
+        table_.payload.insert(table_.payload.end(), payload, eventEnd);
+        table_.payload_offsets.push_back(static_cast<std::uint32_t>(table_.payload.size()));
+    }
+
+    void channel(const std::uint8_t* event, std::size_t size)
+    {
+        append(event[0], event[1], size > 2 ? event[2] : std::uint8_t{0}, 0);
+        table_.payload_offsets.push_back(static_cast<std::uint32_t>(table_.payload.size()));
+    }
+
+    void note_on(const std::uint8_t* event, std::uint32_t duration)
+    {
+        append(event[0], event[1], event[2], duration);
+        table_.payload_offsets.push_back(static_cast<std::uint32_t>(table_.payload.size()));
+    }
+
+    void skip() const
+    {
+    }
+
+private:
+    void append(std::uint8_t status, std::uint8_t data1, std::uint8_t data2, std::uint32_t duration)
+    {
+        table_.ticks.push_back(tick_);
+        // 120 Hz ticks are 25000/3 microseconds; rounded to the nearest.
+        table_.micros.push_back((std::uint64_t{tick_} * 25'000 + 1) / 3);
+        table_.status.push_back(status);
+        table_.data1.push_back(data1);
+        table_.data2.push_back(data2);
+        table_.durations.push_back(duration);
+    }
+
+    event_table& table_;
+    std::uint32_t tick_ = 0;
+    std::optional<error_code> failure_;
+};
+}
+
+// Decodes one sequence into an event_table for players and tools that would
+// otherwise parse the MIDI from convert(). A counting pass sizes every column
+// exactly, then one decoding pass fills them.
+inline result<event_table> try_decode(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    const result<sequence_info> sequence = detail::try_find_sequence(xmi, sequenceIndex);
+    if (!sequence)
+    {
+        return std::unexpected(sequence.error());
+    }
+    const std::uint8_t* const eventStart = xmi.data() + sequence->event_offset;
+    const std::uint8_t* const eventEnd = eventStart + sequence->event_size;
+
+    detail::event_count_sink count;
+    if (result<void> counted = detail::try_decode_events(xmi, eventStart, eventEnd, count); !counted)
+    {
+        return std::unexpected(counted.error());
+    }
+
+    event_table table;
+    table.ticks.reserve(count.events);
+    table.micros.reserve(count.events);
+    table.status.reserve(count.events);
+    table.data1.reserve(count.events);
+    table.data2.reserve(count.events);
+    table.durations.reserve(count.events);
+    table.payload_offsets.reserve(count.events + 1);
+    table.payload.reserve(count.payloadBytes);
+    table.payload_offsets.push_back(0);
+
+    detail::event_table_sink sink(table);
+    if (result<void> decoded = detail::try_decode_events(xmi, eventStart, eventEnd, sink); !decoded)
+    {
+        return std::unexpected(decoded.error());
+    }
+    return table;
+}
+
+inline event_table decode(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    result<event_table> table = try_decode(xmi, sequenceIndex);
+    if (!table)
+    {
+        detail::fail_sequence(xmi, sequenceIndex, table.error());
+    }
+    return std::move(*table);
+}
+
+// Writes an event_table as MIDI. The table is replayed through the renderer
+// convert() uses, so a decoded sequence encodes to the same bytes, and one
+// table can be encoded with several option sets without decoding it again.
+inline std::vector<std::uint8_t> encode_smf(const event_table& table, const convert_options& options = {})
+{
+    detail::smf_render render(table.size() * 8 + table.payload.size());
+    render.set_patch_map(options.patches);
+
+    std::vector<std::uint8_t> event;
+    std::uint32_t tick = 0;
+    for (std::size_t index = 0; index < table.size(); ++index)
+    {
+        if (table.ticks[index] != tick)
+        {
+            render.delay(table.ticks[index] - tick);
+            tick = table.ticks[index];
+        }
+
+        const std::uint8_t status = table.status[index];
+        const std::uint8_t bytes[3] = {status, table.data1[index], table.data2[index]};
+        if (status == 0xFF && bytes[1] == 0x2F)
+        {
+            render.end_of_track();
+            break;
+        }
+        if (status == 0xFF || status == 0xF0 || status == 0xF7)
+        {
+            const std::span<const std::uint8_t> payload = table.event_payload(index);
+            event.assign(bytes, bytes + (status == 0xFF ? 2 : 1));
+            detail::append_varlen(event, static_cast<std::uint32_t>(payload.size()));
+            const std::size_t payloadStart = event.size();
+            event.insert(event.end(), payload.begin(), payload.end());
+            if (status == 0xFF)
+            {
+                render.meta(event.data(), event.data() + event.size(), bytes[1], event.data() + payloadStart,
+                            static_cast<std::uint32_t>(payload.size()));
+            }
+            else
+            {
+                render.sysex(event.data(), event.data() + event.size());
+            }
+        }
+        else if ((status & 0xF0) == 0x90)
+        {
+            render.note_on(bytes, table.durations[index]);
+        }
+        else
+        {
+            render.channel(bytes, detail::channel_event_size(status));
+        }
+    }
+    return render.take();
+}
+
+// Playback blobs hold one sequence as fixed-width records that a player reads
+// in place, with no varlens, running status or note-off queue. All fields are
+// little-endian and 4-byte aligned:
+//
+//   header        40 bytes: "XPBK", u16 version, u16 ticks per second (120),
+//                 u32 length in ticks, then u32 counts and sizes as below
+//   events        event_count x {u32 time, u32 message}
+//   tempos        tempo_count x {u32 time, u32 quarter-note microseconds}
+//   seek table    seek_count x u32: first event at or after entry * interval
+//   payloads      payload_count x {u32 offset, u32 length} into payload bytes
+//   payload bytes payload_bytes bytes
+//
+// Times are absolute 120 Hz ticks, so tempo never changes when an event is
+// due; the tempo map is there for players that count beats. A channel message
+// is packed as status | data1 << 8 | data2 << 16. SysEx (F0, F7) and meta
+// (FF) messages are status | payload index << 8; a meta payload starts with
+// its type byte. Note-offs are ordinary records, in the order convert() writes
+// them.
+struct playback_options
+{
+    // Seek table spacing in ticks; 0 leaves the table out.
+    std::uint32_t seek_interval = 120;
+};
+
+struct playback_event
+{
+    std::uint32_t time = 0;
+    std::uint32_t message = 0;
+
+    std::uint8_t status() const
+    {
+        return static_cast<std::uint8_t>(message);
+    }
+
+    std::uint8_t data1() const
+    {
+        return static_cast<std::uint8_t>(message >> 8);
+    }
+
+    std::uint8_t data2() const
+    {
+        return static_cast<std::uint8_t>(message >> 16);
+    }
+
+    // For SysEx and meta events.
+    std::uint32_t payload_index() const
+    {
+        return message >> 8;
+    }
+};
+
+struct playback_tempo
+{
+    std::uint32_t time = 0;
+    std::uint32_t quarter_note_micros = 0;
+};
+
+namespace detail
+{
+inline constexpr std::uint16_t PlaybackVersion = 1;
+inline constexpr std::size_t PlaybackHeaderSize = 40;
+
+inline std::uint32_t load_le32(const std::uint8_t* bytes)
+{
+    return static_cast<std::uint32_t>(bytes[0]) | (static_cast<std::uint32_t>(bytes[1]) << 8) |
+           (static_cast<std::uint32_t>(bytes[2]) << 16) | (static_cast<std::uint32_t>(bytes[3]) << 24);
+}
+
+inline void store_le32(std::uint8_t* bytes, std::uint32_t value)
+{
+    bytes[0] = static_cast<std::uint8_t>(value);
+    bytes[1] = static_cast<std::uint8_t>(value >> 8);
+    bytes[2] = static_cast<std::uint8_t>(value >> 16);
+    bytes[3] = static_cast<std::uint8_t>(value >> 24);
+}
+
+struct playback_note_off
+{
+    std::uint32_t time = 0;
+    std::uint32_t message = 0;
+};
+}
+
+// Compiles a decoded sequence into a playback blob. Note-offs are resolved
+// the way the MIDI renderer does it: one due at the time of later events
+// follows them, and any still pending at End of Track come just before it.
+inline std::vector<std::uint8_t> compile_playback(const event_table& table, const playback_options& options = {})
+{
+    std::vector<playback_event> events;
+    std::vector<playback_tempo> tempos;
+    std::vector<detail::playback_note_off> pending;
+    events.reserve(table.size() * 2);
+
+    std::uint32_t payloadCount = 0;
+    std::size_t payloadBytes = 0;
+    std::uint32_t tick = 0;
+    for (std::size_t index = 0; index < table.size(); ++index)
+    {
+        const std::uint32_t time = table.ticks[index];
+        if (time != tick)
+        {
+            const auto due = std::find_if(pending.begin(), pending.end(),
+                                          [time](const detail::playback_note_off& noteOff)
+            {
+                return noteOff.time >= time;
+            });
+            for (auto noteOff = pending.begin(); noteOff != due; ++noteOff)
+            {
+                events.push_back({noteOff->time, noteOff->message});
+            }
+            pending.erase(pending.begin(), due);
+            tick = time;
+        }
+
+        const std::uint8_t status = table.status[index];
+        const bool endOfTrack = status == 0xFF && table.data1[index] == 0x2F;
+        if (endOfTrack)
+        {
+            for (const detail::playback_note_off& noteOff : pending)
+            {
+                events.push_back({time, noteOff.message});
+            }
+        }
+
+        if (status == 0xFF || status == 0xF0 || status == 0xF7)
+        {
+            const std::span<const std::uint8_t> payload = table.event_payload(index);
+            if (status == 0xFF && table.data1[index] == 0x51 && payload.size() == 3)
+            {
+                tempos.push_back({time, (static_cast<std::uint32_t>(payload[0]) << 16) |
+                                            (static_cast<std::uint32_t>(payload[1]) << 8) | payload[2]});
+            }
+            if (payloadCount > 0xFFFFFF)
+            {
+                detail::fail("Playback blob has too many SysEx and meta events");
+            }
+            events.push_back({time, status | (payloadCount << 8)});
+            ++payloadCount;
+            payloadBytes += payload.size() + (status == 0xFF ? 1 : 0);
+        }
+        else
+        {
+            events.push_back({time, static_cast<std::uint32_t>(status) | (std::uint32_t{table.data1[index]} << 8) |
+                                        (std::uint32_t{table.data2[index]} << 16)});
+        }
+
+        if (endOfTrack)
+        {
+            break;
+        }
+        if ((status & 0xF0) == 0x90)
+        {
+            const std::uint64_t end = std::uint64_t{time} + table.durations[index];
+            if (end > std::numeric_limits<std::uint32_t>::max())
+            {
+                detail::fail("Invalid XMI: sequence is too long");
+            }
+            const detail::playback_note_off noteOff{
+                static_cast<std::uint32_t>(end),
+                (status & 0x8Fu) | (std::uint32_t{table.data1[index]} << 8) | (0x7Fu << 16)};
+            const auto insertAt = std::upper_bound(pending.begin(), pending.end(), noteOff.time,
+                                                   [](std::uint32_t value, const detail::playback_note_off& queued)
+            {
+                return value < queued.time;
+            });
+            pending.insert(insertAt, noteOff);
+        }
+    }
+
+    const std::uint32_t length = events.empty() ? 0 : events.back().time;
+    const std::size_t seekCount =
+        options.seek_interval == 0 ? 0 : std::size_t{length / options.seek_interval} + 1;
+    const std::size_t eventsOffset = detail::PlaybackHeaderSize;
+    const std::size_t temposOffset = eventsOffset + events.size() * 8;
+    const std::size_t seekOffset = temposOffset + tempos.size() * 8;
+    const std::size_t directoryOffset = seekOffset + seekCount * 4;
+    const std::size_t payloadOffset = directoryOffset + std::size_t{payloadCount} * 8;
+    if (payloadOffset + payloadBytes > std::numeric_limits<std::uint32_t>::max())
+    {
+        detail::fail("Playback blob is too large");
+    }
+
+    std::vector<std::uint8_t> blob(payloadOffset + payloadBytes);
+    std::uint8_t* const bytes = blob.data();
+    std::copy_n("XPBK", 4, bytes);
+    bytes[4] = static_cast<std::uint8_t>(detail::PlaybackVersion);
+    bytes[5] = static_cast<std::uint8_t>(detail::PlaybackVersion >> 8);
+    bytes[6] = static_cast<std::uint8_t>(detail::smf_render::XmiFreq);
+    bytes[7] = 0;
+    detail::store_le32(bytes + 8, length);
+    detail::store_le32(bytes + 12, static_cast<std::uint32_t>(events.size()));
+    detail::store_le32(bytes + 16, static_cast<std::uint32_t>(tempos.size()));
+    detail::store_le32(bytes + 20, options.seek_interval);
+    detail::store_le32(bytes + 24, static_cast<std::uint32_t>(seekCount));
+    detail::store_le32(bytes + 28, payloadCount);
+    detail::store_le32(bytes + 32, static_cast<std::uint32_t>(payloadBytes));
+
+    std::size_t seekEntry = 0;
+    for (std::size_t index = 0; index < events.size(); ++index)
+    {
+        detail::store_le32(bytes + eventsOffset + index * 8, events[index].time);
+        detail::store_le32(bytes + eventsOffset + index * 8 + 4, events[index].message);
+        for (; seekEntry < seekCount && std::uint64_t{seekEntry} * options.seek_interval <= events[index].time;
+             ++seekEntry)
+        {
+            detail::store_le32(bytes + seekOffset + seekEntry * 4, static_cast<std::uint32_t>(index));
+        }
+    }
+    for (std::size_t index = 0; index < tempos.size(); ++index)
+    {
+        detail::store_le32(bytes + temposOffset + index * 8, tempos[index].time);
+        detail::store_le32(bytes + temposOffset + index * 8 + 4, tempos[index].quarter_note_micros);
+    }
+
+    std::uint32_t payloadIndex = 0;
+    std::size_t written = 0;
+    for (std::size_t index = 0; index < table.size(); ++index)
+    {
+        const std::uint8_t status = table.status[index];
+        if (status != 0xFF && status != 0xF0 && status != 0xF7)
+        {
+            continue;
+        }
+
+        const std::span<const std::uint8_t> payload = table.event_payload(index);
+        const std::size_t start = written;
+        if (status == 0xFF)
+        {
+            bytes[payloadOffset + written++] = table.data1[index];
+        }
+        std::copy(payload.begin(), payload.end(), bytes + payloadOffset + written);
+        written += payload.size();
+        detail::store_le32(bytes + directoryOffset + payloadIndex * 8, static_cast<std::uint32_t>(start));
+        detail::store_le32(bytes + directoryOffset + payloadIndex * 8 + 4, static_cast<std::uint32_t>(written - start));
+        if (++payloadIndex == payloadCount)
+        {
+            break;
+        }
+    }
+    return blob;
+}
+
+inline std::vector<std::uint8_t> compile_playback(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                                  const playback_options& options = {})
+{
+    return compile_playback(decode(xmi, sequenceIndex), options);
+}
+
+// Reads a playback blob in place, for example straight from a memory map. The
+// constructor checks the header and section sizes once; after that every
+// accessor is a fixed-offset load.
+class playback_view
+{
+public:
+    explicit playback_view(std::span<const std::uint8_t> blob) : bytes_(blob.data())
+    {
+        if (blob.size() < detail::PlaybackHeaderSize || !std::equal(blob.begin(), blob.begin() + 4, "XPBK") ||
+            (blob[4] | (blob[5] << 8)) != detail::PlaybackVersion)
+        {
+            detail::fail("Invalid playback blob: bad header");
+        }
+
+        eventCount_ = detail::load_le32(bytes_ + 12);
+        tempoCount_ = detail::load_le32(bytes_ + 16);
+        seekInterval_ = detail::load_le32(bytes_ + 20);
+        seekCount_ = detail::load_le32(bytes_ + 24);
+        payloadCount_ = detail::load_le32(bytes_ + 28);
+        payloadBytes_ = detail::load_le32(bytes_ + 32);
+        // 64-bit sums, so hostile counts cannot wrap on 32-bit targets.
+        const std::uint64_t temposOffset = detail::PlaybackHeaderSize + std::uint64_t{eventCount_} * 8;
+        const std::uint64_t seekOffset = temposOffset + std::uint64_t{tempoCount_} * 8;
+        const std::uint64_t directoryOffset = seekOffset + std::uint64_t{seekCount_} * 4;
+        const std::uint64_t payloadOffset = directoryOffset + std::uint64_t{payloadCount_} * 8;
+        if (payloadOffset + payloadBytes_ != blob.size() || (seekCount_ != 0 && seekInterval_ == 0))
+        {
+            detail::fail("Invalid playback blob: section sizes do not match its length");
+        }
+        tempos_ = bytes_ + static_cast<std::size_t>(temposOffset);
+        seeks_ = bytes_ + static_cast<std::size_t>(seekOffset);
+        directory_ = bytes_ + static_cast<std::size_t>(directoryOffset);
+        payloads_ = bytes_ + static_cast<std::size_t>(payloadOffset);
+    }
+
+    std::uint32_t ticks_per_second() const
+    {
+        return static_cast<std::uint32_t>(bytes_[6] | (bytes_[7] << 8));
+    }
+
+    std::uint32_t length_ticks() const
+    {
+        return detail::load_le32(bytes_ + 8);
+    }
+
+    std::size_t event_count() const
+    {
+        return eventCount_;
+    }
+
+    playback_event event(std::size_t index) const
+    {
+        const std::uint8_t* const record = bytes_ + detail::PlaybackHeaderSize + index * 8;
+        return {detail::load_le32(record), detail::load_le32(record + 4)};
+    }
+
+    std::size_t tempo_count() const
+    {
+        return tempoCount_;
+    }
+
+    playback_tempo tempo(std::size_t index) const
+    {
+        return {detail::load_le32(tempos_ + index * 8), detail::load_le32(tempos_ + index * 8 + 4)};
+    }
+
+    // Index of the first event at or after `time`; event_count() past the end.
+    std::size_t seek(std::uint32_t time) const
+    {
+        std::size_t index = 0;
+        if (seekCount_ != 0)
+        {
+            const std::size_t entry = std::min<std::size_t>(time / seekInterval_, seekCount_ - 1);
+            index = std::min<std::size_t>(detail::load_le32(seeks_ + entry * 4), eventCount_);
+        }
+        while (index < eventCount_ && event(index).time < time)
+        {
+            ++index;
+        }
+        return index;
+    }
+
+    std::span<const std::uint8_t> payload(std::uint32_t index) const
+    {
+        if (index >= payloadCount_)
+        {
+            detail::fail("Invalid playback blob: payload index is out of range");
+        }
+        const std::uint32_t offset = detail::load_le32(directory_ + std::size_t{index} * 8);
+        const std::uint32_t length = detail::load_le32(directory_ + std::size_t{index} * 8 + 4);
+        if (offset > payloadBytes_ || length > payloadBytes_ - offset)
+        {
+            detail::fail("Invalid playback blob: payload is out of range");
+        }
+        return {payloads_ + offset, length};
+    }
+
+    // Passes each event from `next` up to and including `time` to `handler`
+    // and returns the index to resume from, the usual call from a timer tick.
+    template <typename Handler>
+    std::size_t play(std::size_t next, std::uint32_t time, Handler&& handler) const
+    {
+        for (; next < eventCount_; ++next)
+        {
+            const playback_event current = event(next);
+            if (current.time > time)
+            {
+                break;
+            }
+            handler(current);
+        }
+        return next;
+    }
+
+private:
+    const std::uint8_t* bytes_;
+    const std::uint8_t* tempos_ = nullptr;
+    const std::uint8_t* seeks_ = nullptr;
+    const std::uint8_t* directory_ = nullptr;
+    const std::uint8_t* payloads_ = nullptr;
+    std::uint32_t eventCount_ = 0;
+    std::uint32_t tempoCount_ = 0;
+    std::uint32_t seekInterval_ = 0;
+    std::uint32_t seekCount_ = 0;
+    std::uint32_t payloadCount_ = 0;
+    std::uint32_t payloadBytes_ = 0;
+};
+
+struct sequencer_options
+{
+    // Percent applied to Part Volume (controller 7). DEF_SYNTH_VOL is 90 in
+    // the MT-32 driver and 100 in the others.
+    std::uint32_t volume_percent = 100;
+    // 1-based physical channels a Channel Lock (110) may take, the driver's
+    // MIN_TRUE_CHAN and MAX_TRUE_CHAN.
+    std::uint8_t first_lock_channel = 2;
+    std::uint8_t last_lock_channel = 9;
+    // See BreakEndsLoopByDefault.
+    bool break_ends_loop = BreakEndsLoopByDefault;
+    // The application's controller table, read by Indirect Controller
+    // Prefix (115).
+    std::array<std::uint8_t, 128> controller_table{};
+};
+
+enum class trace_kind : std::uint8_t
+{
+    midi,     // channel message sent to the synthesizer: status, data1, data2
+    sysex,    // System Exclusive message: status, and its EVNT offset in value
+    callback, // Callback Trigger (119): status, and the trigger value in data1
+    beat,     // beat/bar count changed: beat in data1, bar in value
+    branch,   // branch_index() jump: marker in data1, EVNT offset in value
+    done      // End of Track
+};
+
+struct trace_event
+{
+    std::uint32_t tick = 0;
+    trace_kind kind = trace_kind::midi;
+    std::uint8_t status = 0;
+    std::uint8_t data1 = 0;
+    std::uint8_t data2 = 0;
+    std::uint32_t value = 0;
+};
+
+// The sequence service of XMIDI.ASM (AIL 2 driver shell v1.10) for one
+// sequence, run one 120 Hz interval per serve() without real time. It keeps
+// the driver's note queue, For/Next slots, beat/bar math, channel locks, and
+// controller shadows, and records what the driver would send or report.
+// Tempo and volume stay at 100% and 'volume_percent', since there is no
+// application to ramp them.
+class sequencer
+{
+public:
+    static constexpr std::uint32_t TicksPerSecond = 120;
+    static constexpr std::size_t MaxNotes = 32;
+    static constexpr std::size_t ForNest = 4;
+    static constexpr std::size_t ChannelCount = 16;
+
+    sequencer(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex, const sequencer_options& options = {})
+        : options_(options)
+    {
+        if (options_.first_lock_channel < 1 || options_.last_lock_channel > ChannelCount ||
+            options_.first_lock_channel > options_.last_lock_channel)
+        {
+            detail::fail("Invalid lock channel range");
+        }
+
+        const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+        start_ = xmi.data() + sequence.event_offset;
+        end_ = start_ + sequence.event_size;
+        cursor_ = start_;
+        branches_ = branch_points(xmi, sequence);
+        detail::check_branch_boundaries(sequence, start_, branches_);
+        for (const branch_point& branch : branches_)
+        {
+            detail::check_branch_target(sequence, start_, branch);
+        }
+
+        for (std::size_t channel = 0; channel < ChannelCount; ++channel)
+        {
+            map_[channel] = static_cast<std::uint8_t>(channel);
+        }
+        indirect_.fill(Unset);
+        noteChannel_.fill(Unset);
+        loopCount_.fill(-1);
+        for (auto& controls : controls_)
+        {
+            controls.fill(Unset);
+        }
+        for (auto& controls : globalControls_)
+        {
+            controls.fill(Unset);
+        }
+        globalProgram_.fill(Unset);
+        globalPitchLow_.fill(Unset);
+        globalPitchHigh_.fill(Unset);
+    }
+
+    // Runs one service interval. Returns false once the sequence is done.
+    bool serve()
+    {
+        if (done_)
+        {
+            return false;
+        }
+
+        if (noteCount_ != 0)
+        {
+            expire_notes();
+        }
+        if (--interval_ <= 0)
+        {
+            play_events();
+        }
+        if (!done_)
+        {
+            advance_beat();
+        }
+        ++tick_;
+        return !done_;
+    }
+
+    // Serves intervals until the sequence is done or tick() reaches endTick.
+    void run_until(std::uint32_t endTick)
+    {
+        while (tick_ < endTick && serve())
+        {
+        }
+    }
+
+    // AIL_branch_index(): jumps to the first RBRN entry whose marker has this
+    // low byte, turns off queued notes, and cancels all For/Next loops.
+    // Returns false when the sequence has no such marker.
+    bool branch_index(std::uint8_t marker)
+    {
+        for (const branch_point& branch : branches_)
+        {
+            if ((branch.marker & 0xFF) == marker)
+            {
+                cursor_ = start_ + branch.offset;
+                interval_ = 0;
+                flush_note_queue();
+                loopCount_.fill(-1);
+                record(trace_kind::branch, 0, marker, 0, branch.offset);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool done() const
+    {
+        return done_;
+    }
+
+    // The next interval to serve, counted from 0 at the start.
+    std::uint32_t tick() const
+    {
+        return tick_;
+    }
+
+    std::uint32_t beat_count() const
+    {
+        return beat_;
+    }
+
+    // Measures started, or 0 before the first time signature.
+    std::uint32_t bar_count() const
+    {
+        return static_cast<std::uint32_t>(std::max(bar_, 0));
+    }
+
+    const std::vector<trace_event>& trace() const
+    {
+        return trace_;
+    }
+
+    std::vector<trace_event> take_trace()
+    {
+        return std::move(trace_);
+    }
+
+    // Drops recorded events, for callers that consume them after each serve().
+    void clear_trace()
+    {
+        trace_.clear();
+    }
+
+private:
+    static constexpr std::uint8_t Unset = 0xFF;
+    static constexpr std::uint8_t Locked = 0x80;
+    static constexpr std::uint8_t LockProtected = 0x40;
+    // Switch controllers such as Channel Lock are on from this value up.
+    static constexpr std::uint8_t ControllerOn = 64;
+
+    static constexpr std::uint8_t PartVolume = 7;
+    static constexpr std::uint8_t Sustain = 64;
+    static constexpr std::uint8_t ChannelLock = 110;
+    static constexpr std::uint8_t ChannelProtect = 111;
+    static constexpr std::uint8_t VoiceProtect = 112;
+    static constexpr std::uint8_t IndirectPrefix = 115;
+    static constexpr std::uint8_t AllNotesOff = 123;
+
+    // Controllers kept in the state table and global shadow, in XMIDI.ASM's
+    // logged_ctrls order.
+    static constexpr std::array<std::uint8_t, 9> LoggedControllers = {PartVolume, 1, 10, 11, Sustain, 114,
+                                                                       ChannelLock, ChannelProtect, VoiceProtect};
+    static constexpr std::size_t VolumeLog = 0;
+    static constexpr std::size_t SustainLog = 4;
+    static constexpr std::size_t LockLog = 6;
+    static constexpr std::size_t ProtectLog = 7;
+    static constexpr std::size_t VoiceProtectLog = 8;
+
+    // QUANT_TIME * 16: microseconds per interval in the driver's beat math.
+    static constexpr std::int64_t QuantTime16 = 133333;
+
+    static int logged_index(std::uint8_t controller)
+    {
+        for (std::size_t i = 0; i < LoggedControllers.size(); ++i)
+        {
+            if (LoggedControllers[i] == controller)
+            {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    void record(trace_kind kind, std::uint8_t status, std::uint8_t data1, std::uint8_t data2,
+                std::uint32_t value = 0)
+    {
+        trace_.push_back({tick_, kind, status, data1, data2, value});
+    }
+
+    void send(std::uint8_t status, std::uint8_t data1, std::uint8_t data2 = 0)
+    {
+        record(trace_kind::midi, status, data1, data2);
+    }
+
+    bool locked(std::uint8_t channel) const
+    {
+        return (lockStatus_[channel] & Locked) != 0;
+    }
+
+    void note_off(std::size_t slot)
+    {
+        const std::uint8_t physical = map_[noteChannel_[slot]];
+        noteChannel_[slot] = Unset;
+        // The note may have started on another physical channel if the
+        // mapping changed while it sounded.
+        if (activeNotes_[physical] != 0)
+        {
+            --activeNotes_[physical];
+        }
+        send(static_cast<std::uint8_t>(0x80 | physical), noteNumber_[slot]);
+    }
+
+    void expire_notes()
+    {
+        for (std::size_t slot = 0; slot < MaxNotes; ++slot)
+        {
+            if (noteChannel_[slot] == Unset || --noteTime_[slot] >= 0)
+            {
+                continue;
+            }
+            note_off(slot);
+            if (--noteCount_ == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    void flush_channel_notes(std::uint8_t channel)
+    {
+        if (noteCount_ == 0)
+        {
+            return;
+        }
+        for (std::size_t slot = 0; slot < MaxNotes; ++slot)
+        {
+            if (noteChannel_[slot] == channel)
+            {
+                note_off(slot);
+                --noteCount_;
+            }
+        }
+    }
+
+    void flush_note_queue()
+    {
+        for (std::size_t slot = 0; slot < MaxNotes; ++slot)
+        {
+            if (noteChannel_[slot] != Unset)
+            {
+                note_off(slot);
+            }
+        }
+        noteCount_ = 0;
+    }
+
+    void report_count()
+    {
+        const std::uint32_t bar = bar_count();
+        if (beat_ != reportedBeat_ || bar != reportedBar_)
+        {
+            reportedBeat_ = beat_;
+            reportedBar_ = bar;
+            record(trace_kind::beat, 0, static_cast<std::uint8_t>(std::min<std::uint32_t>(beat_, 0xFF)), 0, bar);
+        }
+    }
+
+    void advance_beat()
+    {
+        beatFraction_ += timeFraction_;
+        if (beatFraction_ < timePerBeat_)
+        {
+            return;
+        }
+
+        beatFraction_ -= timePerBeat_;
+        if (++beat_ >= numerator_)
+        {
+            beat_ = 0;
+            ++bar_;
+        }
+        report_count();
+    }
+
+    void play_events()
+    {
+        while (!done_)
+        {
+            if (cursor_ >= end_)
+            {
+                end_sequence();
+                return;
+            }
+
+            const std::uint8_t status = *cursor_;
+            if (status < 0x80)
+            {
+                interval_ = status;
+                ++cursor_;
+                return;
+            }
+
+            const auto channel = static_cast<std::uint8_t>(status & 0x0F);
+            switch (status & 0xF0)
+            {
+            case 0xF0:
+                if (channel == 0x0F)
+                {
+                    meta();
+                }
+                else
+                {
+                    sysex();
+                }
+                break;
+            case 0xE0:
+                detail::need_bytes(cursor_, end_, 3, "event payload");
+                globalPitchLow_[channel] = cursor_[1];
+                globalPitchHigh_[channel] = cursor_[2];
+                send_channel(status, cursor_[1], cursor_[2]);
+                cursor_ += 3;
+                break;
+            case 0xD0:
+                detail::need_bytes(cursor_, end_, 2, "event payload");
+                send_channel(status, cursor_[1], 0);
+                cursor_ += 2;
+                break;
+            case 0xC0:
+                detail::need_bytes(cursor_, end_, 2, "event payload");
+                globalProgram_[channel] = cursor_[1];
+                send_channel(status, cursor_[1], 0);
+                cursor_ += 2;
+                break;
+            case 0xB0:
+                control();
+                break;
+            case 0xA0:
+                detail::need_bytes(cursor_, end_, 3, "event payload");
+                send_channel(status, cursor_[1], cursor_[2]);
+                cursor_ += 3;
+                break;
+            default:
+                note_on();
+                break;
+            }
+        }
+    }
+
+    void send_channel(std::uint8_t status, std::uint8_t data1, std::uint8_t data2)
+    {
+        const auto channel = static_cast<std::uint8_t>(status & 0x0F);
+        if (!locked(channel))
+        {
+            send(static_cast<std::uint8_t>((status & 0xF0) | map_[channel]), data1, data2);
+        }
+    }
+
+    // XMIDI.ASM reads 0x80 to 0x9F alike as a Note On with a duration.
+    void note_on()
+    {
+        detail::need_bytes(cursor_, end_, 3, "event payload");
+        const auto channel = static_cast<std::uint8_t>(cursor_[0] & 0x0F);
+        const std::uint8_t note = cursor_[1];
+        const std::uint8_t velocity = cursor_[2];
+        cursor_ += 3;
+        const std::uint32_t duration = detail::read_xmi_varlen(cursor_, end_);
+        if (locked(channel))
+        {
+            return;
+        }
+
+        // A full queue overwrites its first entry without a Note Off.
+        std::size_t slot = 0;
+        while (slot < MaxNotes && noteChannel_[slot] != Unset)
+        {
+            ++slot;
+        }
+        if (slot == MaxNotes)
+        {
+            slot = 0;
+        }
+        else
+        {
+            ++noteCount_;
+        }
+
+        noteChannel_[slot] = channel;
+        noteNumber_[slot] = note;
+        noteTime_[slot] = static_cast<std::int32_t>(duration) - 1;
+
+        const std::uint8_t physical = map_[channel];
+        ++activeNotes_[physical];
+        send(static_cast<std::uint8_t>(0x90 | physical), note, velocity);
+    }
+
+    void meta()
+    {
+        detail::need_bytes(cursor_, end_, 2, "meta event");
+        const std::uint8_t type = cursor_[1];
+        const std::uint8_t* payload = cursor_ + 2;
+        const std::uint32_t length = detail::read_xmi_varlen(payload, end_);
+        detail::need_bytes(payload, end_, length, "meta payload");
+        cursor_ = payload + length;
+
+        if (type == 0x2F)
+        {
+            end_sequence();
+        }
+        else if (type == 0x58 && length >= 2)
+        {
+            numerator_ = payload[0];
+            const int denominator = payload[1];
+            timeFraction_ = denominator >= 2 ? QuantTime16 << std::min(denominator - 2, 14)
+                                             : QuantTime16 >> (2 - denominator);
+            beatFraction_ = -timeFraction_;
+            beat_ = 0;
+            ++bar_;
+            report_count();
+        }
+        else if (type == 0x51 && length >= 3)
+        {
+            timePerBeat_ = ((std::int64_t{payload[0]} << 16) | (payload[1] << 8) | payload[2]) * 16;
+        }
+    }
+
+    void sysex()
+    {
+        const std::uint8_t status = *cursor_;
+        const auto offset = static_cast<std::uint32_t>(cursor_ - start_);
+        const std::uint8_t* payload = cursor_ + 1;
+        const std::uint32_t length = detail::read_xmi_varlen(payload, end_);
+        detail::need_bytes(payload, end_, length, "event payload");
+        cursor_ = payload + length;
+        record(trace_kind::sysex, status, 0, 0, offset);
+    }
+
+    void control()
+    {
+        detail::need_bytes(cursor_, end_, 3, "event payload");
+        const auto channel = static_cast<std::uint8_t>(cursor_[0] & 0x0F);
+        const std::uint8_t controller = cursor_[1];
+        std::uint8_t value = cursor_[2];
+        cursor_ += 3;
+
+        if (indirect_[channel] != Unset)
+        {
+            value = options_.controller_table[indirect_[channel] & 0x7F];
+            indirect_[channel] = Unset;
+        }
+
+        const int log = logged_index(controller);
+        if (log >= 0)
+        {
+            globalControls_[log][channel] = value;
+            controls_[log][channel] = value;
+        }
+
+        switch (controller)
+        {
+        case PartVolume:
+            if (options_.volume_percent != 100)
+            {
+                value = static_cast<std::uint8_t>(std::min<std::uint32_t>(value * options_.volume_percent / 100, 127));
+                globalControls_[VolumeLog][channel] = value;
+            }
+            send_control(channel, controller, value);
+            break;
+        case detail::ClearBeatBarController:
+            beat_ = 0;
+            bar_ = 0;
+            beatFraction_ = -timeFraction_;
+            report_count();
+            break;
+        case detail::CallbackController:
+            record(trace_kind::callback, static_cast<std::uint8_t>(0xB0 | channel), value, 0);
+            break;
+        case detail::ForController:
+            for (std::size_t slot = 0; slot < ForNest; ++slot)
+            {
+                if (loopCount_[slot] == -1)
+                {
+                    loopCount_[slot] = value;
+                    loopBody_[slot] = cursor_;
+                    break;
+                }
+            }
+            break;
+        case detail::NextController:
+            next_loop(value);
+            break;
+        case ChannelProtect:
+            lockStatus_[channel] = static_cast<std::uint8_t>(
+                value >= ControllerOn ? lockStatus_[channel] | LockProtected : lockStatus_[channel] & ~LockProtected);
+            break;
+        case ChannelLock:
+            if (value >= ControllerOn)
+            {
+                const int physical = lock_channel() - 1;
+                map_[channel] = static_cast<std::uint8_t>(physical == -1 ? channel : physical);
+            }
+            else
+            {
+                flush_channel_notes(channel);
+                release_channel(map_[channel]);
+                map_[channel] = channel;
+            }
+            break;
+        case IndirectPrefix:
+            indirect_[channel] = value;
+            break;
+        default:
+            send_control(channel, controller, value);
+            break;
+        }
+    }
+
+    void send_control(std::uint8_t channel, std::uint8_t controller, std::uint8_t value)
+    {
+        if (!locked(channel))
+        {
+            send(static_cast<std::uint8_t>(0xB0 | map_[channel]), controller, value);
+        }
+    }
+
+    void next_loop(std::uint8_t value)
+    {
+        std::size_t slot = ForNest;
+        while (slot > 0 && loopCount_[slot - 1] == -1)
+        {
+            --slot;
+        }
+        if (slot == 0)
+        {
+            return;
+        }
+        --slot;
+
+        if (value < detail::BreakThreshold)
+        {
+            if (options_.break_ends_loop)
+            {
+                loopCount_[slot] = -1;
+            }
+            return;
+        }
+
+        if (loopCount_[slot] != 0 && --loopCount_[slot] == 0)
+        {
+            loopCount_[slot] = -1;
+            return;
+        }
+        cursor_ = loopBody_[slot];
+    }
+
+    // Takes the highest unlocked physical channel with the fewest active
+    // notes, preferring ones without lock protection. Returns it 1-based, or
+    // 0 when every channel is locked.
+    int lock_channel()
+    {
+        int found = -1;
+        std::uint32_t fewest = std::numeric_limits<std::uint32_t>::max();
+        for (const std::uint8_t skip : {std::uint8_t{Locked | LockProtected}, Locked})
+        {
+            for (int channel = options_.last_lock_channel - 1; channel >= options_.first_lock_channel - 1; --channel)
+            {
+                if ((lockStatus_[channel] & skip) == 0 && activeNotes_[channel] < fewest)
+                {
+                    fewest = activeNotes_[channel];
+                    found = channel;
+                }
+            }
+            if (found != -1)
+            {
+                break;
+            }
+        }
+        if (found == -1)
+        {
+            return 0;
+        }
+
+        const auto physical = static_cast<std::uint8_t>(found);
+        send(static_cast<std::uint8_t>(0xB0 | physical), Sustain, 0);
+        flush_channel_notes(physical);
+        activeNotes_[physical] = 0;
+        lockStatus_[physical] |= Locked;
+        return found + 1;
+    }
+
+    // Unlocks a physical channel and restores its controllers, program, and
+    // pitch wheel from the global shadow.
+    void release_channel(std::uint8_t physical)
+    {
+        if (!locked(physical))
+        {
+            return;
+        }
+        lockStatus_[physical] &= static_cast<std::uint8_t>(~Locked);
+        activeNotes_[physical] = 0;
+
+        const auto control = static_cast<std::uint8_t>(0xB0 | physical);
+        send(control, Sustain, 0);
+        send(control, AllNotesOff, 0);
+        for (std::size_t log = 0; log < LoggedControllers.size(); ++log)
+        {
+            if (globalControls_[log][physical] != Unset)
+            {
+                send(control, LoggedControllers[log], globalControls_[log][physical]);
+            }
+        }
+        if (globalProgram_[physical] != Unset)
+        {
+            send(static_cast<std::uint8_t>(0xC0 | physical), globalProgram_[physical]);
+        }
+        if (globalPitchLow_[physical] != Unset && globalPitchHigh_[physical] != Unset)
+        {
+            send(static_cast<std::uint8_t>(0xE0 | physical), globalPitchLow_[physical], globalPitchHigh_[physical]);
+        }
+    }
+
+    // reset_sequence() at End of Track: releases sustain, channel locks, lock
+    // protection, and voice protection the sequence owns. Queued notes stay on,
+    // as in the driver.
+    void end_sequence()
+    {
+        for (std::uint8_t channel = 0; channel < ChannelCount; ++channel)
+        {
+            const auto owns = [&](std::size_t log)
+            {
+                return controls_[log][channel] != Unset && controls_[log][channel] >= ControllerOn;
+            };
+
+            if (owns(SustainLog))
+            {
+                globalControls_[SustainLog][channel] = 0;
+                send(static_cast<std::uint8_t>(0xB0 | channel), Sustain, 0);
+            }
+            if (owns(LockLog))
+            {
+                flush_channel_notes(channel);
+                release_channel(map_[channel]);
+                map_[channel] = channel;
+            }
+            if (owns(ProtectLog))
+            {
+                lockStatus_[channel] &= static_cast<std::uint8_t>(~LockProtected);
+            }
+            if (owns(VoiceProtectLog))
+            {
+                send(static_cast<std::uint8_t>(0xB0 | channel), VoiceProtect, 0);
+            }
+        }
+        done_ = true;
+        record(trace_kind::done, 0, 0, 0);
+    }
+
+    sequencer_options options_;
+    const std::uint8_t* start_ = nullptr;
+    const std::uint8_t* end_ = nullptr;
+    const std::uint8_t* cursor_ = nullptr;
+    std::vector<branch_point> branches_;
+    std::vector<trace_event> trace_;
+
+    std::uint32_t tick_ = 0;
+    std::int32_t interval_ = 0;
+    bool done_ = false;
+
+    std::uint32_t beat_ = 0;
+    std::int32_t bar_ = -1;
+    std::uint32_t numerator_ = 4;
+    // 64-bit, as a 24-bit tempo times 16 or a large time signature
+    // denominator overflows the driver's 32 bits.
+    std::int64_t beatFraction_ = 0;
+    std::int64_t timeFraction_ = 0;
+    std::int64_t timePerBeat_ = 500000 * 16;
+    std::uint32_t reportedBeat_ = 0;
+    std::uint32_t reportedBar_ = 0;
+
+    std::array<std::int32_t, ForNest> loopCount_{};
+    std::array<const std::uint8_t*, ForNest> loopBody_{};
+
+    std::array<std::uint8_t, ChannelCount> map_{};
+    std::array<std::uint8_t, ChannelCount> indirect_{};
+    std::array<std::array<std::uint8_t, ChannelCount>, LoggedControllers.size()> controls_{};
+
+    std::size_t noteCount_ = 0;
+    std::array<std::uint8_t, MaxNotes> noteChannel_{};
+    std::array<std::uint8_t, MaxNotes> noteNumber_{};
+    std::array<std::int32_t, MaxNotes> noteTime_{};
+
+    // Driver-wide state, shared by all sequences in AIL.
+    std::array<std::array<std::uint8_t, ChannelCount>, LoggedControllers.size()> globalControls_{};
+    std::array<std::uint8_t, ChannelCount> globalProgram_{};
+    std::array<std::uint8_t, ChannelCount> globalPitchLow_{};
+    std::array<std::uint8_t, ChannelCount> globalPitchHigh_{};
+    std::array<std::uint32_t, ChannelCount> activeNotes_{};
+    std::array<std::uint8_t, ChannelCount> lockStatus_{};
+};
+
+// Runs one sequence through sequencer until End of Track or maxTicks
+// intervals, and returns the trace.
+inline std::vector<trace_event> trace_sequence(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                               std::uint32_t maxTicks, const sequencer_options& options = {})
+{
+    sequencer engine(xmi, sequenceIndex, options);
+    engine.run_until(maxTicks);
+    return engine.take_trace();
+}
+
+inline std::vector<std::uint8_t> convert(std::span<const std::uint8_t> xmi)
+{
+    return convert(xmi, 0);
+}
+
+inline result<std::vector<std::vector<std::uint8_t>>> try_convert_all(std::span<const std::uint8_t> xmi)
+{
+    const result<std::size_t> count = detail::walk_sequence_count(xmi);
+    if (!count)
+    {
+        return std::unexpected(count.error());
+    }
+
+    std::vector<std::vector<std::uint8_t>> midis;
+    midis.reserve(*count);
+    for (std::size_t index = 0; index < *count; ++index)
+    {
+        result<std::vector<std::uint8_t>> midi = try_convert(xmi, index);
+        if (!midi)
+        {
+            return std::unexpected(midi.error());
+        }
+        midis.push_back(std::move(*midi));
+    }
+
+    return midis;
+}
+
+inline std::vector<std::vector<std::uint8_t>> convert_all(std::span<const std::uint8_t> xmi)
+{
+    return detail::value_or_fail(try_convert_all(xmi));
+}
+
+struct encode_options
+{
+    std::uint32_t quantization = 120;
+    bool write_timb = true;
+    bool write_rbrn = true;
+};
+
+namespace detail
+{
+struct midi_track
+{
+    const std::uint8_t* cursor = nullptr;
+    const std::uint8_t* end = nullptr;
+    std::uint32_t pending_delta = 0;
+    std::uint8_t status = 0;
+    bool active = false;
+};
+
+struct encode_scratch
+{
+    struct active_note
+    {
+        std::size_t placeholder = 0;
+        std::uint32_t start = 0;
+        std::uint8_t channel = 0xFF;
+        std::uint8_t note = 0;
+    };
+
+    struct duration_expansion
+    {
+        std::size_t placeholder = 0;
+        std::uint32_t duration = 0;
+    };
+
+    struct branch_entry
+    {
+        std::uint8_t marker = 0;
+        std::size_t offset = 0;
+    };
+
+    std::vector<midi_track> tracks;
+    std::vector<std::uint8_t> events;
+    std::vector<duration_expansion> expansions;
+    std::vector<branch_entry> branches;
+    std::vector<std::array<std::uint8_t, 2>> timbres;
+};
+
+inline void need_midi_bytes(const std::uint8_t* cursor, const std::uint8_t* end, std::size_t count,
+                            std::string_view context)
+{
+    if (cursor > end || count > static_cast<std::size_t>(end - cursor))
+    {
+        detail::fail("Invalid MIDI: truncated " + std::string(context));
+    }
+}
+
+inline bool has_tag_nocase(const std::uint8_t* cursor, const std::uint8_t* end, std::string_view tag)
+{
+    if (cursor > end || tag.size() > static_cast<std::size_t>(end - cursor))
+    {
+        return false;
+    }
+
+    for (std::size_t i = 0; i < tag.size(); ++i)
+    {
+        const std::uint8_t byte = cursor[i];
+        const std::uint8_t lower = (byte >= 'A' && byte <= 'Z') ? static_cast<std::uint8_t>(byte + 32) : byte;
+        const char expected = tag[i];
+        const char expectedLower = (expected >= 'A' && expected <= 'Z') ? static_cast<char>(expected + 32) : expected;
+        if (lower != static_cast<std::uint8_t>(expectedLower))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline std::uint32_t read_midi_varlen(const std::uint8_t*& cursor, const std::uint8_t* end)
+{
+    std::uint32_t value = 0;
+    for (int byteCount = 0; byteCount < 4; ++byteCount)
+    {
+        need_midi_bytes(cursor, end, 1, "variable-length integer");
+        const std::uint8_t byte = *cursor++;
+        value = (value << 7) | (byte & 0x7F);
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+    detail::fail("Invalid MIDI: variable-length integer is too large");
+}
+
+inline void append_le16(std::vector<std::uint8_t>& bytes, std::uint16_t value)
+{
+    bytes.push_back(static_cast<std::uint8_t>(value));
+    bytes.push_back(static_cast<std::uint8_t>(value >> 8));
+}
+
+inline void append_le32(std::vector<std::uint8_t>& bytes, std::uint32_t value)
+{
+    bytes.push_back(static_cast<std::uint8_t>(value));
+    bytes.push_back(static_cast<std::uint8_t>(value >> 8));
+    bytes.push_back(static_cast<std::uint8_t>(value >> 16));
+    bytes.push_back(static_cast<std::uint8_t>(value >> 24));
+}
+
+inline std::uint32_t checked_chunk_length(std::size_t length)
+{
+    if (length > std::numeric_limits<std::uint32_t>::max())
+    {
+        detail::fail("XMI chunk is too large");
+    }
+    return static_cast<std::uint32_t>(length);
+}
+
+// Compiles one Standard MIDI file into a FORM XMID chunk following MIDIFORM.C:
+// tracks are merged by pending delta, time is quantized with the same DDA,
+// Note Offs are folded into Note On durations, and RBRN/TIMB are collected
+// while the EVNT stream is written.
+inline void encode_form_xmid(std::span<const std::uint8_t> midi, const encode_options& options,
+                             encode_scratch& scratch, std::vector<std::uint8_t>& out)
+{
+    constexpr std::size_t MaxActiveNotes = 32;
+    constexpr std::size_t ChannelCount = 16;
+    constexpr std::uint8_t DrumChannel = 9;
+    constexpr std::uint8_t DrumBank = 127;
+    constexpr std::uint8_t PatchBankController = 114;
+    constexpr std::uint64_t QuantizationUnitsPerSecond = 100'000'000;
+
+    if (options.quantization == 0 || options.quantization > QuantizationUnitsPerSecond)
+    {
+        detail::fail("Invalid quantization rate " + std::to_string(options.quantization));
+    }
+
+    const std::uint8_t* const begin = midi.data();
+    const std::uint8_t* const end = begin + midi.size();
+
+    const std::uint8_t* header = begin;
+    while (header < end && !has_tag_nocase(header, end, "MThd"))
+    {
+        ++header;
+    }
+    need_midi_bytes(header, end, 14, "MThd header");
+
+    const std::uint8_t* cursor = header + 4;
+    const std::uint32_t headerLength = read_be32(cursor, end);
+    const std::uint16_t trackCount = static_cast<std::uint16_t>((cursor[2] << 8) | cursor[3]);
+    const std::uint16_t division = static_cast<std::uint16_t>((cursor[4] << 8) | cursor[5]);
+    if (trackCount == 0)
+    {
+        detail::fail("Invalid MIDI: no tracks");
+    }
+    if (division == 0 || (division & 0x8000U) != 0)
+    {
+        detail::fail("Invalid MIDI: unsupported time division");
+    }
+    cursor = chunk_payload_end(cursor, end, headerLength, "MThd header");
+
+    auto& tracks = scratch.tracks;
+    tracks.clear();
+    while (tracks.size() < trackCount)
+    {
+        need_midi_bytes(cursor, end, 8, "MTrk chunk header");
+        const bool isTrack = has_tag_nocase(cursor, end, "MTrk");
+        cursor += 4;
+        const std::uint32_t chunkLength = read_be32(cursor, end);
+        need_midi_bytes(cursor, end, chunkLength, "MTrk chunk");
+
+        if (isTrack)
+        {
+            midi_track track{};
+            track.cursor = cursor;
+            track.end = cursor + chunkLength;
+            track.active = track.cursor < track.end;
+            if (track.active)
+            {
+                track.pending_delta = read_midi_varlen(track.cursor, track.end);
+            }
+            tracks.push_back(track);
+        }
+        cursor += chunkLength;
+    }
+
+    const std::uint64_t quantumLength = QuantizationUnitsPerSecond / options.quantization;
+    std::uint64_t tickLength = 50'000'000U / division;
+    std::uint64_t ddaSum = 0;
+    std::uint32_t interval = 0;
+    std::uint32_t pendingDelay = 0;
+
+    auto& events = scratch.events;
+    auto& expansions = scratch.expansions;
+    auto& branches = scratch.branches;
+    auto& timbres = scratch.timbres;
+    events.clear();
+    expansions.clear();
+    branches.clear();
+    timbres.clear();
+
+    std::array<encode_scratch::active_note, MaxActiveNotes> notes{};
+    std::array<std::uint8_t, ChannelCount> timbreBank{};
+    std::array<std::uint64_t, 128 * 128 / 64> timbreSeen{};
+    std::array<bool, 128> branchSeen{};
+    std::size_t extraDurationBytes = 0;
+
+    auto log_timbre = [&](std::uint8_t bank, std::uint8_t patch)
+    {
+        const std::size_t bit = (static_cast<std::size_t>(bank & 0x7F) << 7) | (patch & 0x7F);
+        std::uint64_t& word = timbreSeen[bit >> 6];
+        const std::uint64_t mask = std::uint64_t{1} << (bit & 63);
+        if ((word & mask) == 0)
+        {
+            word |= mask;
+            timbres.push_back({patch, bank});
+        }
+    };
+
+    auto write_interval = [&]
+    {
+        while (pendingDelay > 127)
+        {
+            events.push_back(0x7F);
+            pendingDelay -= 127;
+        }
+        if (pendingDelay != 0)
+        {
+            events.push_back(static_cast<std::uint8_t>(pendingDelay));
+        }
+        pendingDelay = 0;
+    };
+
+    std::size_t eventTrack = trackCount - 1;
+    for (;;)
+    {
+        // Ties go to the first track after the previous event's track, which
+        // is the order MIDIFORM's backwards "<=" scan produces.
+        std::size_t chosen = trackCount;
+        std::uint32_t minDelta = std::numeric_limits<std::uint32_t>::max();
+        auto consider = [&](std::size_t first, std::size_t last)
+        {
+            for (std::size_t trackIndex = first; trackIndex < last; ++trackIndex)
+            {
+                if (tracks[trackIndex].active && tracks[trackIndex].pending_delta < minDelta)
+                {
+                    minDelta = tracks[trackIndex].pending_delta;
+                    chosen = trackIndex;
+                }
+            }
+        };
+        consider(eventTrack + 1, trackCount);
+        consider(0, eventTrack + 1);
+
+        if (chosen == trackCount)
+        {
+            break;
+        }
+
+        eventTrack = chosen;
+        if (minDelta != 0)
+        {
+            for (midi_track& track : tracks)
+            {
+                if (track.active)
+                {
+                    track.pending_delta -= minDelta;
+                }
+            }
+        }
+
+        midi_track& track = tracks[chosen];
+        need_midi_bytes(track.cursor, track.end, 1, "track event");
+        if (*track.cursor >= 0x80)
+        {
+            track.status = *track.cursor++;
+        }
+        if (track.status < 0x80)
+        {
+            detail::fail("Invalid MIDI: data byte without running status");
+        }
+
+        // MIDIFORM reads the event, including any tempo change, before it
+        // quantizes the delta that precedes it.
+        const std::uint8_t status = track.status;
+        const std::uint8_t channel = status & 0x0F;
+        std::uint8_t data1 = 0;
+        std::uint8_t data2 = 0;
+        std::uint8_t metaType = 0;
+        const std::uint8_t* payload = nullptr;
+        std::uint32_t payloadLength = 0;
+
+        switch (status & 0xF0)
+        {
+        case 0x80:
+        case 0x90:
+        case 0xA0:
+        case 0xB0:
+        case 0xE0:
+            need_midi_bytes(track.cursor, track.end, 2, "channel event");
+            data1 = track.cursor[0];
+            data2 = track.cursor[1];
+            track.cursor += 2;
+            break;
+        case 0xC0:
+        case 0xD0:
+            need_midi_bytes(track.cursor, track.end, 1, "channel event");
+            data1 = *track.cursor++;
+            break;
+        default:
+            if (status == 0xFF)
+            {
+                need_midi_bytes(track.cursor, track.end, 1, "meta event");
+                metaType = *track.cursor++;
+            }
+            else if (status != 0xF0 && status != 0xF7)
+            {
+                detail::fail("Invalid MIDI: illegal status byte");
+            }
+
+            payloadLength = read_midi_varlen(track.cursor, track.end);
+            need_midi_bytes(track.cursor, track.end, payloadLength, "meta or SysEx payload");
+            payload = track.cursor;
+            track.cursor += payloadLength;
+
+            if (status == 0xFF && metaType == 0x2F)
+            {
+                track.active = false;
+            }
+            else if (status == 0xFF && metaType == 0x51 && payloadLength >= 3)
+            {
+                const std::uint64_t tempo = (static_cast<std::uint64_t>(payload[0]) << 16) |
+                                            (static_cast<std::uint64_t>(payload[1]) << 8) | payload[2];
+                tickLength = (100U * tempo) / division;
+            }
+            break;
+        }
+
+        if (track.active)
+        {
+            if (track.cursor < track.end)
+            {
+                track.pending_delta = read_midi_varlen(track.cursor, track.end);
+            }
+            else
+            {
+                track.active = false;
+            }
+        }
+
+        ddaSum += static_cast<std::uint64_t>(minDelta) * tickLength;
+        if (ddaSum >= quantumLength)
+        {
+            const std::uint64_t quanta = ddaSum / quantumLength;
+            ddaSum -= quanta * quantumLength;
+            if (quanta > std::numeric_limits<std::uint32_t>::max() - interval)
+            {
+                detail::fail("Invalid MIDI: sequence is too long");
+            }
+            interval += static_cast<std::uint32_t>(quanta);
+            pendingDelay += static_cast<std::uint32_t>(quanta);
+        }
+
+        const std::uint8_t kind = status & 0xF0;
+        if (kind == 0x90 && data2 != 0)
+        {
+            if (channel == DrumChannel)
+            {
+                log_timbre(DrumBank, data1);
+            }
+
+            auto slot = std::find_if(notes.begin(), notes.end(), [](const encode_scratch::active_note& note)
+            {
+                return note.channel == 0xFF;
+            });
+            if (slot == notes.end())
+            {
+                detail::fail("Invalid MIDI: more than " + std::to_string(MaxActiveNotes) +
+                                         " simultaneous notes");
+            }
+
+            write_interval();
+            events.insert(events.end(), {status, data1, data2, 0x00});
+            *slot = encode_scratch::active_note{events.size() - 1, interval, channel, data1};
+        }
+        else if (kind == 0x80 || kind == 0x90)
+        {
+            for (encode_scratch::active_note& note : notes)
+            {
+                if (note.channel != channel || note.note != data1)
+                {
+                    continue;
+                }
+
+                const std::uint32_t duration = interval - note.start;
+                if (duration < 0x80)
+                {
+                    events[note.placeholder] = static_cast<std::uint8_t>(duration);
+                }
+                else
+                {
+                    expansions.push_back({note.placeholder, duration});
+                    extraDurationBytes += varlen_size(duration) - 1;
+                }
+                note.channel = 0xFF;
+            }
+        }
+        else if (kind == 0xB0 || kind == 0xC0 || kind == 0xA0 || kind == 0xD0 || kind == 0xE0)
+        {
+            if (kind == 0xB0 && data1 == BranchController)
+            {
+                if (branchSeen[data2 & 0x7F])
+                {
+                    detail::fail("Invalid MIDI: duplicate branch point controller " +
+                                             std::to_string(data2));
+                }
+                branchSeen[data2 & 0x7F] = true;
+                branches.push_back({data2, events.size()});
+            }
+            else if (kind == 0xB0 && data1 == PatchBankController)
+            {
+                timbreBank[channel] = data2;
+            }
+            else if (kind == 0xC0)
+            {
+                log_timbre(timbreBank[channel], data1);
+            }
+
+            write_interval();
+            events.push_back(status);
+            events.push_back(data1);
+            if (kind != 0xC0 && kind != 0xD0)
+            {
+                events.push_back(data2);
+            }
+        }
+        else if (status != 0xFF || (metaType != 0x2F && metaType != 0x03 && metaType != 0x04))
+        {
+            write_interval();
+            events.push_back(status);
+            if (status == 0xFF)
+            {
+                events.push_back(metaType);
+            }
+            append_varlen(events, payloadLength);
+            events.insert(events.end(), payload, payload + payloadLength);
+        }
+    }
+
+    write_interval();
+    events.insert(events.end(), {0xFF, 0x2F, 0x00});
+
+    for (const encode_scratch::active_note& note : notes)
+    {
+        if (note.channel != 0xFF)
+        {
+            detail::fail("Invalid MIDI: unpaired note-on event");
+        }
+    }
+
+    std::sort(expansions.begin(), expansions.end(),
+              [](const encode_scratch::duration_expansion& left, const encode_scratch::duration_expansion& right)
+    {
+        return left.placeholder < right.placeholder;
+    });
+
+    // Branch offsets were logged against one-byte duration placeholders; shift
+    // each one past the extra bytes of every wider duration that precedes it.
+    std::size_t shift = 0;
+    std::size_t expansion = 0;
+    for (encode_scratch::branch_entry& branch : branches)
+    {
+        while (expansion < expansions.size() && expansions[expansion].placeholder < branch.offset)
+        {
+            shift += varlen_size(expansions[expansion].duration) - 1;
+            ++expansion;
+        }
+        branch.offset += shift;
+    }
+
+    const std::size_t formStart = out.size();
+    append_tag(out, "FORM");
+    append_be32(out, 0);
+    append_tag(out, "XMID");
+
+    if (options.write_timb && !timbres.empty())
+    {
+        append_tag(out, "TIMB");
+        append_be32(out, checked_chunk_length(2 + (timbres.size() * 2)));
+        append_le16(out, static_cast<std::uint16_t>(timbres.size()));
+        for (const auto& timbre : timbres)
+        {
+            out.push_back(timbre[0]);
+            out.push_back(timbre[1]);
+        }
+    }
+
+    if (options.write_rbrn && !branches.empty())
+    {
+        append_tag(out, "RBRN");
+        append_be32(out, checked_chunk_length(2 + (branches.size() * 6)));
+        append_le16(out, static_cast<std::uint16_t>(branches.size()));
+        for (const encode_scratch::branch_entry& branch : branches)
+        {
+            append_le16(out, branch.marker);
+            append_le32(out, checked_chunk_length(branch.offset));
+        }
+    }
+
+    const std::size_t eventLength = events.size() + extraDurationBytes;
+    append_tag(out, "EVNT");
+    append_be32(out, checked_chunk_length(eventLength + (eventLength & 1U)));
+
+    const std::size_t eventStart = out.size();
+    out.resize(eventStart + eventLength);
+    std::uint8_t* write = out.data() + eventStart;
+    std::size_t copied = 0;
+    for (const encode_scratch::duration_expansion& wide : expansions)
+    {
+        write = std::copy(events.begin() + static_cast<std::ptrdiff_t>(copied),
+                          events.begin() + static_cast<std::ptrdiff_t>(wide.placeholder), write);
+        write = write_varlen(write, wide.duration);
+        copied = wide.placeholder + 1;
+    }
+    std::copy(events.begin() + static_cast<std::ptrdiff_t>(copied), events.end(), write);
+
+    if ((eventLength & 1U) != 0)
+    {
+        out.push_back(0);
+    }
+
+    patch_be32(out, formStart + 4, checked_chunk_length(out.size() - formStart - 8));
+}
+}
+
+namespace detail
+{
+// FORM XDIR with an INFO chunk holding the sequence count, as MIDIFORM writes
+// before the CAT XMID catalog.
+inline void append_directory(std::vector<std::uint8_t>& out, std::size_t sequenceCount)
+{
+    append_tag(out, "FORM");
+    append_be32(out, 14);
+    append_tag(out, "XDIR");
+    append_tag(out, "INFO");
+    append_be32(out, 2);
+    append_le16(out, static_cast<std::uint16_t>(sequenceCount));
+}
+}
+
+inline std::vector<std::uint8_t> encode(std::span<const std::span<const std::uint8_t>> midis,
+                                        const encode_options& options = {})
+{
+    if (midis.empty())
+    {
+        detail::fail("No MIDI sequences to encode");
+    }
+
+    if (midis.size() > std::numeric_limits<std::uint16_t>::max())
+    {
+        detail::fail("Too many MIDI sequences for one XMI catalog");
+    }
+
+    std::size_t inputBytes = 0;
+    for (const auto midi : midis)
+    {
+        inputBytes += midi.size();
+    }
+
+    std::vector<std::uint8_t> xmi;
+    xmi.reserve(inputBytes + 34 + (midis.size() * 64));
+
+    detail::append_directory(xmi, midis.size());
+
+    const std::size_t catalogStart = xmi.size();
+    detail::append_tag(xmi, "CAT ");
+    detail::append_be32(xmi, 0);
+    detail::append_tag(xmi, "XMID");
+
+    detail::encode_scratch scratch;
+    for (const auto midi : midis)
+    {
+        detail::encode_form_xmid(midi, options, scratch, xmi);
+    }
+
+    detail::patch_be32(xmi, catalogStart + 4, detail::checked_chunk_length(xmi.size() - catalogStart - 8));
+    return xmi;
+}
+
+inline std::vector<std::uint8_t> encode(std::span<const std::uint8_t> midi, const encode_options& options = {})
+{
+    const std::span<const std::uint8_t> midis[] = {midi};
+    return encode(std::span<const std::span<const std::uint8_t>>{midis}, options);
+}
+
+// Bytes that go before FORM XMID chunks of the given sizes to make them a
+// MIDIFORM catalog: FORM XDIR with the INFO count, then the CAT XMID header.
+// The chunks follow unchanged, each odd-sized one followed by a zero pad byte.
+inline std::vector<std::uint8_t> catalog_header(std::span<const std::size_t> formSizes)
+{
+    if (formSizes.empty())
+    {
+        detail::fail("No sequences for the XMI catalog");
+    }
+    if (formSizes.size() > std::numeric_limits<std::uint16_t>::max())
+    {
+        detail::fail("Too many sequences for one XMI catalog");
+    }
+
+    std::size_t catalogLength = 4;
+    for (const std::size_t size : formSizes)
+    {
+        catalogLength += size + (size & 1);
+    }
+
+    std::vector<std::uint8_t> header;
+    header.reserve(34);
+    detail::append_directory(header, formSizes.size());
+    detail::append_tag(header, "CAT ");
+    detail::append_be32(header, detail::checked_chunk_length(catalogLength));
+    detail::append_tag(header, "XMID");
+    return header;
+}
+
+// Joins FORM XMID chunks, copied byte for byte, into one catalog. Events are
+// never decoded.
+inline std::vector<std::uint8_t> splice_forms(std::span<const std::span<const std::uint8_t>> forms)
+{
+    std::vector<std::size_t> sizes;
+    sizes.reserve(forms.size());
+    for (const auto form : forms)
+    {
+        sizes.push_back(form.size());
+    }
+
+    std::vector<std::uint8_t> xmi = catalog_header(sizes);
+    for (const auto form : forms)
+    {
+        xmi.insert(xmi.end(), form.begin(), form.end());
+        if ((form.size() & 1) != 0)
+        {
+            xmi.push_back(0);
+        }
+    }
+    return xmi;
+}
+
+// One sequence of a catalog as a standalone XMI file.
+inline std::vector<std::uint8_t> extract_sequence(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex)
+{
+    const sequence_info sequence = detail::find_sequence(xmi, sequenceIndex);
+    const std::span<const std::uint8_t> forms[] = {xmi.subspan(sequence.form_offset, sequence.form_size)};
+    return splice_forms(forms);
+}
+
+// Every sequence of every input, in order, as one catalog.
+inline std::vector<std::uint8_t> merge_catalogs(std::span<const std::span<const std::uint8_t>> xmis)
+{
+    std::vector<std::span<const std::uint8_t>> forms;
+    for (const auto xmi : xmis)
+    {
+        for (const sequence_info& sequence : sequences(xmi))
+        {
+            forms.push_back(xmi.subspan(sequence.form_offset, sequence.form_size));
+        }
+    }
+    return splice_forms(forms);
+}
+
+// One entry of an AIL Global Timbre Library (SAMPLE.AD, SAMPLE.OPL). 'data'
+// starts at the timbre's 16-bit length word, which counts itself.
+struct global_timbre
+{
+    std::uint8_t patch = 0;
+    std::uint8_t bank = 0;
+    std::span<const std::uint8_t> data;
+};
+
+// Reads a GTL directory: {patch, bank, 32-bit offset} entries ending at bank
+// 0xFF, each offset pointing at a length-prefixed timbre.
+inline std::vector<global_timbre> global_timbres(std::span<const std::uint8_t> gtl)
+{
+    std::vector<global_timbre> library;
+    for (std::size_t entry = 0;; entry += 6)
+    {
+        if (entry + 2 > gtl.size())
+        {
+            detail::fail("Invalid GTL: directory has no end marker");
+        }
+        if (gtl[entry + 1] == 0xFF)
+        {
+            return library;
+        }
+        if (entry + 6 > gtl.size())
+        {
+            detail::fail("Invalid GTL: truncated directory entry");
+        }
+
+        const std::size_t offset = static_cast<std::size_t>(gtl[entry + 2]) |
+                                   (static_cast<std::size_t>(gtl[entry + 3]) << 8) |
+                                   (static_cast<std::size_t>(gtl[entry + 4]) << 16) |
+                                   (static_cast<std::size_t>(gtl[entry + 5]) << 24);
+        if (offset > gtl.size() || gtl.size() - offset < 2)
+        {
+            detail::fail("Invalid GTL: timbre offset is outside the file");
+        }
+        const std::size_t length = gtl[offset] | (static_cast<std::size_t>(gtl[offset + 1]) << 8);
+        if (length < 2 || length > gtl.size() - offset)
+        {
+            detail::fail("Invalid GTL: timbre length is outside the file");
+        }
+        library.push_back({gtl[entry], gtl[entry + 1], gtl.subspan(offset, length)});
+    }
+}
+
+enum class opl_chip_type : std::uint8_t
+{
+    opl2, // YM3812: 9 two-operator voices, mono
+    opl3  // YMF262: 18 voices, 6 of them pairable into four-operator voices, stereo
+};
+
+struct opl_render_options
+{
+    opl_chip_type chip = opl_chip_type::opl2;
+    std::uint32_t sample_rate = 44100;
+    // Rendering stops here if the sequence has not ended, e.g. when it loops
+    // forever.
+    std::uint32_t max_ticks = 120 * 60 * 10;
+    // Intervals rendered after End of Track while voices are still sounding.
+    std::uint32_t tail_ticks = 240;
+};
+
+namespace detail
+{
+// Register-level YM3812/YMF262 FM synthesizer at the chip's native rate. The
+// operator state is kept as arrays indexed by role * 18 + channel (role 0 is
+// the first, or modulator, operator), so that each stage of a sample runs as
+// one loop over every voice.
+class opl_chip
+{
+public:
+    static constexpr std::uint32_t NativeRate = 49716;
+    static constexpr std::size_t ChannelCount = 18;
+    static constexpr std::size_t OperatorCount = ChannelCount * 2;
+
+    explicit opl_chip(bool opl3) : opl3_(opl3)
+    {
+        const tables& lookup = shared_tables();
+        logSin_ = lookup.logSin.data();
+        exp_ = lookup.exp.data();
+        env_.fill(MaxAttenuation);
+        level_.fill(MaxAttenuation);
+        egState_.fill(Off);
+        left_.fill(1);
+        right_.fill(1);
+    }
+
+    void write(std::uint16_t reg, std::uint8_t value)
+    {
+        const std::size_t array = (reg >> 8) & 1;
+        const std::uint8_t address = reg & 0xFF;
+        if (array != 0 && !opl3_)
+        {
+            return;
+        }
+
+        if (array != 0 && address == 0x05)
+        {
+            newMode_ = (value & 1) != 0;
+            update_four_op();
+            return;
+        }
+        if (array != 0 && address == 0x04)
+        {
+            fourOpMask_ = value & 0x3F;
+            update_four_op();
+            return;
+        }
+        if (array == 0 && address == 0x01)
+        {
+            waveSelect_ = (value & 0x20) != 0;
+            return;
+        }
+        if (array == 0 && address == 0xBD)
+        {
+            tremoloShift_ = (value & 0x80) != 0 ? 2 : 4;
+            vibratoShift_ = (value & 0x40) != 0 ? 0 : 1;
+            return;
+        }
+
+        switch (address & 0xE0)
+        {
+        case 0x20:
+        case 0x40:
+        case 0x60:
+        case 0x80:
+        case 0xE0:
+            write_operator(array, address, value);
+            break;
+        case 0xA0:
+        case 0xC0:
+            write_channel(array, address, value);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Appends 'count' stereo frames (left, right) at NativeRate.
+    void generate(std::int16_t* frames, std::size_t count)
+    {
+        const std::size_t channels = opl3_ ? ChannelCount : ChannelCount / 2;
+        for (std::size_t frame = 0; frame < count; ++frame)
+        {
+            advance_lfo();
+
+            for (std::size_t op = 0; op < OperatorCount; ++op)
+            {
+                if (egState_[op] != Off)
+                {
+                    advance_envelope(op);
+                }
+            }
+            // The remaining per-operator stages have no branches or lookups.
+            for (std::size_t op = 0; op < OperatorCount; ++op)
+            {
+                const std::int32_t total = env_[op] + baseLevel_[op] + (tremolo_ & amMask_[op]);
+                level_[op] = std::min(total, MaxAttenuation);
+            }
+            for (std::size_t op = 0; op < OperatorCount; ++op)
+            {
+                phase_[op] += increment_[op];
+            }
+
+            std::int32_t left = 0;
+            std::int32_t right = 0;
+            for (std::size_t channel = 0; channel < channels; ++channel)
+            {
+                if (fourOpRole_[channel] == FourOpSecond || !audible(channel))
+                {
+                    continue;
+                }
+                const std::int32_t sample =
+                    fourOpRole_[channel] == FourOpFirst ? four_op_output(channel) : two_op_output(channel);
+                left += left_[channel] * sample;
+                right += right_[channel] * sample;
+            }
+            frames[frame * 2] = static_cast<std::int16_t>(std::clamp(left, -32768, 32767));
+            frames[frame * 2 + 1] = static_cast<std::int16_t>(std::clamp(right, -32768, 32767));
+        }
+    }
+
+    // True once every envelope has finished its release.
+    bool silent() const
+    {
+        return std::all_of(egState_.begin(), egState_.end(), [](std::uint8_t state) { return state == Off; });
+    }
+
+private:
+    static constexpr std::int32_t MaxAttenuation = 511;
+    static constexpr std::uint8_t Attack = 0;
+    static constexpr std::uint8_t Decay = 1;
+    static constexpr std::uint8_t Sustain = 2;
+    static constexpr std::uint8_t Release = 3;
+    static constexpr std::uint8_t Off = 4;
+
+    static constexpr std::uint8_t TwoOp = 0;
+    static constexpr std::uint8_t FourOpFirst = 1;
+    static constexpr std::uint8_t FourOpSecond = 2;
+
+    // Frequency multiplier times two.
+    static constexpr std::array<std::uint8_t, 16> Multiplier = {1,  2,  4,  6,  8,  10, 12, 14,
+                                                                16, 18, 20, 20, 24, 24, 30, 30};
+    static constexpr std::array<std::uint8_t, 16> KeyScaleRom = {0,  32, 40, 45, 48, 51, 53, 55,
+                                                                 56, 58, 59, 60, 61, 62, 63, 64};
+    static constexpr std::array<std::uint8_t, 4> KeyScaleShift = {8, 1, 2, 0};
+
+    struct tables
+    {
+        std::array<std::uint16_t, 256> logSin{};
+        std::array<std::uint16_t, 256> exp{};
+    };
+
+    // The chip's quarter-wave log-sine and exponent ROMs.
+    static const tables& shared_tables()
+    {
+        static const tables lookup = []
+        {
+            tables built;
+            for (std::size_t i = 0; i < 256; ++i)
+            {
+                const double angle = (static_cast<double>(i) + 0.5) * std::numbers::pi / 512.0;
+                built.logSin[i] = static_cast<std::uint16_t>(std::lround(-std::log2(std::sin(angle)) * 256.0));
+                built.exp[i] = static_cast<std::uint16_t>(
+                    std::lround(1024.0 * std::exp2((255.0 - static_cast<double>(i)) / 256.0)));
+            }
+            return built;
+        }();
+        return lookup;
+    }
+
+    static std::size_t operator_index(std::size_t array, std::uint8_t address, bool& valid)
+    {
+        const std::size_t offset = address & 0x1F;
+        const std::size_t cell = offset & 7;
+        valid = cell < 6 && offset < 0x16;
+        const std::size_t channel = (offset >> 3) * 3 + cell % 3 + array * 9;
+        return (cell / 3) * ChannelCount + channel;
+    }
+
+    void write_operator(std::size_t array, std::uint8_t address, std::uint8_t value)
+    {
+        bool valid = false;
+        const std::size_t op = operator_index(array, address, valid);
+        if (!valid)
+        {
+            return;
+        }
+
+        switch (address & 0xE0)
+        {
+        case 0x20:
+            amMask_[op] = (value & 0x80) != 0 ? -1 : 0;
+            vibrato_[op] = (value & 0x40) != 0;
+            sustained_[op] = (value & 0x20) != 0;
+            keyScaleRate_[op] = (value & 0x10) != 0;
+            multiple_[op] = value & 0x0F;
+            break;
+        case 0x40:
+            keyScaleLevel_[op] = value >> 6;
+            totalLevel_[op] = value & 0x3F;
+            break;
+        case 0x60:
+            attackRate_[op] = value >> 4;
+            decayRate_[op] = value & 0x0F;
+            break;
+        case 0x80:
+            sustainLevel_[op] = static_cast<std::int16_t>((value >> 4) == 15 ? 31 * 16 : (value >> 4) * 16);
+            releaseRate_[op] = value & 0x0F;
+            break;
+        default:
+            waveform_[op] = value & 7;
+            return;
+        }
+        update_operator(op);
+    }
+
+    void write_channel(std::size_t array, std::uint8_t address, std::uint8_t value)
+    {
+        const std::size_t index = address & 0x0F;
+        if (index > 8)
+        {
+            return;
+        }
+        const std::size_t channel = index + array * 9;
+
+        if ((address & 0xF0) == 0xC0)
+        {
+            feedback_[channel] = (value >> 1) & 7;
+            additive_[channel] = value & 1;
+            if (opl3_ && newMode_)
+            {
+                left_[channel] = (value & 0x10) != 0 ? 1 : 0;
+                right_[channel] = (value & 0x20) != 0 ? 1 : 0;
+            }
+            return;
+        }
+
+        if (fourOpRole_[channel] == FourOpSecond)
+        {
+            return;
+        }
+        if ((address & 0xF0) == 0xA0)
+        {
+            frequency_[channel] = static_cast<std::uint16_t>((frequency_[channel] & 0x300) | value);
+        }
+        else
+        {
+            frequency_[channel] = static_cast<std::uint16_t>((frequency_[channel] & 0xFF) | ((value & 3) << 8));
+            block_[channel] = (value >> 2) & 7;
+            key_channel(channel, (value & 0x20) != 0);
+        }
+        update_channel(channel);
+    }
+
+    // Pairs channel n with n + 3 for the Connection Select bits set in OPL3
+    // mode.
+    void update_four_op()
+    {
+        fourOpRole_.fill(TwoOp);
+        for (std::size_t bit = 0; bit < 6; ++bit)
+        {
+            if (newMode_ && (fourOpMask_ >> bit & 1) != 0)
+            {
+                const std::size_t first = (bit % 3) + (bit / 3) * 9;
+                fourOpRole_[first] = FourOpFirst;
+                fourOpRole_[first + 3] = FourOpSecond;
+            }
+        }
+        for (std::size_t op = 0; op < OperatorCount; ++op)
+        {
+            update_operator(op);
+        }
+    }
+
+    void key_channel(std::size_t channel, bool on)
+    {
+        key_operator(channel, on);
+        key_operator(ChannelCount + channel, on);
+        if (fourOpRole_[channel] == FourOpFirst)
+        {
+            key_operator(channel + 3, on);
+            key_operator(ChannelCount + channel + 3, on);
+        }
+    }
+
+    void key_operator(std::size_t op, bool on)
+    {
+        if (on && (egState_[op] == Release || egState_[op] == Off))
+        {
+            phase_[op] = 0;
+            egState_[op] = Attack;
+            egCounter_[op] = 0;
+        }
+        else if (!on && egState_[op] != Off)
+        {
+            egState_[op] = Release;
+        }
+    }
+
+    void update_channel(std::size_t channel)
+    {
+        for (std::size_t op = channel; op < OperatorCount; op += ChannelCount)
+        {
+            update_operator(op);
+            if (fourOpRole_[channel] == FourOpFirst)
+            {
+                update_operator(op + 3);
+            }
+        }
+    }
+
+    std::size_t frequency_channel(std::size_t op) const
+    {
+        const std::size_t channel = op % ChannelCount;
+        return fourOpRole_[channel] == FourOpSecond ? channel - 3 : channel;
+    }
+
+    // Envelope steps per sample in 16.16 fixed point for a 4-bit rate.
+    static std::uint32_t rate_step(std::uint8_t rate, std::uint8_t keyScale)
+    {
+        if (rate == 0)
+        {
+            return 0;
+        }
+        const std::uint32_t effective = std::min<std::uint32_t>(rate * 4u + keyScale, 63);
+        const std::uint32_t shift = effective >> 2;
+        const std::uint32_t mantissa = 4 + (effective & 3);
+        if (shift == 15)
+        {
+            return 8u << 16;
+        }
+        return shift < 12 ? mantissa << (shift + 1) : mantissa << (shift + 2);
+    }
+
+    void update_operator(std::size_t op)
+    {
+        const std::size_t channel = frequency_channel(op);
+        const std::uint32_t frequency = frequency_[channel];
+        const std::uint32_t block = block_[channel];
+
+        const std::uint8_t keyScale = static_cast<std::uint8_t>((block << 1) | ((frequency >> 9) & 1));
+        const std::uint8_t rateScale = keyScaleRate_[op] ? keyScale : keyScale >> 2;
+        attackInstant_[op] = attackRate_[op] != 0 && attackRate_[op] * 4 + rateScale >= 60;
+        attackStep_[op] = rate_step(attackRate_[op], rateScale);
+        decayStep_[op] = rate_step(decayRate_[op], rateScale);
+        releaseStep_[op] = rate_step(releaseRate_[op], rateScale);
+
+        const std::int32_t keyLevel =
+            std::max(0, (KeyScaleRom[frequency >> 6] << 2) - ((8 - static_cast<std::int32_t>(block)) << 5));
+        baseLevel_[op] = static_cast<std::int32_t>(totalLevel_[op] << 2) +
+                         (keyLevel >> KeyScaleShift[keyScaleLevel_[op]]);
+        update_increment(op);
+    }
+
+    void update_increment(std::size_t op)
+    {
+        const std::size_t channel = frequency_channel(op);
+        std::int32_t frequency = frequency_[channel];
+        if (vibrato_[op])
+        {
+            const std::int32_t range = (frequency >> 7) & 7;
+            std::int32_t offset = (vibratoPosition_ & 3) == 0 ? 0
+                                  : (vibratoPosition_ & 1) != 0 ? range >> 1
+                                                                : range;
+            offset >>= vibratoShift_;
+            frequency += (vibratoPosition_ & 4) != 0 ? -offset : offset;
+        }
+        const std::uint32_t base = (static_cast<std::uint32_t>(frequency) << block_[channel]) >> 1;
+        increment_[op] = (base * Multiplier[multiple_[op]]) >> 1;
+    }
+
+    void advance_lfo()
+    {
+        ++timer_;
+        if ((timer_ & 63) == 0)
+        {
+            tremoloPosition_ = tremoloPosition_ == 209 ? 0 : tremoloPosition_ + 1;
+            const std::int32_t depth = tremoloPosition_ < 105 ? tremoloPosition_ : 210 - tremoloPosition_;
+            tremolo_ = depth >> tremoloShift_;
+        }
+        if ((timer_ & 1023) == 0)
+        {
+            vibratoPosition_ = (vibratoPosition_ + 1) & 7;
+            for (std::size_t op = 0; op < OperatorCount; ++op)
+            {
+                if (vibrato_[op])
+                {
+                    update_increment(op);
+                }
+            }
+        }
+    }
+
+    std::uint32_t envelope_steps(std::size_t op, std::uint32_t step)
+    {
+        egCounter_[op] += step;
+        const std::uint32_t steps = egCounter_[op] >> 16;
+        egCounter_[op] &= 0xFFFF;
+        return steps;
+    }
+
+    void advance_envelope(std::size_t op)
+    {
+        std::int32_t env = env_[op];
+        switch (egState_[op])
+        {
+        case Attack:
+            if (attackInstant_[op])
+            {
+                env = 0;
+            }
+            else
+            {
+                for (std::uint32_t steps = envelope_steps(op, attackStep_[op]); steps != 0 && env > 0; --steps)
+                {
+                    env += ~env >> 3;
+                }
+            }
+            if (env <= 0)
+            {
+                env = 0;
+                egState_[op] = Decay;
+            }
+            break;
+        case Decay:
+            env += static_cast<std::int32_t>(envelope_steps(op, decayStep_[op]));
+            if (env >= sustainLevel_[op])
+            {
+                egState_[op] = Sustain;
+            }
+            break;
+        case Sustain:
+            if (!sustained_[op])
+            {
+                env += static_cast<std::int32_t>(envelope_steps(op, releaseStep_[op]));
+            }
+            break;
+        default:
+            env += static_cast<std::int32_t>(envelope_steps(op, releaseStep_[op]));
+            if (env >= MaxAttenuation)
+            {
+                egState_[op] = Off;
+            }
+            break;
+        }
+        env_[op] = std::min(env, MaxAttenuation);
+    }
+
+    bool audible(std::size_t channel) const
+    {
+        const bool first = egState_[channel] != Off || egState_[ChannelCount + channel] != Off;
+        if (fourOpRole_[channel] != FourOpFirst)
+        {
+            return first;
+        }
+        return first || egState_[channel + 3] != Off || egState_[ChannelCount + channel + 3] != Off;
+    }
+
+    std::int32_t exp_level(std::uint32_t level) const
+    {
+        level = std::min<std::uint32_t>(level, 0x1FFF);
+        return static_cast<std::int32_t>((exp_[level & 0xFF] << 1) >> (level >> 8));
+    }
+
+    // One operator's output for this sample, phase-modulated by 'modulation'.
+    std::int32_t operator_output(std::size_t op, std::int32_t modulation) const
+    {
+        const std::uint32_t phase = ((phase_[op] >> 9) + static_cast<std::uint32_t>(modulation)) & 0x3FF;
+        const std::uint32_t envelope = static_cast<std::uint32_t>(level_[op]) << 3;
+        const std::uint8_t waveform = opl3_ && newMode_ ? waveform_[op] : waveSelect_ ? waveform_[op] & 3 : 0;
+
+        const std::uint32_t quarter = phase & 0xFF;
+        const std::uint16_t sine = logSin_[(phase & 0x100) != 0 ? quarter ^ 0xFF : quarter];
+        const bool negative = (phase & 0x200) != 0;
+        switch (waveform)
+        {
+        case 0: // sine
+            return negative ? ~exp_level(sine + envelope) : exp_level(sine + envelope);
+        case 1: // half sine
+            return negative ? 0 : exp_level(sine + envelope);
+        case 2: // absolute sine
+            return exp_level(sine + envelope);
+        case 3: // pulse sine
+            return (phase & 0x100) != 0 ? 0 : exp_level(logSin_[quarter] + envelope);
+        case 4: // alternating sine
+        {
+            if (negative)
+            {
+                return 0;
+            }
+            const std::uint32_t doubled = (phase << 1) & 0x3FF;
+            const std::uint32_t index = doubled & 0xFF;
+            const std::uint16_t value = logSin_[(doubled & 0x100) != 0 ? index ^ 0xFF : index];
+            return (doubled & 0x200) != 0 ? ~exp_level(value + envelope) : exp_level(value + envelope);
+        }
+        case 5: // camel sine
+        {
+            if (negative)
+            {
+                return 0;
+            }
+            const std::uint32_t doubled = (phase << 1) & 0x1FF;
+            const std::uint32_t index = doubled & 0xFF;
+            return exp_level(logSin_[(doubled & 0x100) != 0 ? index ^ 0xFF : index] + envelope);
+        }
+        case 6: // square
+            return negative ? ~exp_level(envelope) : exp_level(envelope);
+        default: // derived square
+        {
+            const std::uint32_t ramp = negative ? (phase ^ 0x3FF) << 3 : phase << 3;
+            return negative ? ~exp_level(ramp + envelope) : exp_level(ramp + envelope);
+        }
+        }
+    }
+
+    std::int32_t feedback_input(std::size_t channel) const
+    {
+        const std::uint8_t shift = feedback_[channel];
+        return shift == 0 ? 0 : (previous_[channel] + output_[channel]) >> (9 - shift);
+    }
+
+    // Runs the channel's first operator, which owns the feedback path.
+    std::int32_t first_operator(std::size_t channel)
+    {
+        const std::int32_t value = operator_output(channel, feedback_input(channel));
+        previous_[channel] = output_[channel];
+        output_[channel] = value;
+        return value;
+    }
+
+    std::int32_t two_op_output(std::size_t channel)
+    {
+        const std::int32_t modulator = first_operator(channel);
+        if (additive_[channel] != 0)
+        {
+            return modulator + operator_output(ChannelCount + channel, 0);
+        }
+        return operator_output(ChannelCount + channel, modulator);
+    }
+
+    // The four algorithms selected by the two channels' connection bits.
+    std::int32_t four_op_output(std::size_t channel)
+    {
+        const std::size_t op1 = ChannelCount + channel;
+        const std::size_t op2 = channel + 3;
+        const std::size_t op3 = ChannelCount + channel + 3;
+
+        const std::int32_t out0 = first_operator(channel);
+        switch (additive_[channel] | (additive_[channel + 3] << 1))
+        {
+        case 0:
+        {
+            const std::int32_t out1 = operator_output(op1, out0);
+            return operator_output(op3, operator_output(op2, out1));
+        }
+        case 1:
+        {
+            const std::int32_t out2 = operator_output(op2, operator_output(op1, 0));
+            return out0 + operator_output(op3, out2);
+        }
+        case 2:
+        {
+            const std::int32_t out1 = operator_output(op1, out0);
+            return out1 + operator_output(op3, operator_output(op2, 0));
+        }
+        default:
+        {
+            const std::int32_t out2 = operator_output(op2, operator_output(op1, 0));
+            return out0 + out2 + operator_output(op3, 0);
+        }
+        }
+    }
+
+    bool opl3_ = false;
+    bool newMode_ = false;
+    bool waveSelect_ = false;
+    std::uint8_t fourOpMask_ = 0;
+    std::uint32_t timer_ = 0;
+    std::int32_t tremoloPosition_ = 0;
+    std::int32_t tremolo_ = 0;
+    std::int32_t tremoloShift_ = 4;
+    std::uint32_t vibratoPosition_ = 0;
+    std::int32_t vibratoShift_ = 1;
+    const std::uint16_t* logSin_ = nullptr;
+    const std::uint16_t* exp_ = nullptr;
+
+    std::array<std::uint32_t, OperatorCount> phase_{};
+    std::array<std::uint32_t, OperatorCount> increment_{};
+    std::array<std::int32_t, OperatorCount> env_{};
+    std::array<std::int32_t, OperatorCount> baseLevel_{};
+    std::array<std::int32_t, OperatorCount> level_{};
+    std::array<std::int32_t, OperatorCount> amMask_{};
+    std::array<std::uint32_t, OperatorCount> egCounter_{};
+    std::array<std::uint32_t, OperatorCount> attackStep_{};
+    std::array<std::uint32_t, OperatorCount> decayStep_{};
+    std::array<std::uint32_t, OperatorCount> releaseStep_{};
+    std::array<std::int16_t, OperatorCount> sustainLevel_{};
+    std::array<std::uint8_t, OperatorCount> egState_{};
+    std::array<bool, OperatorCount> attackInstant_{};
+    std::array<bool, OperatorCount> vibrato_{};
+    std::array<bool, OperatorCount> sustained_{};
+    std::array<bool, OperatorCount> keyScaleRate_{};
+    std::array<std::uint8_t, OperatorCount> multiple_{};
+    std::array<std::uint8_t, OperatorCount> keyScaleLevel_{};
+    std::array<std::uint8_t, OperatorCount> totalLevel_{};
+    std::array<std::uint8_t, OperatorCount> attackRate_{};
+    std::array<std::uint8_t, OperatorCount> decayRate_{};
+    std::array<std::uint8_t, OperatorCount> releaseRate_{};
+    std::array<std::uint8_t, OperatorCount> waveform_{};
+
+    std::array<std::uint16_t, ChannelCount> frequency_{};
+    std::array<std::uint8_t, ChannelCount> block_{};
+    std::array<std::uint8_t, ChannelCount> feedback_{};
+    std::array<std::uint8_t, ChannelCount> additive_{};
+    std::array<std::uint8_t, ChannelCount> fourOpRole_{};
+    std::array<std::int32_t, ChannelCount> left_{};
+    std::array<std::int32_t, ChannelCount> right_{};
+    std::array<std::int32_t, ChannelCount> output_{};
+    std::array<std::int32_t, ChannelCount> previous_{};
+};
+
+// The Ad Lib / OPL3 voice manager of YAMAHA.INC (AIL 2), driving an opl_chip
+// register by register: BNK and OPL3BNK timbres, the 16/20 virtual voice
+// slots, circular voice assignment, and priority-based voice stealing.
+class adlib_driver
+{
+public:
+    adlib_driver(opl_chip& chip, bool opl3)
+        : chip_(chip), opl3_(opl3), voiceCount_(opl3 ? 18 : 9), slotCount_(opl3 ? 20 : 16)
+    {
+        reset_synth();
+
+        midiTimbre_.fill(-1);
+        midiProgram_.fill(Unset);
+        rbsTimbres_.fill(-1);
+        voiceChannel_.fill(-1);
+        voice_.fill(-1);
+
+        // init_driver's default controllers, pitch, and programs. Channels
+        // outside 2-10 keep the same values instead of uninitialized ones.
+        for (std::size_t channel = 0; channel < 16; ++channel)
+        {
+            midiVolume_[channel] = 127;
+            midiPan_[channel] = 64;
+            midiExpression_[channel] = 127;
+            midiPitchHigh_[channel] = 0x40;
+        }
+        for (std::size_t channel = 1; channel <= DefaultPrograms.size(); ++channel)
+        {
+            program_change(channel, DefaultPrograms[channel - 1]);
+        }
+    }
+
+    // install_timbre(): makes a GTL timbre available, and selects it in the
+    // channels whose program and bank already request it.
+    void install_timbre(std::uint8_t bank, std::uint8_t patch, std::span<const std::uint8_t> data)
+    {
+        int index = index_timbre(bank, patch);
+        if (index == -1)
+        {
+            index = static_cast<int>(cache_.size());
+            cache_.push_back({patch, bank, data});
+        }
+        for (std::size_t channel = 0; channel < 16; ++channel)
+        {
+            if (midiProgram_[channel] == patch && midiBank_[channel] == bank)
+            {
+                midiTimbre_[channel] = index;
+            }
+        }
+    }
+
+    void send_message(std::uint8_t status, std::uint8_t data1, std::uint8_t data2)
+    {
+        const std::size_t channel = status & 0x0F;
+        switch (status & 0xF0)
+        {
+        case 0x80:
+            note_off(channel, data1);
+            break;
+        case 0x90:
+            if (channel < FirstNoteChannel || channel > LastNoteChannel)
+            {
+                break;
+            }
+            if (data2 == 0)
+            {
+                note_off(channel, data1);
+            }
+            else
+            {
+                note_on(channel, data1, data2);
+            }
+            break;
+        case 0xB0:
+            control_change(channel, data1, data2);
+            break;
+        case 0xC0:
+            program_change(channel, data1);
+            break;
+        case 0xE0:
+            midiPitchLow_[channel] = data1;
+            midiPitchHigh_[channel] = data2;
+            flag_updates(channel, UpdateFrequency);
+            break;
+        default:
+            break;
+        }
+    }
+
+private:
+    static constexpr std::uint8_t Unset = 0xFF;
+    static constexpr std::size_t MaxSlots = 20;
+    static constexpr std::size_t MaxVoices = 18;
+    // Note On is accepted on 0-based channels MIN_TRUE_CHAN-1 to
+    // MAX_REC_CHAN-1; channel 9 plays the rhythm bank.
+    static constexpr std::size_t FirstNoteChannel = 1;
+    static constexpr std::size_t LastNoteChannel = 9;
+    static constexpr std::size_t RhythmChannel = 9;
+    static constexpr std::uint8_t RhythmBank = 127;
+
+    static constexpr std::uint8_t Free = 0;
+    static constexpr std::uint8_t KeyOn = 1;
+    static constexpr std::uint8_t BnkInstrument = 0;
+    static constexpr std::uint8_t Opl3Instrument = 2;
+    static constexpr std::size_t BnkSize = 14;
+    static constexpr std::size_t Opl3BnkSize = 25;
+
+    static constexpr std::uint8_t UpdateAvekm = 0x80;
+    static constexpr std::uint8_t UpdateKsltl = 0x40;
+    static constexpr std::uint8_t UpdateAdsr = 0x20;
+    static constexpr std::uint8_t UpdateWaveform = 0x10;
+    static constexpr std::uint8_t UpdateFeedback = 0x08;
+    static constexpr std::uint8_t UpdateFrequency = 0x01;
+    static constexpr std::uint8_t UpdateAll = 0xF9;
+    static constexpr std::uint8_t KeyOnBit = 0x20;
+
+    static constexpr std::uint8_t PanRightThreshold = 27;
+    static constexpr std::uint8_t PanLeftThreshold = 100;
+    static constexpr std::uint8_t LeftMask = 0xEF;
+    static constexpr std::uint8_t RightMask = 0xDF;
+
+    static constexpr std::array<std::uint8_t, 8> DefaultPrograms = {68, 48, 95, 78, 41, 3, 110, 122};
+    static constexpr std::array<std::uint8_t, 16> VelocityGraph = {82,  85,  88,  91,  94,  97,  100, 103,
+                                                                   106, 109, 112, 115, 118, 121, 124, 127};
+
+    static constexpr std::array<std::uint16_t, 192> FrequencyTable = {
+        0x02b2, 0x02b4, 0x02b7, 0x02b9, 0x02bc, 0x02be, 0x02c1, 0x02c3, 0x02c6, 0x02c9, 0x02cb, 0x02ce, 0x02d0,
+        0x02d3, 0x02d6, 0x02d8, 0x02db, 0x02dd, 0x02e0, 0x02e3, 0x02e5, 0x02e8, 0x02eb, 0x02ed, 0x02f0, 0x02f3,
+        0x02f6, 0x02f8, 0x02fb, 0x02fe, 0x0301, 0x0303, 0x0306, 0x0309, 0x030c, 0x030f, 0x0311, 0x0314, 0x0317,
+        0x031a, 0x031d, 0x0320, 0x0323, 0x0326, 0x0329, 0x032b, 0x032e, 0x0331, 0x0334, 0x0337, 0x033a, 0x033d,
+        0x0340, 0x0343, 0x0346, 0x0349, 0x034c, 0x034f, 0x0352, 0x0356, 0x0359, 0x035c, 0x035f, 0x0362, 0x0365,
+        0x0368, 0x036b, 0x036f, 0x0372, 0x0375, 0x0378, 0x037b, 0x037f, 0x0382, 0x0385, 0x0388, 0x038c, 0x038f,
+        0x0392, 0x0395, 0x0399, 0x039c, 0x039f, 0x03a3, 0x03a6, 0x03a9, 0x03ad, 0x03b0, 0x03b4, 0x03b7, 0x03bb,
+        0x03be, 0x03c1, 0x03c5, 0x03c8, 0x03cc, 0x03cf, 0x03d3, 0x03d7, 0x03da, 0x03de, 0x03e1, 0x03e5, 0x03e8,
+        0x03ec, 0x03f0, 0x03f3, 0x03f7, 0x03fb, 0x03fe, 0xfe01, 0xfe03, 0xfe05, 0xfe07, 0xfe08, 0xfe0a, 0xfe0c,
+        0xfe0e, 0xfe10, 0xfe12, 0xfe14, 0xfe16, 0xfe18, 0xfe1a, 0xfe1c, 0xfe1e, 0xfe20, 0xfe21, 0xfe23, 0xfe25,
+        0xfe27, 0xfe29, 0xfe2b, 0xfe2d, 0xfe2f, 0xfe31, 0xfe34, 0xfe36, 0xfe38, 0xfe3a, 0xfe3c, 0xfe3e, 0xfe40,
+        0xfe42, 0xfe44, 0xfe46, 0xfe48, 0xfe4a, 0xfe4c, 0xfe4f, 0xfe51, 0xfe53, 0xfe55, 0xfe57, 0xfe59, 0xfe5c,
+        0xfe5e, 0xfe60, 0xfe62, 0xfe64, 0xfe67, 0xfe69, 0xfe6b, 0xfe6d, 0xfe6f, 0xfe72, 0xfe74, 0xfe76, 0xfe79,
+        0xfe7b, 0xfe7d, 0xfe7f, 0xfe82, 0xfe84, 0xfe86, 0xfe89, 0xfe8b, 0xfe8d, 0xfe90, 0xfe92, 0xfe95, 0xfe97,
+        0xfe99, 0xfe9c, 0xfe9e, 0xfea1, 0xfea3, 0xfea5, 0xfea8, 0xfeaa, 0xfead, 0xfeaf};
+
+    // First and second operator cells of each voice, and each cell's
+    // register offset and array.
+    static constexpr std::array<std::uint8_t, 18> Operator0 = {0,  1,  2,  6,  7,  8,  12, 13, 14,
+                                                               18, 19, 20, 24, 25, 26, 30, 31, 32};
+    static constexpr std::array<std::uint8_t, 18> Operator1 = {3,  4,  5,  9,  10, 11, 15, 16, 17,
+                                                               21, 22, 23, 27, 28, 29, 33, 34, 35};
+    static constexpr std::array<std::uint8_t, 18> OperatorOffset = {0, 1, 2, 3, 4, 5, 8, 9, 10,
+                                                                    11, 12, 13, 16, 17, 18, 19, 20, 21};
+    static constexpr std::array<bool, 18> FourOpBase = {true, true, true, false, false, false, false, false, false,
+                                                        true, true, true, false, false, false, false, false, false};
+    static constexpr std::array<std::int8_t, 18> AlternateVoice = {3,  4,  5,  0, 1, 2,  -1, -1, -1,
+                                                                   12, 13, 14, 9, 10, 11, -1, -1, -1};
+    static constexpr std::array<std::uint8_t, 18> ConnectionSelect = {1, 2,  4,  1, 2,  4,  0, 0, 0,
+                                                                      8, 16, 32, 8, 16, 32, 0, 0, 0};
+    static constexpr std::array<std::uint8_t, 6> FourOpVoices = {0, 1, 2, 9, 10, 11};
+    // Operators scaled by volume (bit 0 first, bit 1 second) for each
+    // four-operator algorithm.
+    static constexpr std::array<std::uint8_t, 4> Carrier01 = {0, 1, 2, 1};
+    static constexpr std::array<std::uint8_t, 4> Carrier23 = {2, 2, 2, 3};
+
+    struct cached_timbre
+    {
+        std::uint8_t patch = 0;
+        std::uint8_t bank = 0;
+        std::span<const std::uint8_t> data;
+    };
+
+    // The per-pair operator values update_voice() writes.
+    struct operator_pair
+    {
+        std::array<std::uint8_t, 2> avekm{};
+        std::array<std::uint8_t, 2> multiple{};
+        std::array<std::uint8_t, 2> ksltl{};
+        std::array<std::uint8_t, 2> level{};
+        std::array<std::uint8_t, 2> attackDecay{};
+        std::array<std::uint8_t, 2> sustainRelease{};
+        std::uint16_t waveforms = 0;
+        std::uint8_t feedback = 0;
+        std::uint8_t connection = 0;
+        std::uint8_t scale = 0;
+    };
+
+    // array0_init and array1_init, written from register 1 up.
+    void reset_synth()
+    {
+        if (opl3_)
+        {
+            chip_.write(0x105, 1);
+            chip_.write(0x104, 0);
+            connectionShadow_ = 0;
+        }
+        for (std::size_t array = 0; array < (opl3_ ? 2u : 1u); ++array)
+        {
+            const std::uint16_t base = static_cast<std::uint16_t>(array << 8);
+            for (std::uint16_t reg = 0x01; reg <= 0xF5; ++reg)
+            {
+                std::uint8_t value = 0;
+                if (reg >= 0x20 && reg <= 0x95 && (reg & 0x1F) < 0x16)
+                {
+                    value = reg < 0x40 ? 1 : reg < 0x60 ? 63 : reg < 0x80 ? 255 : 15;
+                }
+                else if (array == 0)
+                {
+                    value = reg == 0x01 ? 0x20 : reg == 0x04 ? 0x60 : reg == 0xBD ? 0xC0 : 0;
+                }
+                else if (reg == 0x05)
+                {
+                    value = 1;
+                }
+                chip_.write(static_cast<std::uint16_t>(base | reg), value);
+            }
+        }
+    }
+
+    void write_register(std::size_t cell, std::uint8_t base, std::uint8_t value)
+    {
+        const std::uint16_t array = cell >= 18 ? 0x100 : 0;
+        chip_.write(static_cast<std::uint16_t>(array | (OperatorOffset[cell % 18] + base)), value);
+    }
+
+    void send_byte(std::size_t voice, std::uint8_t base, std::uint8_t value)
+    {
+        const std::uint16_t array = voice >= 9 ? 0x100 : 0;
+        chip_.write(static_cast<std::uint16_t>(array | (voice % 9 + base)), value);
+    }
+
+    int index_timbre(std::uint8_t bank, std::uint8_t patch) const
+    {
+        for (std::size_t index = 0; index < cache_.size(); ++index)
+        {
+            if (cache_[index].bank == bank && cache_[index].patch == patch)
+            {
+                return static_cast<int>(index);
+            }
+        }
+        return -1;
+    }
+
+    void program_change(std::size_t channel, std::uint8_t program)
+    {
+        midiProgram_[channel] = program;
+        midiTimbre_[channel] = index_timbre(midiBank_[channel], program);
+    }
+
+    void control_change(std::size_t channel, std::uint8_t controller, std::uint8_t value)
+    {
+        switch (controller)
+        {
+        case 114: // Patch Bank Select
+            midiBank_[channel] = value;
+            break;
+        case 112: // Voice Protect
+            midiVoiceProtect_[channel] = value;
+            break;
+        case 1:
+            midiModulation_[channel] = value;
+            flag_updates(channel, UpdateAvekm);
+            break;
+        case 7:
+            midiVolume_[channel] = value;
+            flag_updates(channel, UpdateKsltl);
+            break;
+        case 11:
+            midiExpression_[channel] = value;
+            flag_updates(channel, UpdateKsltl);
+            break;
+        case 10:
+            midiPan_[channel] = value;
+            flag_updates(channel, opl3_ ? UpdateFeedback : UpdateKsltl);
+            break;
+        case 64:
+            midiSustain_[channel] = value;
+            if (value < 64)
+            {
+                release_sustain(channel);
+            }
+            break;
+        case 121: // Reset All Controllers
+            midiSustain_[channel] = 0;
+            release_sustain(channel);
+            midiModulation_[channel] = 0;
+            midiExpression_[channel] = 127;
+            midiPitchLow_[channel] = 0;
+            midiPitchHigh_[channel] = 0x40;
+            flag_updates(channel, UpdateAvekm | UpdateKsltl | UpdateFrequency);
+            break;
+        case 123: // All Notes Off
+            for (std::size_t slot = 0; slot < slotCount_; ++slot)
+            {
+                if (status_[slot] == KeyOn && channel_[slot] == channel)
+                {
+                    note_off(channel, note_[slot]);
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    void flag_updates(std::size_t channel, std::uint8_t flags)
+    {
+        for (std::size_t slot = 0; slot < slotCount_; ++slot)
+        {
+            if (status_[slot] != Free && channel_[slot] == channel)
+            {
+                update_[slot] |= flags;
+                update_voice(slot);
+            }
+        }
+    }
+
+    // Note Off for sustained slots. Like the driver, this passes the slot's
+    // sounding note rather than its key number.
+    void release_sustain(std::size_t channel)
+    {
+        for (std::size_t slot = 0; slot < slotCount_; ++slot)
+        {
+            if (status_[slot] != Free && channel_[slot] == channel && sustain_[slot])
+            {
+                note_off(channel, note_[slot]);
+            }
+        }
+    }
+
+    void note_off(std::size_t channel, std::uint8_t note)
+    {
+        for (std::size_t slot = 0; slot < slotCount_; ++slot)
+        {
+            if (status_[slot] != KeyOn || keyNumber_[slot] != note || channel_[slot] != channel)
+            {
+                continue;
+            }
+            if (midiSustain_[channel] >= 64)
+            {
+                sustain_[slot] = true;
+                continue;
+            }
+            release_voice(slot);
+            status_[slot] = Free;
+        }
+    }
+
+    void note_on(std::size_t channel, std::uint8_t note, std::uint8_t velocity)
+    {
+        int index = midiTimbre_[channel];
+        if (channel == RhythmChannel)
+        {
+            index = rbsTimbres_[note];
+            if (index == -1)
+            {
+                index = index_timbre(RhythmBank, note);
+                rbsTimbres_[note] = index;
+            }
+        }
+        if (index == -1)
+        {
+            return;
+        }
+
+        const std::span<const std::uint8_t> timbre = cache_[static_cast<std::size_t>(index)].data;
+        const std::size_t size = timbre[0] | (static_cast<std::size_t>(timbre[1]) << 8);
+        // TVFX timbres need TV_phase, which these drivers leave out; OPL3BNK
+        // timbres only play on the OPL3.
+        if (size != BnkSize && !(size == Opl3BnkSize && opl3_))
+        {
+            return;
+        }
+
+        std::size_t slot = 0;
+        while (slot < slotCount_ && status_[slot] != Free)
+        {
+            ++slot;
+        }
+        if (slot == slotCount_)
+        {
+            return;
+        }
+
+        channel_[slot] = static_cast<std::uint8_t>(channel);
+        keyNumber_[slot] = note;
+        if (channel == RhythmChannel)
+        {
+            note_[slot] = timbre[2];
+            transpose_[slot] = 0;
         }
         else
         {
-            const std::size_t eventSize = channel_event_size(status);
-            if (eventSize == 0)
+            note_[slot] = note;
+            transpose_[slot] = static_cast<std::int8_t>(timbre[2]);
+        }
+        velocity_[slot] = VelocityGraph[velocity >> 3];
+        status_[slot] = KeyOn;
+        sustain_[slot] = false;
+
+        bnk_phase(slot, timbre);
+        if (size == Opl3BnkSize)
+        {
+            opl_phase(slot, timbre);
+        }
+        voice_[slot] = -1;
+        assign_voice(slot);
+    }
+
+    static void load_pair(operator_pair& pair, std::span<const std::uint8_t> timbre, std::size_t first)
+    {
+        for (std::size_t op = 0; op < 2; ++op)
+        {
+            const std::size_t field = first + op * 6;
+            pair.avekm[op] = timbre[field] & 0xF0;
+            pair.multiple[op] = timbre[field] & 0x0F;
+            pair.ksltl[op] = timbre[field + 1] & 0xC0;
+            pair.level[op] = ~timbre[field + 1] & 0x3F;
+            pair.attackDecay[op] = timbre[field + 2];
+            pair.sustainRelease[op] = timbre[field + 3];
+        }
+        pair.waveforms = static_cast<std::uint16_t>(timbre[first + 10] | (timbre[first + 4] << 8));
+        pair.feedback = timbre[first + 5] & 0x0E;
+    }
+
+    void bnk_phase(std::size_t slot, std::span<const std::uint8_t> timbre)
+    {
+        block_[slot] = KeyOnBit;
+        type_[slot] = BnkInstrument;
+        priority_[slot] = 32767;
+
+        operator_pair& pair = pairs_[slot][0];
+        load_pair(pair, timbre, 3);
+        pair.connection = timbre[8] & 1;
+        pair.scale = pair.connection | 2;
+        update_[slot] = UpdateAll;
+    }
+
+    void opl_phase(std::size_t slot, std::span<const std::uint8_t> timbre)
+    {
+        type_[slot] = Opl3Instrument;
+        operator_pair& first = pairs_[slot][0];
+        operator_pair& second = pairs_[slot][1];
+        // The second connection bit comes from bit 7 of the first pair's
+        // feedback/connection byte.
+        const std::uint8_t algorithm = static_cast<std::uint8_t>(first.connection | ((timbre[8] & 0x80) >> 6));
+        first.connection = algorithm;
+        first.scale = Carrier01[algorithm];
+
+        load_pair(second, timbre, 14);
+        second.feedback = 0;
+        second.connection = algorithm >> 1;
+        second.scale = Carrier23[algorithm];
+    }
+
+    void assign_voice(std::size_t slot)
+    {
+        const std::size_t channel = channel_[slot];
+        if (opl3_ && type_[slot] == Opl3Instrument)
+        {
+            int rover = fourOpRover_;
+            for (std::size_t searched = 0;; ++searched)
+            {
+                if (searched == FourOpVoices.size())
+                {
+                    update_priority();
+                    return;
+                }
+                rover = rover + 1 == static_cast<int>(FourOpVoices.size()) ? 0 : rover + 1;
+                fourOpRover_ = rover;
+                const std::size_t voice = FourOpVoices[static_cast<std::size_t>(rover)];
+                if (voiceChannel_[voice] == -1 && voiceChannel_[voice + 3] == -1)
+                {
+                    voice_[slot] = static_cast<std::int8_t>(voice);
+                    voiceChannel_[voice] = static_cast<std::int8_t>(channel);
+                    voiceChannel_[voice + 3] = static_cast<std::int8_t>(channel);
+                    break;
+                }
+            }
+        }
+        else
+        {
+            int rover = twoOpRover_;
+            for (std::size_t searched = 0;; ++searched)
+            {
+                if (searched == voiceCount_)
+                {
+                    update_priority();
+                    return;
+                }
+                rover = rover + 1 == static_cast<int>(voiceCount_) ? 0 : rover + 1;
+                twoOpRover_ = rover;
+                if (voiceChannel_[static_cast<std::size_t>(rover)] == -1)
+                {
+                    voice_[slot] = static_cast<std::int8_t>(rover);
+                    voiceChannel_[static_cast<std::size_t>(rover)] = static_cast<std::int8_t>(channel);
+                    break;
+                }
+            }
+        }
+
+        ++midiVoices_[channel];
+        update_[slot] = UpdateAll;
+        update_voice(slot);
+    }
+
+    void release_voice(std::size_t slot)
+    {
+        if (voice_[slot] == -1)
+        {
+            return;
+        }
+
+        block_[slot] &= static_cast<std::uint8_t>(~KeyOnBit);
+        update_[slot] |= UpdateFrequency;
+        update_voice(slot);
+
+        --midiVoices_[channel_[slot]];
+        const std::size_t voice = static_cast<std::size_t>(voice_[slot]);
+        if (type_[slot] == Opl3Instrument)
+        {
+            voiceChannel_[voice + 3] = -1;
+        }
+        voiceChannel_[voice] = -1;
+        voice_[slot] = -1;
+        status_[slot] = Free;
+    }
+
+    // Gives voices to the highest-priority waiting slots by taking them from
+    // the lowest-priority sounding ones, until no waiting slot outranks a
+    // sounding one.
+    void update_priority()
+    {
+        std::array<std::uint16_t, MaxSlots> adjusted{};
+        std::size_t activeSlots = 0;
+        for (std::size_t slot = 0; slot < slotCount_; ++slot)
+        {
+            if (status_[slot] == Free)
             {
-                ++cursor;
-                expectDelta = true;
                 continue;
             }
+            ++activeSlots;
+            const std::size_t channel = channel_[slot];
+            const std::uint16_t priority = midiVoiceProtect_[channel] >= 64 ? 0xFFFF : priority_[slot];
+            adjusted[slot] =
+                priority > midiVoices_[channel] ? static_cast<std::uint16_t>(priority - midiVoices_[channel]) : 0;
+        }
+
+        for (; activeSlots != 0; --activeSlots)
+        {
+            std::uint16_t high = 0;
+            std::uint16_t low = 0xFFFF;
+            std::uint16_t lowFourOp = 0xFFFF;
+            std::size_t highSlot = slotCount_;
+            std::size_t lowSlot = slotCount_;
+            std::size_t lowFourOpSlot = slotCount_;
+            for (std::size_t slot = 0; slot < slotCount_; ++slot)
+            {
+                if (status_[slot] == Free)
+                {
+                    continue;
+                }
+                const std::uint16_t priority = adjusted[slot];
+                if (voice_[slot] == -1)
+                {
+                    if (priority >= high)
+                    {
+                        high = priority;
+                        highSlot = slot;
+                    }
+                    continue;
+                }
+                if (FourOpBase[static_cast<std::size_t>(voice_[slot])] && priority <= lowFourOp)
+                {
+                    lowFourOp = priority;
+                    lowFourOpSlot = slot;
+                }
+                if (priority <= low)
+                {
+                    low = priority;
+                    lowSlot = slot;
+                }
+            }
+            if (high < low || high == 0 || highSlot == slotCount_)
+            {
+                return;
+            }
+
+            std::size_t victim = lowSlot;
+            if (opl3_ && type_[highSlot] == Opl3Instrument)
+            {
+                if (lowFourOpSlot == slotCount_)
+                {
+                    return;
+                }
+                victim = lowFourOpSlot;
+                // A two-operator victim frees only half of the four-operator
+                // voice; free the slot on the other half too. (The driver
+                // looks the other half up by slot number here.)
+                if (type_[victim] != Opl3Instrument)
+                {
+                    const std::int8_t other = AlternateVoice[static_cast<std::size_t>(voice_[victim])];
+                    for (std::size_t slot = 0; slot < slotCount_; ++slot)
+                    {
+                        if (status_[slot] != Free && voice_[slot] == other)
+                        {
+                            release_voice(slot);
+                            break;
+                        }
+                    }
+                }
+            }
+
+            const std::int8_t voice = voice_[victim];
+            release_voice(victim);
+
+            const std::size_t channel = channel_[highSlot];
+            voice_[highSlot] = voice;
+            ++midiVoices_[channel];
+            voiceChannel_[static_cast<std::size_t>(voice)] = static_cast<std::int8_t>(channel);
+            if (type_[highSlot] == Opl3Instrument)
+            {
+                voiceChannel_[static_cast<std::size_t>(voice) + 3] = static_cast<std::int8_t>(channel);
+            }
+            update_[highSlot] = UpdateAll;
+            update_voice(highSlot);
+        }
+    }
+
+    static std::uint8_t scale_volume(std::uint32_t a, std::uint32_t b)
+    {
+        // (a*b*2)/256 ~= a*b/127, rounded up when nonzero.
+        const std::uint8_t value = static_cast<std::uint8_t>((a * b * 2) >> 8);
+        return value == 0 ? 0 : static_cast<std::uint8_t>(value + 1);
+    }
+
+    void update_voice(std::size_t slot)
+    {
+        if (voice_[slot] == -1)
+        {
+            return;
+        }
+
+        const std::size_t channel = channel_[slot];
+        const std::size_t voice = static_cast<std::size_t>(voice_[slot]);
+        const std::uint8_t flags = update_[slot];
+        std::uint8_t volume = 0;
+        if ((flags & UpdateKsltl) != 0)
+        {
+            volume = scale_volume(scale_volume(midiVolume_[channel], midiExpression_[channel]), velocity_[slot]);
+        }
+
+        const bool fourOp = type_[slot] == Opl3Instrument;
+        if (opl3_)
+        {
+            const std::uint8_t select = ConnectionSelect[voice];
+            const std::uint8_t shadow =
+                fourOp ? connectionShadow_ | select : connectionShadow_ & static_cast<std::uint8_t>(~select);
+            if (shadow != connectionShadow_)
+            {
+                connectionShadow_ = shadow;
+                chip_.write(0x104, shadow);
+                if (!fourOp)
+                {
+                    // Silence the other half of the old four-operator voice.
+                    const std::size_t other = static_cast<std::size_t>(AlternateVoice[voice]);
+                    write_register(Operator0[other], 0x80, 0x0F);
+                    write_register(Operator1[other], 0x80, 0x0F);
+                    send_byte(other, 0xB0, 0);
+                }
+            }
+        }
+
+        if (fourOp)
+        {
+            write_pair(slot, voice + 3, pairs_[slot][1], flags, volume, false);
+        }
+        write_pair(slot, voice, pairs_[slot][0], flags, volume, true);
+        update_[slot] = 0;
+    }
 
-            begin_event();
-            const std::uint8_t eventStatus = cursor[0];
-            const std::uint8_t eventNote = eventSize > 1 ? cursor[1] : 0;
-            append_bytes(midi, cursor, eventEnd, eventSize);
+    void write_pair(std::size_t slot, std::size_t voice, const operator_pair& pair, std::uint8_t flags,
+                    std::uint8_t volume, bool frequency)
+    {
+        const std::size_t channel = channel_[slot];
+        const std::array<std::size_t, 2> cells = {Operator0[voice], Operator1[voice]};
 
-            if ((eventStatus & 0xF0) == 0x90)
+        if ((flags & UpdateAvekm) != 0)
+        {
+            const std::uint8_t vibrato = midiModulation_[channel] >= 64 ? 0x40 : 0;
+            for (std::size_t op = 0; op < 2; ++op)
+            {
+                write_register(cells[op], 0x20, pair.multiple[op] | vibrato | pair.avekm[op]);
+            }
+        }
+        if ((flags & UpdateKsltl) != 0)
+        {
+            for (std::size_t op = 0; op < 2; ++op)
+            {
+                std::uint32_t level = pair.level[op];
+                if ((pair.scale >> op & 1) != 0)
+                {
+                    level = level * volume / 127;
+                }
+                write_register(cells[op], 0x40, static_cast<std::uint8_t>((~level & 0x3F) | pair.ksltl[op]));
+            }
+        }
+        if ((flags & UpdateAdsr) != 0)
+        {
+            write_register(cells[0], 0x60, pair.attackDecay[0]);
+            write_register(cells[1], 0x60, pair.attackDecay[1]);
+            write_register(cells[0], 0x80, pair.sustainRelease[0]);
+            write_register(cells[1], 0x80, pair.sustainRelease[1]);
+        }
+        if ((flags & UpdateWaveform) != 0)
+        {
+            write_register(cells[1], 0xE0, static_cast<std::uint8_t>(pair.waveforms & 0xFF));
+            write_register(cells[0], 0xE0, static_cast<std::uint8_t>(pair.waveforms >> 8));
+        }
+        if ((flags & UpdateFeedback) != 0)
+        {
+            std::uint8_t value = pair.feedback | (pair.connection & 1);
+            if (opl3_)
             {
-                queue_note_off(read_varlen(cursor, eventEnd), eventStatus, eventNote);
+                value |= 0x30;
+                if (midiPan_[channel] <= PanRightThreshold)
+                {
+                    value &= RightMask;
+                }
+                else if (midiPan_[channel] >= PanLeftThreshold)
+                {
+                    value &= LeftMask;
+                }
             }
+            send_byte(voice, 0xC0, value);
+        }
+        if ((flags & UpdateFrequency) != 0 && frequency)
+        {
+            write_frequency(slot, voice);
         }
     }
 
-    const std::size_t trackLength = midi.size() - TrackDataOffset;
-    if (trackLength > std::numeric_limits<std::uint32_t>::max())
+    void write_frequency(std::size_t slot, std::size_t voice)
     {
-        throw std::runtime_error("MIDI track is too large");
+        if ((block_[slot] & KeyOnBit) == 0)
+        {
+            send_byte(voice, 0xB0, frequencyShadow_[slot] & static_cast<std::uint8_t>(~KeyOnBit));
+            return;
+        }
+
+        const std::size_t channel = channel_[slot];
+        const std::int32_t bend = ((midiPitchHigh_[channel] << 7) | midiPitchLow_[channel]) - 0x2000;
+        std::int32_t pitch = (bend >> 5) * 12;
+
+        std::int32_t note = note_[slot] + transpose_[slot] - 24;
+        do
+        {
+            note += 12;
+        } while (note < 0);
+        note += 12;
+        do
+        {
+            note -= 12;
+        } while (note > 95);
+
+        pitch = (pitch + note * 256 + 8) >> 4;
+        pitch -= 12 * 16;
+        do
+        {
+            pitch += 12 * 16;
+        } while (pitch < 0);
+        pitch += 12 * 16;
+        do
+        {
+            pitch -= 12 * 16;
+        } while (pitch > 96 * 16 - 1);
+
+        const std::size_t key = static_cast<std::size_t>(pitch >> 4);
+        std::int32_t number = static_cast<std::int16_t>(FrequencyTable[(key % 12) * 16 + (pitch & 15)]);
+        std::int32_t octave = static_cast<std::int32_t>(key / 12) - 1;
+        if (number < 0)
+        {
+            ++octave;
+        }
+        if (octave < 0)
+        {
+            ++octave;
+            number >>= 1;
+        }
+
+        const std::uint8_t high = static_cast<std::uint8_t>(((number >> 8) & 3) | (octave << 2));
+        send_byte(voice, 0xA0, static_cast<std::uint8_t>(number & 0xFF));
+        frequencyShadow_[slot] = high | block_[slot];
+        send_byte(voice, 0xB0, frequencyShadow_[slot]);
     }
 
-    patch_be32(midi, TrackLengthOffset, static_cast<std::uint32_t>(trackLength));
-    return midi;
+    opl_chip& chip_;
+    bool opl3_ = false;
+    std::size_t voiceCount_ = 0;
+    std::size_t slotCount_ = 0;
+    int twoOpRover_ = -1;
+    int fourOpRover_ = -1;
+    std::uint8_t connectionShadow_ = 0;
+    std::vector<cached_timbre> cache_;
+    std::array<int, 128> rbsTimbres_{};
+
+    std::array<std::uint8_t, 16> midiVolume_{};
+    std::array<std::uint8_t, 16> midiPan_{};
+    std::array<std::uint8_t, 16> midiExpression_{};
+    std::array<std::uint8_t, 16> midiModulation_{};
+    std::array<std::uint8_t, 16> midiSustain_{};
+    std::array<std::uint8_t, 16> midiVoiceProtect_{};
+    std::array<std::uint8_t, 16> midiPitchLow_{};
+    std::array<std::uint8_t, 16> midiPitchHigh_{};
+    std::array<std::uint8_t, 16> midiBank_{};
+    std::array<std::uint8_t, 16> midiProgram_{};
+    std::array<int, 16> midiTimbre_{};
+    std::array<std::uint16_t, 16> midiVoices_{};
+    std::array<std::int8_t, MaxVoices> voiceChannel_{};
+
+    std::array<std::uint8_t, MaxSlots> status_{};
+    std::array<std::uint8_t, MaxSlots> type_{};
+    std::array<std::int8_t, MaxSlots> voice_{};
+    std::array<std::uint8_t, MaxSlots> channel_{};
+    std::array<std::uint8_t, MaxSlots> keyNumber_{};
+    std::array<std::uint8_t, MaxSlots> note_{};
+    std::array<std::int8_t, MaxSlots> transpose_{};
+    std::array<std::uint8_t, MaxSlots> velocity_{};
+    std::array<bool, MaxSlots> sustain_{};
+    std::array<std::uint8_t, MaxSlots> update_{};
+    std::array<std::uint8_t, MaxSlots> block_{};
+    std::array<std::uint8_t, MaxSlots> frequencyShadow_{};
+    std::array<std::uint16_t, MaxSlots> priority_{};
+    std::array<std::array<operator_pair, 2>, MaxSlots> pairs_{};
+};
 }
 
-inline std::vector<std::uint8_t> convert(std::span<const std::uint8_t> xmi)
+namespace detail
 {
-    return convert(xmi, 0);
+inline std::vector<std::uint8_t> wav_header(std::uint16_t channels, std::uint32_t sampleRate, std::size_t dataBytes)
+{
+    if (dataBytes > std::numeric_limits<std::uint32_t>::max() - 36)
+    {
+        detail::fail("WAV data is too large");
+    }
+
+    std::vector<std::uint8_t> header;
+    header.reserve(44);
+    append_tag(header, "RIFF");
+    append_le32(header, static_cast<std::uint32_t>(36 + dataBytes));
+    append_tag(header, "WAVE");
+    append_tag(header, "fmt ");
+    append_le32(header, 16);
+    append_le16(header, 1);
+    append_le16(header, channels);
+    append_le32(header, sampleRate);
+    append_le32(header, sampleRate * channels * 2);
+    append_le16(header, static_cast<std::uint16_t>(channels * 2));
+    append_le16(header, 16);
+    append_tag(header, "data");
+    append_le32(header, static_cast<std::uint32_t>(dataBytes));
+    return header;
+}
 }
 
-inline std::vector<std::vector<std::uint8_t>> convert_all(std::span<const std::uint8_t> xmi)
+// Plays one sequence through the AIL Ad Lib driver on an emulated OPL2 or
+// OPL3 and returns a 16-bit PCM WAV file, mono for OPL2 and stereo for OPL3.
+// As in XPLAY, the sequence's TIMB requests are installed from 'gtl' before
+// it starts; requests the library lacks stay silent.
+inline std::vector<std::uint8_t> render_wav(std::span<const std::uint8_t> xmi, std::size_t sequenceIndex,
+                                            std::span<const std::uint8_t> gtl, const opl_render_options& options = {})
 {
+    if (options.sample_rate == 0)
+    {
+        detail::fail("Invalid sample rate");
+    }
+
+    const bool opl3 = options.chip == opl_chip_type::opl3;
+    const std::vector<global_timbre> library = global_timbres(gtl);
+    sequencer engine(xmi, sequenceIndex);
+    detail::opl_chip chip(opl3);
+    detail::adlib_driver driver(chip, opl3);
+
     const auto sequences = sequence_infos(xmi);
-    std::vector<std::vector<std::uint8_t>> midis;
-    midis.reserve(sequences.size());
+    for (const timbre_request request : timbres(xmi, sequences[sequenceIndex]))
+    {
+        const auto found = std::find_if(library.begin(), library.end(), [request](const global_timbre& timbre)
+                                        { return timbre.bank == request.bank && timbre.patch == request.patch; });
+        if (found != library.end())
+        {
+            driver.install_timbre(found->bank, found->patch, found->data);
+        }
+    }
+
+    constexpr std::uint64_t NativeRate = detail::opl_chip::NativeRate;
+    const std::uint64_t outputRate = options.sample_rate;
+    const std::size_t outputChannels = opl3 ? 2 : 1;
+
+    std::vector<std::uint8_t> wav(44);
+    std::vector<std::int16_t> frames;
+    std::array<std::int32_t, 2> previous{};
+    std::uint64_t nativeFrame = 0;
+    std::uint64_t outputFrame = 0;
+
+    // Renders one 120 Hz interval and resamples it linearly: output frame k
+    // sits at native time k * NativeRate / outputRate.
+    std::uint64_t renderedTicks = 0;
+    const auto render_tick = [&]
+    {
+        const std::uint64_t end = (renderedTicks + 1) * NativeRate / sequencer::TicksPerSecond;
+        const std::size_t count = static_cast<std::size_t>(end - renderedTicks * NativeRate / sequencer::TicksPerSecond);
+        ++renderedTicks;
+        frames.resize(count * 2);
+        chip.generate(frames.data(), count);
 
-    for (const sequence_info& sequence : sequences)
+        for (std::size_t frame = 0; frame < count; ++frame, ++nativeFrame)
+        {
+            const std::array<std::int32_t, 2> current = {frames[frame * 2], frames[frame * 2 + 1]};
+            while (outputFrame * NativeRate <= nativeFrame * outputRate)
+            {
+                const std::int64_t numerator = static_cast<std::int64_t>(outputFrame * NativeRate) -
+                                               (static_cast<std::int64_t>(nativeFrame) - 1) *
+                                                   static_cast<std::int64_t>(outputRate);
+                for (std::size_t channel = 0; channel < outputChannels; ++channel)
+                {
+                    const std::int64_t sample =
+                        previous[channel] +
+                        (current[channel] - previous[channel]) * numerator / static_cast<std::int64_t>(outputRate);
+                    detail::append_le16(wav, static_cast<std::uint16_t>(static_cast<std::int16_t>(sample)));
+                }
+                ++outputFrame;
+            }
+            previous = current;
+        }
+    };
+
+    while (!engine.done() && engine.tick() < options.max_ticks)
     {
-        midis.push_back(convert(xmi, sequence.index));
+        engine.serve();
+        for (const trace_event& event : engine.trace())
+        {
+            if (event.kind == trace_kind::midi)
+            {
+                driver.send_message(event.status, event.data1, event.data2);
+            }
+        }
+        engine.clear_trace();
+        render_tick();
+    }
+    for (std::uint32_t tail = 0; tail < options.tail_ticks && !chip.silent(); ++tail)
+    {
+        render_tick();
     }
 
-    return midis;
+    const std::vector<std::uint8_t> header =
+        detail::wav_header(static_cast<std::uint16_t>(outputChannels), options.sample_rate, wav.size() - 44);
+    std::copy(header.begin(), header.end(), wav.begin());
+    return wav;
 }
+#endif
 }
 
 #endif